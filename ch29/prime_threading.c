@@ -0,0 +1,352 @@
+/*
+  Counting (or listing) the primes up to some limit with several threads:
+  a segmented Sieve of Eratosthenes.
+
+  Usage: prime_threading [-t threads] [-s segment-KiB] [-p] [-S] limit
+
+  'limit' may be written as, e.g., 1e10. The primes up to it are counted
+  by 'threads' threads (default 4), and the time taken and primes found
+  per second printed; with -S, by 1, 2, 4, ... threads up to 'threads',
+  one run after another, to show how it scales. With -p they are also
+  printed, in order, one per line.
+
+  The sieve:
+
+    Odd numbers only, one bit each: bit i stands for 2i + 1. Even numbers
+    are never stored, which halves the memory and the work.
+
+    Segments: the bits are sieved a segment (default 32 KiB, to fit the
+    L1 cache) at a time, so however large 'limit' is, memory is bounded
+    by the segment size (and by the primes up to sqrt(limit), which do
+    the sieving). Each segment crosses off the multiples of every sieving
+    prime while the segment is in cache, instead of each prime sweeping
+    the whole range.
+
+    A wheel: the multiples of 3, 5, 7, 11 and 13 repeat every 15015 odd
+    numbers, so rather than crossing them off, each segment starts as a
+    copy of a precomputed pattern of that period (15015 bytes, 8 periods,
+    so the pattern always starts on a byte boundary). Only primes from 17
+    up are sieved, which saves about half the crossing off.
+
+    Threads: segments are grouped into chunks of CHUNK_SEGMENTS, and each
+    thread takes the next unclaimed chunk until there are none left, so a
+    thread that falls behind (or shares a CPU) simply takes fewer. For
+    each chunk a thread works out, once, where each prime's next multiple
+    falls, and carries that from segment to segment. The threads share
+    nothing but the chunk counter and, with -p, a turn counter that makes
+    them print their chunks in order (each keeps its chunk's bits until
+    its turn comes).
+*/
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include "../lib/tlpi_hdr.h"
+
+#define WHEEL_BYTES     15015       // 3 * 5 * 7 * 11 * 13
+#define CHUNK_SEGMENTS  8
+#define MAX_LIMIT       1000000000000000ULL     // 1e15
+
+static const unsigned wheel_primes[] = { 3, 5, 7, 11, 13 };
+#define NWHEEL (sizeof(wheel_primes) / sizeof(wheel_primes[0]))
+
+static uint8_t wheel[WHEEL_BYTES];  // bit i: 2i + 1 is prime to the wheel
+
+static uint64_t limit;
+static uint64_t max_index;          // of the bit for the largest odd <= limit
+static uint32_t *primes;            // the sieving primes, 17..sqrt(limit)
+static size_t nprimes;
+static size_t seg_bytes, seg_bits;
+static uint64_t nchunks;
+static int enumerate;
+
+static uint64_t next_chunk;         // the next to claim, atomically
+
+static pthread_mutex_t turn_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t turn_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t turn;               // the chunk whose primes print next
+
+typedef struct thread_args {
+    pthread_t tid;
+    uint64_t count;
+} thread_args;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t isqrt(uint64_t n) {
+    uint64_t r = 0, bit = (uint64_t) 1 << 62;
+
+    while (bit > n)
+        bit >>= 2;
+    while (bit != 0) {
+        if (n >= r + bit) {
+            n -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+        bit >>= 2;
+    }
+    return r;
+}
+
+static uint64_t get_limit(const char *arg) {
+    double d;
+    char *end;
+
+    if (strpbrk(arg, "eE") == NULL)
+        return getLong(arg, GN_GT_0, "limit");
+    d = strtod(arg, &end);
+    if (*end != '\0' || d < 1 || d > (double) MAX_LIMIT ||
+            d != (double) (uint64_t) d)
+        cmdLineErr("bad limit: %s\n", arg);
+    return (uint64_t) d;
+}
+
+static void make_wheel(void) {
+    size_t i, j;
+
+    memset(wheel, 0xff, WHEEL_BYTES);
+    for (j = 0; j < NWHEEL; j++)    // 2i + 1 = p (2k + 1): i = k p + p / 2
+        for (i = wheel_primes[j] / 2; i < WHEEL_BYTES * 8;
+             i += wheel_primes[j])
+            wheel[i / 8] &= ~(1 << (i % 8));
+}
+
+/* The primes from 17 to sqrt(limit), by a plain sieve */
+static void make_primes(void) {
+    uint64_t root = isqrt(limit), i, j;
+    uint8_t *composite = calloc(root + 1, 1);
+
+    if (composite == NULL) errExit("calloc");
+    primes = malloc((root / 2 + 1) * sizeof(uint32_t));
+    if (primes == NULL) errExit("malloc");
+    nprimes = 0;
+    for (i = 3; i <= root; i += 2) {
+        if (composite[i]) continue;
+        if (i >= 17) primes[nprimes++] = i;
+        for (j = i * i; j <= root; j += 2 * i)
+            composite[j] = 1;
+    }
+    free(composite);
+}
+
+/* next[k]: the index of the first odd multiple of primes[k] at or after
+   index 'lo' still to cross off (none below its square) */
+static void start_chunk(uint64_t lo, uint64_t *next) {
+    uint64_t n = 2 * lo + 1, p, m;
+    size_t k;
+
+    for (k = 0; k < nprimes; k++) {
+        p = primes[k];
+        m = (n + p - 1) / p * p;
+        if (m % 2 == 0) m += p;
+        if (m < p * p) m = p * p;
+        next[k] = (m - 1) / 2;
+    }
+}
+
+/* Sieve the 'nbits' bits from index 'lo' into 'seg'; returns the number of
+   primes among them */
+static uint64_t sieve_segment(uint8_t *seg, uint64_t lo, size_t nbits,
+                              uint64_t *next) {
+    size_t nbytes = (nbits + 7) / 8, off, n, i, j, k;
+    uint64_t word, count = 0;
+    uint32_t p;
+
+    // The wheel, from where 'lo' falls in it, round and round
+    off = lo / 8 % WHEEL_BYTES;
+    for (i = 0; i < nbytes; i += n) {
+        n = WHEEL_BYTES - off < nbytes - i ? WHEEL_BYTES - off : nbytes - i;
+        memcpy(seg + i, wheel + off, n);
+        off = 0;
+    }
+    if (lo == 0) seg[0] &= ~1;      // 1 isn't prime
+
+    // j counts from the start of the segment, not of the whole sieve
+    for (k = 0; k < nprimes; k++) {
+        if (next[k] >= lo + nbits) continue;
+        p = primes[k];
+        for (j = next[k] - lo; j < nbits; j += p)
+            seg[j / 8] &= ~(1 << (j % 8));
+        next[k] = lo + j;
+    }
+
+    // Clear the bits past the end, up to a whole word, and count
+    if (nbits % 8 != 0) seg[nbytes - 1] &= (1 << (nbits % 8)) - 1;
+    memset(seg + nbytes, 0, (8 - nbytes % 8) % 8);
+    for (i = 0; i < nbytes; i += 8) {
+        memcpy(&word, seg + i, 8);
+        count += __builtin_popcountll(word);
+    }
+    return count;
+}
+
+/* Write the primes of a chunk (its bits from index 'lo') to stdout */
+static void print_chunk(const uint8_t *bits, uint64_t lo, size_t nbits,
+                        int first) {
+    char buf[65536], digits[24];
+    size_t len = 0, i, d;
+    uint64_t n;
+    int b;
+
+    for (i = 0; first && i < NWHEEL + 1; i++) {
+        n = i == 0 ? 2 : wheel_primes[i - 1];
+        if (n <= limit) len += sprintf(buf + len, "%u\n", (unsigned) n);
+    }
+    for (i = 0; i < nbits; i += 8) {
+        if (bits[i / 8] == 0) continue;
+        for (b = 0; b < 8; b++) {
+            if (!(bits[i / 8] & (1 << b))) continue;
+            n = 2 * (lo + i + b) + 1;
+            d = sizeof(digits);
+            digits[--d] = '\n';
+            do {
+                digits[--d] = '0' + n % 10;
+                n /= 10;
+            } while (n != 0);
+            memcpy(buf + len, digits + d, sizeof(digits) - d);
+            len += sizeof(digits) - d;
+            if (len > sizeof(buf) - sizeof(digits)) {
+                fwrite(buf, 1, len, stdout);
+                len = 0;
+            }
+        }
+    }
+    fwrite(buf, 1, len, stdout);
+}
+
+static void *worker(void *arg) {
+    thread_args *a = arg;
+    size_t chunk_bits = CHUNK_SEGMENTS * seg_bits, nbits, s;
+    uint64_t c, lo, seg_lo, *next;
+    uint8_t *bits;
+
+    // With -p, the whole chunk is kept until it can be printed
+    bits = malloc(enumerate ? CHUNK_SEGMENTS * seg_bytes : seg_bytes);
+    next = malloc((nprimes + 1) * sizeof(uint64_t));
+    if (bits == NULL || next == NULL) errExit("malloc");
+
+    while ((c = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED))
+            < nchunks) {
+        lo = c * chunk_bits;
+        start_chunk(lo, next);
+        for (s = 0; s < CHUNK_SEGMENTS; s++) {
+            seg_lo = lo + s * seg_bits;
+            if (seg_lo > max_index) break;
+            nbits = max_index - seg_lo + 1 < seg_bits ?
+                    max_index - seg_lo + 1 : seg_bits;
+            a->count += sieve_segment(enumerate ? bits + s * seg_bytes :
+                                      bits, seg_lo, nbits, next);
+        }
+
+        if (enumerate) {
+            pthread_mutex_lock(&turn_mutex);
+            while (turn != c)
+                pthread_cond_wait(&turn_cond, &turn_mutex);
+            pthread_mutex_unlock(&turn_mutex);
+
+            nbits = max_index - lo + 1 < chunk_bits ?
+                    max_index - lo + 1 : chunk_bits;
+            print_chunk(bits, lo, nbits, c == 0);
+
+            pthread_mutex_lock(&turn_mutex);
+            turn++;
+            pthread_cond_broadcast(&turn_cond);
+            pthread_mutex_unlock(&turn_mutex);
+        }
+    }
+
+    free(bits);
+    free(next);
+    return NULL;
+}
+
+/* Count the primes up to 'limit' with 'nthreads' threads */
+static uint64_t count_primes(unsigned nthreads) {
+    thread_args *args = calloc(nthreads, sizeof(thread_args));
+    uint64_t count = 0;
+    unsigned i;
+    int s;
+
+    if (args == NULL) errExit("calloc");
+    next_chunk = 0;
+    turn = 0;
+    for (i = 0; i < nthreads; i++) {
+        s = pthread_create(&args[i].tid, NULL, worker, &args[i]);
+        if (s != 0) errExitEN(s, "pthread_create");
+    }
+    for (i = 0; i < nthreads; i++) {
+        s = pthread_join(args[i].tid, NULL);
+        if (s != 0) errExitEN(s, "pthread_join");
+        count += args[i].count;
+    }
+    free(args);
+
+    // 2 and the wheel's primes aren't in the bits
+    for (i = 0; i < NWHEEL; i++)
+        count += wheel_primes[i] <= limit;
+    return count + (limit >= 2);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned nthreads = 4, t, first;
+    int opt, scaling = 0;
+    double t0, secs, base = 0;
+    uint64_t count;
+
+    seg_bytes = 32 * 1024;
+    while ((opt = getopt(argc, argv, "t:s:pS")) != -1) {
+        switch (opt) {
+        case 't': nthreads = getInt(optarg, GN_GT_0, "threads");   break;
+        case 's': seg_bytes = getInt(optarg, GN_GT_0, "segment-KiB") * 1024;
+                  break;
+        case 'p': enumerate = 1;                                   break;
+        case 'S': scaling = 1;                                     break;
+        default:
+            usageErr("%s [-t threads] [-s segment-KiB] [-p] [-S] limit\n",
+                     argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usageErr("%s [-t threads] [-s segment-KiB] [-p] [-S] limit\n",
+                 argv[0]);
+    if (enumerate && scaling)
+        cmdLineErr("-p and -S don't go together\n");
+    limit = get_limit(argv[optind]);
+    if (limit > MAX_LIMIT)
+        cmdLineErr("limit must be at most %llu\n",
+                   (unsigned long long) MAX_LIMIT);
+
+    seg_bits = seg_bytes * 8;
+    max_index = (limit - 1) / 2;
+    nchunks = max_index / (CHUNK_SEGMENTS * seg_bits) + 1;
+    make_wheel();
+    make_primes();
+
+    // The report goes to stderr with -p, out of the way of the primes
+    first = scaling ? 1 : nthreads;
+    for (t = first; t <= nthreads; t = t < nthreads && 2 * t > nthreads ?
+                                       nthreads : 2 * t) {
+        t0 = now();
+        count = count_primes(t);
+        secs = now() - t0;
+        if (t == first) {
+            fprintf(enumerate ? stderr : stdout,
+                    "%llu primes up to %llu\n%-8s %10s %14s %8s\n",
+                    (unsigned long long) count, (unsigned long long) limit,
+                    "threads", "seconds", "primes/s", "speedup");
+            base = secs;
+        }
+        fprintf(enumerate ? stderr : stdout, "%-8u %10.3f %14.0f %8.2f\n",
+                t, secs, count / secs, base / secs);
+    }
+
+    free(primes);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,370 @@
+/*
+  A balanced alternative to binary_tree.c.
+
+  binary_tree.c never rebalances, so keys that arrive in order (as in
+  bt_demo, which adds 1..99) build a linked list, and every operation
+  costs O(n). Here the tree is kept AVL-balanced: after each add() or
+  delete(), the heights along the path back to the root are recomputed
+  and any node whose subtrees differ in height by 2 is fixed with one or
+  two rotations, so the height never exceeds about 1.44 log2(n).
+
+  Writers are serialised by the tree's mutex. Fine-grained locking would
+  let writers in disjoint subtrees run in parallel, but the rotations work
+  bottom-up, against the top-down order that lock coupling relies on, and
+  balanced concurrent trees that avoid this (relaxed AVL, chromatic trees)
+  need far more machinery. Every change is local, however -- a rotation
+  touches three links -- and readers don't take the mutex at all.
+
+  avl_lookup() is lock-free in the same way as lookup() in binary_tree.c
+  (see there): each node carries a sequence counter that writers make odd
+  while they change it, and readers validate each node, and the link to
+  it, as they go, restarting from the root if anything moved. A rotation
+  bumps the counters of the two nodes it turns and of the parent link,
+  and moves whole subtrees without changing what they contain, so a
+  reader already inside one of those subtrees is still on the right path.
+  As in binary_tree.c, the one exception is a two-child delete moving the
+  successor's key up, which is covered by the tree's 'moves' counter, and
+  unlinked nodes are kept on a free list rather than freed, so that a
+  stale reader never touches freed memory.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "avl_tree.h"
+#include "seqlock.h"
+
+#define AVL_MAX_HEIGHT 64           // enough for more nodes than memory
+
+static void die(int err, const char *what) {
+    fprintf(stderr, "avl_tree: %s: %s\n", what, strerror(err));
+    abort();
+}
+
+static void lock_tree(avl_tree *tree) {
+    int s = pthread_mutex_lock(&tree->mutex);
+    if (s != 0) { die(s, "pthread_mutex_lock"); }
+}
+
+static void unlock_tree(avl_tree *tree) {
+    int s = pthread_mutex_unlock(&tree->mutex);
+    if (s != 0) { die(s, "pthread_mutex_unlock"); }
+}
+
+avl_tree *avl_initialize(void) {
+    avl_tree *tree = calloc(1, sizeof(avl_tree));
+    if (tree == NULL) { die(ENOMEM, "calloc"); }
+    tree->root = NULL;
+    tree->node_count = 0;
+    tree->free_list = NULL;
+    pthread_mutex_init(&tree->mutex, NULL);
+    return tree;
+}
+
+// the caller holds the tree's mutex
+static avl_node *create_node(avl_tree *tree, Key key, int value) {
+    avl_node *result = tree->free_list;
+
+    if (result != NULL) {
+        tree->free_list = result->right;
+    } else {
+        result = calloc(1, sizeof(avl_node));
+        if (result == NULL) { die(ENOMEM, "calloc"); }
+    }
+    STORE(result->left, NULL);
+    STORE(result->right, NULL);
+    STORE(result->key, key);
+    STORE(result->value, value);
+    result->height = 1;
+    return result;
+}
+
+// the caller holds the tree's mutex, and has bumped the node's counter
+static void free_node(avl_tree *tree, avl_node *node) {
+    STORE(node->right, tree->free_list);
+    tree->free_list = node;
+}
+
+static void destroy_subtree(avl_node *node) {
+    if (node == NULL) return;
+    destroy_subtree(node->left);
+    destroy_subtree(node->right);
+    free(node);
+}
+
+void avl_destroy(avl_tree *tree) {
+    avl_node *node;
+
+    destroy_subtree(tree->root);
+    while ((node = tree->free_list) != NULL) {
+        tree->free_list = node->right;
+        free(node);
+    }
+    pthread_mutex_destroy(&tree->mutex);
+    free(tree);
+}
+
+size_t avl_size(avl_tree *tree) {
+    return __atomic_load_n(&tree->node_count, __ATOMIC_RELAXED);
+}
+
+static int height(const avl_node *node) {
+    return node != NULL ? node->height : 0;
+}
+
+int avl_height(avl_tree *tree) {
+    return height(tree->root);
+}
+
+static void fix_height(avl_node *node) {
+    int l = height(node->left), r = height(node->right);
+    node->height = (l > r ? l : r) + 1;
+}
+
+/* The link from 'parent' (NULL for the tree itself) to its child 'child',
+   and the counter that guards it */
+
+static avl_node **link_to(avl_tree *tree, avl_node *parent,
+                          const avl_node *child) {
+    if (parent == NULL) return &tree->root;
+    return parent->left == child ? &parent->left : &parent->right;
+}
+
+static unsigned long *seq_of(avl_tree *tree, avl_node *parent) {
+    return parent != NULL ? &parent->version : &tree->version;
+}
+
+/* Make 'child' take the place of 'node' below 'parent' */
+static void replace_child(avl_tree *tree, avl_node *parent,
+                          const avl_node *node, avl_node *child) {
+    unsigned long *pseq = seq_of(tree, parent);
+    avl_node **link = link_to(tree, parent, node);
+
+    write_begin(pseq);
+    STORE(*link, child);
+    write_end(pseq);
+}
+
+/* Rotate 'node' (below 'parent') down to the right, its left child taking
+   its place; returns the new subtree root */
+static avl_node *rotate_right(avl_tree *tree, avl_node *parent,
+                              avl_node *node) {
+    unsigned long *pseq = seq_of(tree, parent);
+    avl_node **link = link_to(tree, parent, node);
+    avl_node *l = node->left;
+
+    write_begin(pseq);
+    write_begin(&node->version);
+    write_begin(&l->version);
+    STORE(node->left, l->right);
+    STORE(l->right, node);
+    STORE(*link, l);
+    write_end(&l->version);
+    write_end(&node->version);
+    write_end(pseq);
+
+    fix_height(node);
+    fix_height(l);
+    return l;
+}
+
+static avl_node *rotate_left(avl_tree *tree, avl_node *parent,
+                             avl_node *node) {
+    unsigned long *pseq = seq_of(tree, parent);
+    avl_node **link = link_to(tree, parent, node);
+    avl_node *r = node->right;
+
+    write_begin(pseq);
+    write_begin(&node->version);
+    write_begin(&r->version);
+    STORE(node->right, r->left);
+    STORE(r->left, node);
+    STORE(*link, r);
+    write_end(&r->version);
+    write_end(&node->version);
+    write_end(pseq);
+
+    fix_height(node);
+    fix_height(r);
+    return r;
+}
+
+/* Restore the balance of path[depth - 1] ... path[0] (path[0] being the
+   root), bottom up, after the subtree below path[depth - 1] changed */
+static void rebalance(avl_tree *tree, avl_node **path, int depth) {
+    avl_node *node, *parent;
+    int i, balance;
+
+    for (i = depth - 1; i >= 0; i--) {
+        node = path[i];
+        parent = i > 0 ? path[i - 1] : NULL;
+        balance = height(node->left) - height(node->right);
+
+        if (balance > 1) {
+            if (height(node->left->left) < height(node->left->right))
+                rotate_left(tree, node, node->left);
+            rotate_right(tree, parent, node);
+        } else if (balance < -1) {
+            if (height(node->right->right) < height(node->right->left))
+                rotate_right(tree, node, node->right);
+            rotate_left(tree, parent, node);
+        } else {
+            fix_height(node);
+        }
+    }
+}
+
+int avl_add(avl_tree *tree, Key key, int value) {
+    avl_node *path[AVL_MAX_HEIGHT], *node, *parent;
+    int depth = 0;
+
+    lock_tree(tree);
+    for (node = tree->root; node != NULL;
+         node = key < node->key ? node->left : node->right) {
+        if (key == node->key) {
+            unlock_tree(tree);
+            return 0;
+        }
+        path[depth++] = node;
+    }
+
+    parent = depth > 0 ? path[depth - 1] : NULL;
+    node = create_node(tree, key, value);
+    write_begin(seq_of(tree, parent));
+    if (parent == NULL)             STORE(tree->root, node);
+    else if (key < parent->key)     STORE(parent->left, node);
+    else                            STORE(parent->right, node);
+    write_end(seq_of(tree, parent));
+
+    rebalance(tree, path, depth);
+    __atomic_add_fetch(&tree->node_count, 1, __ATOMIC_RELAXED);
+    unlock_tree(tree);
+    return 1;
+}
+
+int avl_delete(avl_tree *tree, Key key) {
+    avl_node *path[AVL_MAX_HEIGHT], *node, *succ;
+    int depth = 0;
+
+    lock_tree(tree);
+    for (node = tree->root; node != NULL && key != node->key;
+         node = key < node->key ? node->left : node->right)
+        path[depth++] = node;
+
+    if (node == NULL) {
+        unlock_tree(tree);
+        return 0;
+    }
+
+    if (node->left == NULL || node->right == NULL) {
+        // at most one child, which takes the node's place
+        replace_child(tree, depth > 0 ? path[depth - 1] : NULL, node,
+                      node->left != NULL ? node->left : node->right);
+    } else {
+        /* Two children: the successor (leftmost in the right subtree)
+           moves its key and value into 'node', and is removed instead */
+        path[depth++] = node;
+        for (succ = node->right; succ->left != NULL; succ = succ->left)
+            path[depth++] = succ;
+
+        write_begin(&tree->moves);
+        write_begin(&node->version);
+        STORE(node->key, succ->key);
+        STORE(node->value, succ->value);
+        write_end(&node->version);
+        replace_child(tree, path[depth - 1], succ, succ->right);
+        write_end(&tree->moves);
+
+        node = succ;
+    }
+
+    write_begin(&node->version);    // tell readers it has gone
+    write_end(&node->version);
+    free_node(tree, node);
+
+    rebalance(tree, path, depth);
+    __atomic_sub_fetch(&tree->node_count, 1, __ATOMIC_RELAXED);
+    unlock_tree(tree);
+    return 1;
+}
+
+int avl_lookup(avl_tree *tree, Key key, int *value) {
+    const unsigned long *pseq;      // counter of the node we came from
+    unsigned long pv, v, moves;
+    avl_node *current, *next;
+    Key k;
+    int val;
+
+retry:
+    moves = __atomic_load_n(&tree->moves, __ATOMIC_ACQUIRE);
+    pseq = &tree->version;
+    pv = read_begin(pseq);
+    current = LOAD(tree->root);
+    if (!read_valid(pseq, pv)) goto retry;
+
+    while (current != NULL) {
+        v = read_begin(&current->version);
+        if (!read_valid(pseq, pv))  // did the parent still link to us?
+            goto retry;
+
+        k = LOAD(current->key);
+        if (k == key) {
+            val = LOAD(current->value);
+            if (!read_valid(&current->version, v)) goto retry;
+            if (value != NULL) *value = val;
+            return 1;
+        }
+        next = key < k ? LOAD(current->left) : LOAD(current->right);
+        if (!read_valid(&current->version, v)) goto retry;
+
+        pseq = &current->version;
+        pv = v;
+        current = next;
+    }
+
+    // a key moved up by a concurrent delete() may have eluded us
+    if ((moves & 1) || !read_valid(&tree->moves, moves)) goto retry;
+    return 0;
+}
+
+/* Check ordering, heights and balance of the subtree, all of whose keys
+   must lie in (lo, hi) (where there are such bounds); returns the number
+   of nodes, or -1 if anything is wrong */
+static long verify_subtree(const avl_node *node, int has_lo, Key lo,
+                           int has_hi, Key hi) {
+    long l, r;
+    int hl, hr;
+
+    if (node == NULL) return 0;
+    if ((has_lo && node->key <= lo) || (has_hi && node->key >= hi))
+        return -1;
+    hl = height(node->left);
+    hr = height(node->right);
+    if (node->height != (hl > hr ? hl : hr) + 1 || hl - hr > 1 || hr - hl > 1)
+        return -1;
+    l = verify_subtree(node->left, has_lo, lo, 1, node->key);
+    r = verify_subtree(node->right, 1, node->key, has_hi, hi);
+    return (l < 0 || r < 0) ? -1 : l + r + 1;
+}
+
+int avl_verify(avl_tree *tree) {
+    long n = verify_subtree(tree->root, 0, 0, 0, 0);
+    return n >= 0 && (size_t) n == tree->node_count;
+}
+
+static void *ops_initialize(void) { return avl_initialize(); }
+static void ops_destroy(void *tree) { avl_destroy(tree); }
+static int ops_add(void *tree, Key key, int value) {
+    return avl_add(tree, key, value);
+}
+static int ops_delete(void *tree, Key key) { return avl_delete(tree, key); }
+static int ops_lookup(void *tree, Key key, int *value) {
+    return avl_lookup(tree, key, value);
+}
+static int ops_verify(void *tree) { return avl_verify(tree); }
+
+const tree_ops avl_ops = {
+    "avl", ops_initialize, ops_destroy, ops_add, ops_delete, ops_lookup,
+    ops_verify
+};
@@ -0,0 +1,50 @@
+/*
+  Concurrent AVL tree (see avl_tree.c), with the same operations as
+  binary_tree.h: avl_add(), avl_delete() and avl_lookup() may be called
+  from any number of threads, and avl_lookup() takes no locks. The tree
+  stays balanced whatever the order of the keys.
+*/
+#ifndef AVL_TREE_H
+#define AVL_TREE_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "tree_ops.h"               // Key, and avl_ops for this tree
+
+typedef struct avl_node {
+    Key key;
+    int value;
+    struct avl_node *left;
+    struct avl_node *right;
+    int height;                     // of the subtree; writers only
+    unsigned long version;          // odd while the node is being changed
+} avl_node;
+
+typedef struct avl_tree {
+    avl_node *root;
+    size_t node_count;
+    pthread_mutex_t mutex;          // serialises writers
+    unsigned long version;          // odd while 'root' is being changed
+    unsigned long moves;            // odd while a key moves up (delete())
+    avl_node *free_list;            // unlinked nodes, for reuse
+} avl_tree;
+
+avl_tree *avl_initialize(void);
+void avl_destroy(avl_tree *tree);
+
+// Returns 1 if 'key' was added, 0 if it was already present (unchanged)
+int avl_add(avl_tree *tree, Key key, int value);
+
+// Returns 1 if 'key' was removed, 0 if it wasn't present
+int avl_delete(avl_tree *tree, Key key);
+
+// Returns 1 and sets *value if 'key' is present, else returns 0
+int avl_lookup(avl_tree *tree, Key key, int *value);
+
+size_t avl_size(avl_tree *tree);
+int avl_height(avl_tree *tree);
+
+// Checks ordering, heights, balance and node_count; 1 if all consistent
+int avl_verify(avl_tree *tree);
+
+#endif
@@ -21,274 +21,1156 @@
   tree necessitates moving nodes between subtrees during the add() and delete()
   operations, which requires much more complex locking strategies.
 
+  Locking: add() and delete() walk down from the root using lock coupling
+  ("hand-over-hand"): they lock a child before unlocking its parent, so
+  they never hold more than two node locks (three while delete() looks
+  for a successor). The tree's own mutex stands in for the root's parent.
+  Since locks are always taken top to bottom there is no deadlock, no
+  thread can overtake another on the same path, and threads working in
+  disjoint subtrees only meet briefly at the nodes their paths share.
+
+  lookup() takes no locks at all, and never waits for anything but a
+  writer's few stores to a node it is reading. Each node (and the tree, for its root
+  pointer) carries a sequence counter, which a writer already holding the
+  node's mutex makes odd while it changes the node and even again after.
+  A reader notes the counter, reads the key and the child pointer it
+  needs, and checks that the counter hasn't moved; it then starts on the
+  child and re-checks the parent, which proves that the parent still
+  linked to the child at that moment. Any failed check restarts the
+  search from the root. Unlinking a node also bumps its counter, so a
+  reader can't be fooled by a node that has left the tree.
+
+  The one thing this can't see is a two-child delete() moving the
+  successor's key up the tree: a search for that key which has already
+  gone past the node receiving it can find it missing from its old place.
+  Such deletes bump the tree's 'moves' counter, and a lookup() that comes
+  up empty-handed retries if that has changed since it started. Two-child
+  deletes in disjoint subtrees hold no lock in common, so the counter has
+  a mutex of its own: it is only taken around the move itself, with no
+  other lock sought while it's held.
+
+  Lock-free readers mean an unlinked node may still be being read, so
+  nodes are never returned to malloc() while the tree exists: they come
+  from the tree's node pool (node_pool.c), delete() gives them back to it,
+  add() reuses them, and their counters keep counting. A stale reader thus
+  always reads a bt_node, and always notices that it changed.
+  ("Type-stable" memory, as in the kernel's SLAB_TYPESAFE_BY_RCU.) The
+  pool also saves a malloc() and a pthread_mutex_init() per add(), and
+  lets destroy() release the whole tree without walking it. Trees made
+  by initialize_sharing() use another tree's pool, so a stale reader may
+  find its node in a different tree, but still a bt_node, still counting.
+
+  lookup_locked() is a lock-coupling lookup, kept for comparison.
+
+  Keys and values: this file is compiled once per instantiation of
+  bt_template.h. On its own it is binary_tree.h's (Key and int); the
+  others (u128_tree.c, ...) define their parameters and include it. The
+  comparisons are macros, so each instantiation gets its own inlined
+  code, with no call through a function pointer per node.
 */
 
-#include <stdint.h>
-#include <pthread.h>
-#include <search.h>
-#include <ctype.h>
-#include "../lib/tlpi_hdr.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef BT_KEY                      // not included for another instantiation
+#define BT_DEFAULT
+#define BT_KEEP_PARAMS
+#include "binary_tree.h"
+#endif
+#include "seqlock.h"
 
-// static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
-// typedef __uint128_t Key;
-typedef unsigned int Key;
+#ifndef BT_LT
+#define BT_LT(a, b)             ((a) < (b))
+#define BT_EQ(a, b)             ((a) == (b))
+#endif
+#ifndef BT_KEY_LOAD
+#define BT_KEY_LOAD(field)      LOAD(field)
+#define BT_KEY_STORE(field, k)  STORE(field, k)
+#endif
 
-typedef struct bt_node {
-    Key key;
-    int value;
-    struct bt_node *left;
-    struct bt_node *right;
-    pthread_mutex_t mutex;
-} bt_node;
+// Within this file, the instantiation's names and types are the plain ones
+#ifndef BT_DEFAULT
+typedef BT_NAME(bt_key) Key;
+#endif
+typedef BT_NAME(bt_value) Value;
+#define bt_node         BT_NAME(bt_node)
+#define bt_root         BT_NAME(bt_root)
+#define bt_iter         BT_NAME(bt_iter)
+#define initialize      BT_NAME(initialize)
+#define initialize_sharing BT_NAME(initialize_sharing)
+#define destroy         BT_NAME(destroy)
+#define add             BT_NAME(add)
+#define delete          BT_NAME(delete)
+#define lookup          BT_NAME(lookup)
+#define lookup_locked   BT_NAME(lookup_locked)
+#define add_batch       BT_NAME(add_batch)
+#define lookup_batch    BT_NAME(lookup_batch)
+#define delete_batch    BT_NAME(delete_batch)
+#define bulk_load       BT_NAME(bulk_load)
+#define iter_start      BT_NAME(iter_start)
+#define iter_first      BT_NAME(iter_first)
+#define iter_next       BT_NAME(iter_next)
+#define range           BT_NAME(range)
+#define parallel_scan   BT_NAME(parallel_scan)
+#define tree_size       BT_NAME(tree_size)
+#define breadth_first   BT_NAME(breadth_first)
+#define depth_first     BT_NAME(depth_first)
+#define verify_tree     BT_NAME(verify_tree)
 
-typedef struct bt_root {
-    bt_node *root;
-    size_t node_count;
-} bt_root;
+static void die(int err, const char *what) {
+    fprintf(stderr, "binary_tree: %s: %s\n", what, strerror(err));
+    abort();
+}
 
-// pthread_create arguments
-typedef struct mt_node_arguments {
-    Key key;
-    int value;
-    bt_root *root;
-} mt_args;
+static void lock_mutex(pthread_mutex_t *mutex) {
+    int s = pthread_mutex_lock(mutex);
+    if (s != 0) { die(s, "pthread_mutex_lock"); }
+}
 
-int lock(bt_node *node) {
-    int s = pthread_mutex_lock(&node->mutex);
-    if (s != 0) { errExitEN(s, "pthread_mutex_lock" ); }
-    return s;
+static void unlock_mutex(pthread_mutex_t *mutex) {
+    int s = pthread_mutex_unlock(mutex);
+    if (s != 0) { die(s, "pthread_mutex_unlock"); }
 }
 
-int unlock(bt_node *node) {
-    int s = pthread_mutex_unlock(&node->mutex);
-    if (s != 0) { errExitEN(s, "pthread_mutex_unlock" ); }
-    return s;
+static void lock(bt_node *node)   { lock_mutex(&node->mutex); }
+static void unlock(bt_node *node) { unlock_mutex(&node->mutex); }
+
+static void *xcalloc(size_t n, size_t size) {
+    void *p = calloc(n, size);
+    if (p == NULL) { die(ENOMEM, "calloc"); }
+    return p;
 }
 
-bt_root *initialize() {
-    bt_root *tree = calloc(1, sizeof(bt_root));
+/* Called once per node, when the pool first carves it out */
+static void init_node(void *node) {
+    pthread_mutex_init(&((bt_node *) node)->mutex, NULL);
+}
+
+static bt_root *new_root(node_pool *pool, int shares_pool) {
+    bt_root *tree;
+    int s;
+
+    s = posix_memalign((void **) &tree, 64, sizeof(bt_root));
+    if (s != 0) { die(s, "posix_memalign"); }
+    memset(tree, 0, sizeof(bt_root));
     tree->node_count = 0;
     tree->root = NULL;
+    tree->pool = pool;
+    tree->shares_pool = shares_pool;
+    pthread_mutex_init(&tree->mutex, NULL);
+    pthread_mutex_init(&tree->moves_mutex, NULL);
     return tree;
 }
 
-bt_node *create_node(Key key, int value) {
-    bt_node *result = calloc(1, sizeof(bt_node));
-    result->left  = NULL;
-    result->right = NULL;
-    result->key   = key;
-    result->value = value;
-    pthread_mutex_init(&result->mutex, NULL);
+bt_root *initialize(void) {
+    return new_root(pool_create(sizeof(bt_node), offsetof(bt_node, right),
+                                init_node), 0);
+}
+
+bt_root *initialize_sharing(bt_root *other) {
+    return new_root(other->pool, 1);
+}
+
+/* Take a node from the pool; it isn't reachable yet, and is published by
+   a store under its parent's counter */
+static bt_node *create_node(bt_root *tree, Key key, Value value) {
+    bt_node *result = pool_alloc(tree->pool);
+
+    STORE(result->left, NULL);
+    STORE(result->right, NULL);
+    BT_KEY_STORE(result->key, key);
+    STORE(result->value, value);
     return result;
 }
 
-bt_node *closest_leaf(bt_node *root, Key key) {
-    bt_node *current = root;
-    bt_node *prev = NULL;
+/* 'node' has been unlinked (its counter bumped) and unlocked; readers may
+   still be looking at it, so it goes back to the pool, not to free() */
+static void free_node(bt_root *tree, bt_node *node) {
+    pool_free(tree->pool, node);
+}
+
+/* The node mutexes aren't destroyed: none is held by now, and (with
+   NPTL) they own no resources, so the pool can simply drop its slabs.
+   A tree sharing another's pool leaves its nodes there, for the owner's
+   destroy() to drop with the rest. */
+void destroy(bt_root *tree) {
+    if (!tree->shares_pool)
+        pool_destroy(tree->pool);
+    pthread_mutex_destroy(&tree->moves_mutex);
+    pthread_mutex_destroy(&tree->mutex);
+    free(tree);
+}
+
+size_t tree_size(bt_root *tree) {
+    return __atomic_load_n(&tree->node_count, __ATOMIC_RELAXED);
+}
+
+/* The link that leads to 'key' from 'node': the left or right child
+   pointer, whichever the search continues through */
+static bt_node **child_link(bt_node *node, Key key) {
+    return BT_LT(key, node->key) ? &node->left : &node->right;
+}
+
+int add(bt_root *tree, Key key, Value value) {
+    bt_node **link, *current, *child;
+
+    lock_mutex(&tree->mutex);
+    if (tree->root == NULL) {
+        write_begin(&tree->version);
+        STORE(tree->root, create_node(tree, key, value));
+        write_end(&tree->version);
+        __atomic_add_fetch(&tree->node_count, 1, __ATOMIC_RELAXED);
+        unlock_mutex(&tree->mutex);
+        return 1;
+    }
+
+    current = tree->root;
+    lock(current);
+    unlock_mutex(&tree->mutex);
+
+    while (!BT_EQ(key, current->key)) {
+        link = child_link(current, key);
+        child = *link;
+        if (child == NULL) {
+            child = create_node(tree, key, value);
+            write_begin(&current->version);
+            STORE(*link, child);
+            write_end(&current->version);
+            __atomic_add_fetch(&tree->node_count, 1, __ATOMIC_RELAXED);
+            unlock(current);
+            return 1;
+        }
+        lock(child);
+        unlock(current);
+        current = child;
+    }
+
+    unlock(current);                // already present
+    return 0;
+}
+
+int lookup(bt_root *tree, Key key, Value *value) {
+    const unsigned long *pseq;      // counter of the node we came from
+    unsigned long pv, v, moves;
+    bt_node *current, *next;
+    Key k;
+    Value val;
+
+retry:
+    moves = __atomic_load_n(&tree->moves, __ATOMIC_ACQUIRE);
+    pseq = &tree->version;
+    pv = read_begin(pseq);
+    current = LOAD(tree->root);
+    if (!read_valid(pseq, pv)) goto retry;
+
     while (current != NULL) {
-        prev = current;
-        if      (key < current->key)  current = current->left;
-        else if (key > current->key)  current = current->right;
-        else  {
-            prev = current;
-            break;
+        v = read_begin(&current->version);
+        if (!read_valid(pseq, pv))  // did the parent still link to us?
+            goto retry;
+
+        k = BT_KEY_LOAD(current->key);
+        if (BT_EQ(k, key)) {
+            val = LOAD(current->value);
+            if (!read_valid(&current->version, v)) goto retry;
+            if (value != NULL) *value = val;
+            return 1;
         }
+        next = BT_LT(key, k) ? LOAD(current->left) : LOAD(current->right);
+        if (!read_valid(&current->version, v)) goto retry;
+
+        pseq = &current->version;
+        pv = v;
+        current = next;
     }
 
-    return prev;
+    // a key moved up by a concurrent delete() may have eluded us
+    if ((moves & 1) || !read_valid(&tree->moves, moves)) goto retry;
+    return 0;
 }
 
-int add(bt_root *root_tree, Key key, int value) {
-    bt_node *new_node = create_node(key, value);
-    bt_node *current = root_tree->root;
+int lookup_locked(bt_root *tree, Key key, Value *value) {
+    bt_node *current, *child;
 
-    // we could have both threads think 'root' is NULL and replace both in sequence
+    lock_mutex(&tree->mutex);
+    current = tree->root;
     if (current == NULL) {
-        root_tree->root = new_node;
-        root_tree->node_count = 1;
-        return 1;
+        unlock_mutex(&tree->mutex);
+        return 0;
     }
-
     lock(current);
-    bt_node *leaf = closest_leaf(current, key);
-    if (key < leaf->key) {
-        leaf->left = new_node;
-        ++root_tree->node_count;
-    }
-    else if (key > leaf->key) {
-        leaf->right = new_node;
-        ++root_tree->node_count;
-    } else {
-        free(new_node);
+    unlock_mutex(&tree->mutex);
+
+    while (!BT_EQ(key, current->key)) {
+        child = *child_link(current, key);
+        if (child == NULL) {
+            unlock(current);
+            return 0;
+        }
+        lock(child);
+        unlock(current);
+        current = child;
     }
+
+    if (value != NULL) *value = current->value;
     unlock(current);
+    return 1;
+}
+
+/* Remove 'node' (locked) whose parent's link to it is 'link', the parent
+   (or the tree) also being locked and its counter being 'pseq'. Returns
+   the node to be freed, which may not be 'node' itself: with two
+   children, 'node' takes over the key and value of its successor, and
+   the successor is unlinked instead. */
+static bt_node *splice(bt_root *tree, bt_node *node, bt_node **link,
+                       unsigned long *pseq) {
+    bt_node *succ_parent, *succ, *next;
 
+    // with at most one child, the child is adopted by its grandparent
+    if (node->left == NULL || node->right == NULL) {
+        write_begin(pseq);
+        STORE(*link, node->left != NULL ? node->left : node->right);
+        write_end(pseq);
+        write_begin(&node->version);        // tell readers it has gone
+        write_end(&node->version);
+        unlock(node);
+        return node;
+    }
+
+    /* With two children, find the smallest key of the right subtree,
+       coupling down the leftmost path; 'node' stays locked throughout, so
+       nothing can enter the right subtree behind us */
+    succ_parent = node;
+    succ = node->right;
+    lock(succ);
+    while ((next = succ->left) != NULL) {
+        lock(next);
+        if (succ_parent != node) unlock(succ_parent);
+        succ_parent = succ;
+        succ = next;
+    }
+
+    lock_mutex(&tree->moves_mutex);
+    write_begin(&tree->moves);
+    write_begin(&node->version);
+    BT_KEY_STORE(node->key, succ->key);
+    STORE(node->value, succ->value);
+    if (succ_parent == node) {
+        STORE(node->right, succ->right);
+    } else {
+        write_begin(&succ_parent->version);
+        STORE(succ_parent->left, succ->right);
+        write_end(&succ_parent->version);
+        unlock(succ_parent);
+    }
+    write_end(&node->version);
+    write_begin(&succ->version);
+    write_end(&succ->version);
+    write_end(&tree->moves);
+    unlock_mutex(&tree->moves_mutex);
+
+    unlock(succ);
+    unlock(node);
+    return succ;
+}
+
+int delete(bt_root *tree, Key key) {
+    bt_node **link, *parent, *current;
+
+    lock_mutex(&tree->mutex);
+    parent = NULL;                  // i.e. the tree itself
+    link = &tree->root;
+
+    for (;;) {
+        current = *link;
+        if (current == NULL) {
+            if (parent != NULL) unlock(parent);
+            else unlock_mutex(&tree->mutex);
+            return 0;
+        }
+        lock(current);
+        if (BT_EQ(current->key, key)) break;
+
+        if (parent != NULL) unlock(parent);
+        else unlock_mutex(&tree->mutex);
+        parent = current;
+        link = child_link(current, key);
+    }
 
+    // holding 'parent' (or the tree) and 'current'
+    free_node(tree, splice(tree, current, link,
+                           parent != NULL ? &parent->version
+                                          : &tree->version));
+    if (parent != NULL) unlock(parent);
+    else unlock_mutex(&tree->mutex);
+    __atomic_sub_fetch(&tree->node_count, 1, __ATOMIC_RELAXED);
     return 1;
 }
 
-void replace_parent(bt_node *parent, bt_node *child, bt_node *new_child) {
-    if (parent->left == child) {
-        free(parent->left);
-        parent->left = new_child;
+/* Batches. A batch is sorted first, so that instead of each key making
+   its own way down from the root, the whole batch goes down together:
+   at each node it splits into the keys that belong to the left subtree
+   and those that belong to the right, and only where both are non-empty
+   (a branch point) does the node stay locked while the left part is
+   handled; elsewhere the usual lock coupling applies. The upper levels,
+   which every key would otherwise lock and miss in the cache on its own,
+   are visited once per batch. */
+
+typedef struct bt_item {
+    Key key;
+    Value value;
+    size_t pos;                     // in the caller's arrays
+} bt_item;
+
+static int cmp_item(const void *a, const void *b) {
+    const bt_item *x = a, *y = b;
+
+    if (!BT_EQ(x->key, y->key)) return BT_LT(x->key, y->key) ? -1 : 1;
+    return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+static int cmp_key(const void *a, const void *b) {
+    Key x = *(const Key *) a, y = *(const Key *) b;
+    return BT_LT(y, x) - BT_LT(x, y);
+}
+
+/* The index of the first of the (sorted) items whose key is >= 'key' */
+static size_t first_from(const bt_item *items, size_t n, Key key) {
+    size_t lo = 0, hi = n, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (BT_LT(items[mid].key, key)) lo = mid + 1;
+        else hi = mid;
     }
+    return lo;
+}
+
+static size_t first_key_from(const Key *keys, size_t n, Key key) {
+    size_t lo = 0, hi = n, mid;
 
-    if (parent->right == child) {
-        free(parent->right);
-        parent->right = new_child;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (BT_LT(keys[mid], key)) lo = mid + 1;
+        else hi = mid;
     }
+    return lo;
 }
 
-void splice(bt_node *node, bt_node *parent) {
-    // if it's a leaf, destroy it.
-    if (!node->left && !node->right) {
-             replace_parent(parent, node, NULL);
+/* A balanced subtree of new nodes, not yet visible to anyone */
+static bt_node *build_subtree(bt_root *tree, const bt_item *items,
+                              size_t n) {
+    bt_node *node;
+    size_t mid = n / 2;
 
-    // if it has one child, have them be adopted by their grandparent
-    } else if (node->left && !node->right) {
-            replace_parent(parent, node, node->left);
-    } else if (node->right && !node->left) {
-            replace_parent(parent, node, node->right);
+    if (n == 0) return NULL;
+    node = create_node(tree, items[mid].key, items[mid].value);
+    STORE(node->left, build_subtree(tree, items, mid));
+    STORE(node->right, build_subtree(tree, items + mid + 1, n - mid - 1));
+    return node;
+}
+
+/* Hang a subtree of 'items' from the empty 'link' of the locked 'parent'
+   (or the tree, if NULL), with a single store */
+static size_t graft(bt_root *tree, bt_node *parent, bt_node **link,
+                    const bt_item *items, size_t n) {
+    unsigned long *seq = parent != NULL ? &parent->version : &tree->version;
+    bt_node *subtree = build_subtree(tree, items, n);
 
-    /* if it has two children, take the smallest value of the right tree and
-       replace the node with that one. */
-    } else if (node->right && node->left) {
-        // find the smallest element of the right tree
-        bt_node *smallest_parent = node;
-        bt_node *smallest = node->right;
-        while (smallest->left) {
-            smallest_parent = smallest;
-            // left is the smaller side
-            smallest = smallest->left;
+    write_begin(seq);
+    STORE(*link, subtree);
+    write_end(seq);
+    __atomic_add_fetch(&tree->node_count, n, __ATOMIC_RELAXED);
+    return n;
+}
+
+static size_t add_into(bt_root *tree, bt_node *parent, bt_node **link,
+                       const bt_item *items, size_t n);
+
+/* Add items (sorted, distinct) to the subtree of the locked 'current';
+   unlocks it. Returns the number added. */
+static size_t add_below(bt_root *tree, bt_node *current,
+                        const bt_item *items, size_t n) {
+    size_t added = 0, lo, hi;
+    bt_node **link, *child;
+
+    for (;;) {
+        lo = first_from(items, n, current->key);
+        hi = lo < n && BT_EQ(items[lo].key, current->key) ? lo + 1 : lo;
+
+        if (lo > 0 && hi < n) {     // a branch point
+            added += add_into(tree, current, &current->left, items, lo);
+            items += hi, n -= hi;
+            link = &current->right;
+        } else if (lo > 0) {
+            n = lo;
+            link = &current->left;
+        } else if (hi < n) {
+            items += hi, n -= hi;
+            link = &current->right;
+        } else {
+            unlock(current);
+            return added;
         }
 
-        // "swap" the smallest.
-        node->key = smallest->key;
-        node->value = smallest->value;
+        child = *link;
+        if (child == NULL) {
+            added += graft(tree, current, link, items, n);
+            unlock(current);
+            return added;
+        }
+        lock(child);
+        unlock(current);
+        current = child;
+    }
+}
+
+/* Add items below 'link' of the locked 'parent', which stays locked */
+static size_t add_into(bt_root *tree, bt_node *parent, bt_node **link,
+                       const bt_item *items, size_t n) {
+    bt_node *child = *link;
+
+    if (child == NULL)
+        return graft(tree, parent, link, items, n);
+    lock(child);
+    return add_below(tree, child, items, n);
+}
 
-        // unsure if this is correct -- seems to be only sensible thing to do
-        smallest_parent->left = smallest->right;
-        free(smallest);
+size_t add_batch(bt_root *tree, const Key *keys, const Value *values,
+                 size_t n) {
+    bt_item *items;
+    bt_node *root;
+    size_t i, m, added;
 
+    if (n == 0) return 0;
+    items = xcalloc(n, sizeof(bt_item));
+    for (i = 0; i < n; i++) {
+        items[i].key = keys[i];
+        items[i].value = values[i];
+        items[i].pos = i;
+    }
+    qsort(items, n, sizeof(bt_item), cmp_item);
+    for (i = m = 1; i < n; i++)     // the first of each key wins, as in add()
+        if (!BT_EQ(items[i].key, items[m - 1].key))
+            items[m++] = items[i];
+
+    lock_mutex(&tree->mutex);
+    root = tree->root;
+    if (root == NULL) {
+        added = graft(tree, NULL, &tree->root, items, m);
+        unlock_mutex(&tree->mutex);
+    } else {
+        lock(root);
+        unlock_mutex(&tree->mutex);
+        added = add_below(tree, root, items, m);
     }
+
+    free(items);
+    return added;
 }
 
-int delete_dfs(bt_node *node, bt_node *parent, Key key) {
-    if (node == NULL)
-        return 0;
+static void unlock_parent(bt_root *tree, bt_node *parent) {
+    if (parent != NULL) unlock(parent);
+    else unlock_mutex(&tree->mutex);
+}
+
+/* Delete keys (sorted, distinct) from the subtree of the locked 'current',
+   where 'parent' (or the tree, if NULL) is locked too and links to it
+   through 'link'. Unlocks 'current', and 'parent' only if 'own_parent'.
+   Returns the number deleted. */
+static size_t delete_below(bt_root *tree, bt_node *parent, int own_parent,
+                           bt_node **link, bt_node *current,
+                           const Key *keys, size_t n) {
+    size_t removed = 0, lo, hi;
+    bt_node **side, *child;
 
-    Key node_key = node->key;
+    for (;;) {
+        lo = first_key_from(keys, n, current->key);
+        hi = lo < n && BT_EQ(keys[lo], current->key) ? lo + 1 : lo;
 
-    // we've found the key, let's actually splice it out of the tree
-    if (node_key == key) {
-        splice(node, parent);
+        if (hi > lo || (lo > 0 && hi < n))
+            break;                  // a branch point, or 'current' goes
+        if (lo == 0 && hi == n) {
+            unlock(current);
+            if (own_parent) unlock_parent(tree, parent);
+            return removed;
+        }
+
+        // all the keys are on one side: move down, coupling
+        side = lo > 0 ? &current->left : &current->right;
+        if (lo == 0) keys += hi, n -= hi;
+        else n = lo;
+        child = *side;
+        if (child == NULL) {
+            unlock(current);
+            if (own_parent) unlock_parent(tree, parent);
+            return removed;
+        }
+        lock(child);
+        if (own_parent) unlock_parent(tree, parent);
+        parent = current;
+        own_parent = 1;
+        link = side;
+        current = child;
+    }
+
+    // 'current' stays locked while its subtrees are done
+    if (lo > 0 && (child = current->left) != NULL) {
+        lock(child);
+        removed += delete_below(tree, current, 0, &current->left, child,
+                                keys, lo);
+    }
+    if (hi < n && (child = current->right) != NULL) {
+        lock(child);
+        removed += delete_below(tree, current, 0, &current->right, child,
+                                keys + hi, n - hi);
+    }
+    if (hi > lo) {
+        free_node(tree, splice(tree, current, link,
+                               parent != NULL ? &parent->version
+                                              : &tree->version));
+        __atomic_sub_fetch(&tree->node_count, 1, __ATOMIC_RELAXED);
+        removed++;
+    } else {
+        unlock(current);
+    }
+    if (own_parent) unlock_parent(tree, parent);
+    return removed;
+}
+
+size_t delete_batch(bt_root *tree, const Key *keys, size_t n) {
+    Key *sorted;
+    bt_node *root;
+    size_t i, m;
+
+    if (n == 0) return 0;
+    sorted = xcalloc(n, sizeof(Key));
+    memcpy(sorted, keys, n * sizeof(Key));
+    qsort(sorted, n, sizeof(Key), cmp_key);
+    for (i = m = 1; i < n; i++)
+        if (!BT_EQ(sorted[i], sorted[m - 1]))
+            sorted[m++] = sorted[i];
+
+    lock_mutex(&tree->mutex);
+    root = tree->root;
+    if (root == NULL) {
+        unlock_mutex(&tree->mutex);
+        m = 0;
+    } else {
+        lock(root);
+        m = delete_below(tree, NULL, 1, &tree->root, root, sorted, m);
+    }
+
+    free(sorted);
+    return m;
+}
+
+/* Bulk loading. Sorted keys need no searching: the middle one is the
+   root, and each half becomes a subtree the same way, built bottom-up --
+   children before their parent, so every node is written once and is
+   complete when it's linked. n keys take O(n) time and give a tree of
+   the least possible height. With threads to spare, a node builds its
+   left half on a new thread while it builds the right half itself, so
+   the top levels fan the work out and the threads never share a node. */
+
+#define LOAD_SPLIT_MIN 4096         // keys; fewer aren't worth a thread
+
+typedef struct load_part {
+    bt_root *tree;
+    const Key *keys;
+    const Value *values;
+    size_t n;
+    unsigned nthreads;
+    bt_node *subtree;               // the result
+} load_part;
+
+static void *load_worker(void *arg);
+
+static bt_node *load_subtree(bt_root *tree, const Key *keys,
+                             const Value *values, size_t n,
+                             unsigned nthreads) {
+    load_part left;
+    pthread_t tid;
+    bt_node *node, *right;
+    size_t mid = n / 2;
+    int s;
+
+    if (n == 0) return NULL;
+    left.tree = tree;
+    left.keys = keys;
+    left.values = values;
+    left.n = mid;
+    left.nthreads = nthreads / 2;
+    if (nthreads > 1 && n >= LOAD_SPLIT_MIN) {
+        s = pthread_create(&tid, NULL, load_worker, &left);
+        if (s != 0) { die(s, "pthread_create"); }
+        right = load_subtree(tree, keys + mid + 1, values + mid + 1,
+                             n - mid - 1, nthreads - nthreads / 2);
+        s = pthread_join(tid, NULL);
+        if (s != 0) { die(s, "pthread_join"); }
+    } else {
+        load_worker(&left);
+        right = load_subtree(tree, keys + mid + 1, values + mid + 1,
+                             n - mid - 1, 1);
+    }
+
+    node = create_node(tree, keys[mid], values[mid]);
+    STORE(node->left, left.subtree);
+    STORE(node->right, right);
+    return node;
+}
+
+static void *load_worker(void *arg) {
+    load_part *p = arg;
+
+    p->subtree = load_subtree(p->tree, p->keys, p->values, p->n,
+                              p->nthreads);
+    return NULL;
+}
+
+size_t bulk_load(bt_root *tree, const Key *keys, const Value *values,
+                 size_t n, unsigned nthreads) {
+    bt_node *subtree;
+    size_t i;
+
+    for (i = 1; i < n; i++)
+        if (!BT_LT(keys[i - 1], keys[i]))
+            break;
+    lock_mutex(&tree->mutex);
+    if (i < n || tree->root != NULL) {
+        unlock_mutex(&tree->mutex);
+        return add_batch(tree, keys, values, n);
+    }
+
+    // Other writers wait on the root's parent, readers see an empty tree
+    subtree = load_subtree(tree, keys, values, n, nthreads);
+    write_begin(&tree->version);
+    STORE(tree->root, subtree);
+    write_end(&tree->version);
+    __atomic_add_fetch(&tree->node_count, n, __ATOMIC_RELAXED);
+    unlock_mutex(&tree->mutex);
+    return n;
+}
+
+/* lookup_batch() runs LOOKUP_GROUP lookups side by side, one step of each
+   in turn, prefetching the node each will look at next: by the time a
+   lookup comes round again its node is (with luck) in the cache, and the
+   misses of the whole group overlap instead of being paid one after the
+   other. Each step is exactly a step of lookup(). */
+
+#define LOOKUP_GROUP 16
+
+typedef struct lookup_state {
+    Key key;
+    bt_node *current;
+    const unsigned long *pseq;
+    unsigned long pv, moves;
+} lookup_state;
+
+static void lookup_start(bt_root *tree, lookup_state *s) {
+    do {
+        s->moves = __atomic_load_n(&tree->moves, __ATOMIC_ACQUIRE);
+        s->pseq = &tree->version;
+        s->pv = read_begin(s->pseq);
+        s->current = LOAD(tree->root);
+    } while (!read_valid(s->pseq, s->pv));
+    if (s->current != NULL) __builtin_prefetch(s->current);
+}
+
+/* Returns 1 when the lookup is over, having set *found and *value */
+static int lookup_step(bt_root *tree, lookup_state *s, int *found,
+                       Value *value) {
+    bt_node *current = s->current, *next;
+    unsigned long v;
+    Key k;
+    Value val;
+
+    if (current == NULL) {
+        if ((s->moves & 1) || !read_valid(&tree->moves, s->moves)) {
+            lookup_start(tree, s);
+            return 0;
+        }
+        *found = 0;
         return 1;
     }
 
-    // otherwise we should search (depth first).
-    if (key < node_key) {
-        return delete_dfs(node->left, node, key);
-    } else if (key > node_key) {
-        return delete_dfs(node->right, node, key);
+    v = read_begin(&current->version);
+    if (!read_valid(s->pseq, s->pv)) {
+        lookup_start(tree, s);
+        return 0;
+    }
+    k = BT_KEY_LOAD(current->key);
+    if (BT_EQ(k, s->key)) {
+        val = LOAD(current->value);
+        if (!read_valid(&current->version, v)) {
+            lookup_start(tree, s);
+            return 0;
+        }
+        *found = 1;
+        *value = val;
+        return 1;
+    }
+    next = BT_LT(s->key, k) ? LOAD(current->left) : LOAD(current->right);
+    if (!read_valid(&current->version, v)) {
+        lookup_start(tree, s);
+        return 0;
     }
 
-    return -1;
+    s->pseq = &current->version;
+    s->pv = v;
+    s->current = next;
+    if (next != NULL) __builtin_prefetch(next);
+    return 0;
 }
 
-void delete(bt_root *root_tree, Key key) {
-    if (delete_dfs(root_tree->root, NULL, key)) root_tree->node_count--;
+size_t lookup_batch(bt_root *tree, const Key *keys, Value *values,
+                    int *found, size_t n) {
+    lookup_state group[LOOKUP_GROUP];
+    int done[LOOKUP_GROUP], f;
+    Value value;
+    size_t base, nfound = 0;
+    int i, m, active;
+
+    for (base = 0; base < n; base += m) {
+        m = n - base < LOOKUP_GROUP ? n - base : LOOKUP_GROUP;
+        for (i = 0; i < m; i++) {
+            group[i].key = keys[base + i];
+            lookup_start(tree, &group[i]);
+            done[i] = 0;
+        }
+
+        for (active = m; active > 0; ) {
+            for (i = 0; i < m; i++) {
+                if (done[i] || !lookup_step(tree, &group[i], &f, &value))
+                    continue;
+                done[i] = 1;
+                active--;
+                if (found != NULL) found[base + i] = f;
+                if (f && values != NULL) values[base + i] = value;
+                nfound += f;
+            }
+        }
+    }
+    return nfound;
 }
 
-void breadth_first(bt_root *root_tree, void (*action)(const bt_node*)) {
-    bt_node *current = root_tree->root;
-    int count = root_tree->node_count;
+/* Ordered scans. Each step of an iterator is a lock-free search, like
+   lookup(), for the smallest key after the last one returned, so a scan
+   takes no locks, never holds up a writer, and copes with any changes
+   made while it runs: it returns the keys in order, each of them present
+   at the moment it was found, and every key that stays in the tree
+   throughout the scan. The price is a descent from the root per key. */
+
+/* Find the smallest key >= 'key' (> 'key' if 'from' is BT_AFTER_KEY, or
+   any key at all if it is BT_FIRST); returns 0 if there is none */
+static int find_from(bt_root *tree, Key key, enum bt_iter_from from,
+                     Key *found_key, Value *found_value) {
+    const unsigned long *pseq;
+    unsigned long pv, v, moves;
+    bt_node *current, *next;
+    Key k, best_key;
+    Value val, best_value;
+    int found;
 
-    // stack of elements
-    bt_node **stack = calloc(count, sizeof(bt_node*));
+retry:
+    found = 0;
+    moves = __atomic_load_n(&tree->moves, __ATOMIC_ACQUIRE);
+    pseq = &tree->version;
+    pv = read_begin(pseq);
+    current = LOAD(tree->root);
+    if (!read_valid(pseq, pv)) goto retry;
 
-    int ith = 0, nth = 0;
-    stack[0] = current;
-    while(current != NULL) {
-        if (current->left)  stack[++nth] = current->left;
-        if (current->right) stack[++nth] = current->right;
+    while (current != NULL) {
+        v = read_begin(&current->version);
+        if (!read_valid(pseq, pv)) goto retry;
 
-        current = stack[++ith];
+        k = BT_KEY_LOAD(current->key);
+        val = LOAD(current->value);
+        if (from == BT_FIRST || BT_LT(key, k) ||
+                (from == BT_FROM_KEY && BT_EQ(k, key))) {
+            next = LOAD(current->left);     // look for a smaller one
+            if (!read_valid(&current->version, v)) goto retry;
+            best_key = k;
+            best_value = val;
+            found = 1;
+            if (from == BT_FROM_KEY && BT_EQ(k, key)) break;
+        } else {
+            next = LOAD(current->right);
+            if (!read_valid(&current->version, v)) goto retry;
+        }
+        pseq = &current->version;
+        pv = v;
+        current = next;
     }
 
-    int i = 0;
-    while (stack[i] != NULL)
-        action(stack[i++]);
+    /* A key moved up by a two-child delete() could have been skipped,
+       whether or not we found something */
+    if ((moves & 1) || !read_valid(&tree->moves, moves)) goto retry;
+
+    if (found) {
+        *found_key = best_key;
+        *found_value = best_value;
+    }
+    return found;
 }
 
-void depth_first_driver(bt_node *current, size_t depth, void (*action)(const bt_node*, int)) {
-    if (!current) return;
-    action(current, depth);
-    if (!current->right && !current->left) return;
-    depth_first_driver(current->right, depth + 1, action);
-    depth_first_driver(current->left, depth + 1, action);
+void iter_start(bt_iter *it, bt_root *tree, Key from) {
+    it->tree = tree;
+    it->key = from;
+    it->from = BT_FROM_KEY;
+    it->done = 0;
 }
 
-void depth_first(bt_root *root, void (*action)(const bt_node*, int)) {
-    depth_first_driver(root->root, 0, action);
+void iter_first(bt_iter *it, bt_root *tree) {
+    it->tree = tree;
+    memset(&it->key, 0, sizeof(it->key));
+    it->from = BT_FIRST;
+    it->done = 0;
 }
 
-void print_node_depth(const bt_node *node, int depth) {
-    if (isalnum(node->key)) {
-        printf("%c ", node->key);
-    } else {
-        printf("%X ", node->key);
+int iter_next(bt_iter *it, Key *key, Value *value) {
+    Key k;
+    Value v;
+
+    if (it->done) return 0;
+    if (!find_from(it->tree, it->key, it->from, &k, &v)) {
+        it->done = 1;
+        return 0;
     }
-    return;
-    if (node != NULL) {
-        printf("%*c \n", 3*depth, node->key);
-    } else {
-        printf("%*c \n", 3*depth, '%');
+    it->key = k;
+    it->from = BT_AFTER_KEY;
+    if (key != NULL) *key = k;
+    if (value != NULL) *value = v;
+    return 1;
+}
+
+size_t range(bt_root *tree, Key lo, Key hi,
+             int (*callback)(Key key, Value value, void *arg), void *arg) {
+    bt_iter it;
+    size_t n = 0;
+    Key k;
+    Value v;
+
+    iter_start(&it, tree, lo);
+    while (iter_next(&it, &k, &v) && !BT_LT(hi, k)) {
+        n++;
+        if (callback(k, v, arg) != 0) break;
     }
+    return n;
 }
 
-void print_node(const bt_node *node) {
-    if (node != NULL) {
-        printf("node: %c\n", node->key);
+/* parallel_scan() cuts the key space at the keys of the top few levels of
+   the tree -- so each piece is, roughly, a subtree -- and its threads take
+   the pieces in turn and range() over them. */
+
+#define SCAN_PIECES 4               // per thread, to even out the work
+
+typedef struct scan_shared {
+    bt_root *tree;
+    const Key *cuts;                // piece i: (cuts[i - 1], cuts[i]]
+    size_t ncuts;
+    size_t next_piece;              // taken atomically
+    int stop;                       // set when a callback asks
+    int (*callback)(Key key, Value value, void *arg);
+    void *arg;
+    size_t visited;
+} scan_shared;
+
+/* Scan piece i; returns the number of keys visited */
+static size_t scan_piece(scan_shared *sh, size_t i) {
+    bt_iter it;
+    size_t n = 0;
+    Key k;
+    Value v;
+
+    if (i == 0) {
+        iter_first(&it, sh->tree);
+    } else {
+        iter_start(&it, sh->tree, sh->cuts[i - 1]);
+        it.from = BT_AFTER_KEY;
+    }
+    while (iter_next(&it, &k, &v) &&
+           (i == sh->ncuts || !BT_LT(sh->cuts[i], k))) {
+        n++;
+        if (__atomic_load_n(&sh->stop, __ATOMIC_RELAXED)) break;
+        if (sh->callback(k, v, sh->arg) != 0) {
+            __atomic_store_n(&sh->stop, 1, __ATOMIC_RELAXED);
+            break;
+        }
     }
+    return n;
 }
 
-void *mt_add(void *arg) {
-    mt_args *parameters = (mt_args*)arg;
-    add(parameters->root, parameters->key, parameters->value);
+static void *scan_worker(void *arg) {
+    scan_shared *sh = arg;
+    size_t i, n = 0;
+
+    while ((i = __atomic_fetch_add(&sh->next_piece, 1, __ATOMIC_RELAXED))
+            <= sh->ncuts && !__atomic_load_n(&sh->stop, __ATOMIC_RELAXED))
+        n += scan_piece(sh, i);
+    __atomic_add_fetch(&sh->visited, n, __ATOMIC_RELAXED);
     return NULL;
 }
 
-int main() {
-    bt_root *root = initialize();
-    add(root, 'M', 1);
+/* Up to 'max' distinct keys from the top of the tree, sorted. The nodes
+   are read as lookup() reads them, and any that change under us are just
+   left out: the cuts only need to be roughly even, not exact. */
+static size_t top_keys(bt_root *tree, Key *keys, size_t max) {
+    bt_node **queue = xcalloc(2 * max + 1, sizeof(bt_node *)), *node, *l, *r;
+    size_t head = 0, tail = 0, n = 0, i, m;
+    unsigned long v;
+    Key k;
+
+    node = LOAD(tree->root);
+    if (node != NULL) queue[tail++] = node;
+    while (head < tail && n < max) {
+        node = queue[head++];
+        v = read_begin(&node->version);
+        k = BT_KEY_LOAD(node->key);
+        l = LOAD(node->left);
+        r = LOAD(node->right);
+        if (!read_valid(&node->version, v)) continue;
+        keys[n++] = k;
+        if (l != NULL) queue[tail++] = l;
+        if (r != NULL) queue[tail++] = r;
+    }
+    free(queue);
+
+    if (n == 0) return 0;
+    qsort(keys, n, sizeof(Key), cmp_key);
+    for (i = m = 1; i < n; i++)
+        if (!BT_EQ(keys[i], keys[m - 1]))
+            keys[m++] = keys[i];
+    return m;
+}
 
-    char __attribute__((__unused__)) letters[25] = {'G', 'A', 'Q', 'Z', 'J', 'C', 'L', 'U', 'P', 'V', 'T', 'O', 'E',
-                        'X', 'N', 'S', 'R', 'W', 'B', 'F', 'H', 'I', 'D', 'K', 'Y'};
+size_t parallel_scan(bt_root *tree, unsigned nthreads,
+                     int (*callback)(Key key, Value value, void *arg),
+                     void *arg) {
+    scan_shared sh;
+    pthread_t *tids;
+    Key *cuts;
+    unsigned i;
+    int s;
 
-    int num = 100;
-    pthread_t threads[num];
+    if (nthreads == 0) nthreads = 1;
+    cuts = xcalloc(SCAN_PIECES * nthreads, sizeof(Key));
+    tids = xcalloc(nthreads, sizeof(pthread_t));
 
-    /* for(int i = 0; i < num; i++) { */
-    /*     mt_args *args = alloca(1); */
-    /*     args->key = letters[i]; args->value = i; args->root = root; */
-    /*     int s = pthread_create(&threads[i], NULL, mt_add, args); */
-    /*     if (s != 0) errExitEN(s, "pthread_create"); */
-    /* } */
+    sh.tree = tree;
+    sh.cuts = cuts;
+    sh.ncuts = top_keys(tree, cuts, SCAN_PIECES * nthreads - 1);
+    sh.next_piece = 0;
+    sh.stop = 0;
+    sh.callback = callback;
+    sh.arg = arg;
+    sh.visited = 0;
 
-    for(int i = 1; i < num; i++) {
-        mt_args *args = alloca(1);
-        args->key = i; args->value = i; args->root = root;
-        int s = pthread_create(&threads[i], NULL, mt_add, args);
-        if (s != 0) errExitEN(s, "pthread_create");
+    for (i = 0; i < nthreads; i++) {
+        s = pthread_create(&tids[i], NULL, scan_worker, &sh);
+        if (s != 0) { die(s, "pthread_create"); }
+    }
+    for (i = 0; i < nthreads; i++) {
+        s = pthread_join(tids[i], NULL);
+        if (s != 0) { die(s, "pthread_join"); }
     }
 
-    for(int i = 1; i < num; i++) {
-        int s = pthread_join(threads[i], NULL);
-        if (s != 0) errExitEN(s, "pthread_join");
+    free(cuts);
+    free(tids);
+    return sh.visited;
+}
+
+void breadth_first(bt_root *tree, void (*action)(const bt_node*)) {
+    size_t size = 64;
+    size_t ith, nth;
+
+    if (tree->root == NULL) return;
+
+    /* queue of elements; grown as needed rather than sized from
+       node_count, which another thread may have changed meanwhile */
+    bt_node **queue = xcalloc(size, sizeof(bt_node*));
+
+    ith = 0; nth = 0;
+    queue[0] = tree->root;
+    while (ith <= nth) {
+        bt_node *current = queue[ith++];
+        if (nth + 2 >= size) {
+            size *= 2;
+            queue = realloc(queue, size * sizeof(bt_node*));
+            if (queue == NULL) { die(ENOMEM, "realloc"); }
+        }
+        if (current->left)  queue[++nth] = current->left;
+        if (current->right) queue[++nth] = current->right;
+        action(current);
     }
 
-    depth_first(root, &print_node_depth);
-    printf("\nnumber: %zd\n", root->node_count);
-    free(root);
-    return 0;
+    free(queue);
 }
+
+static void depth_first_driver(bt_node *current, size_t depth,
+                               void (*action)(const bt_node*, int)) {
+    if (!current) return;
+    action(current, depth);
+    depth_first_driver(current->right, depth + 1, action);
+    depth_first_driver(current->left, depth + 1, action);
+}
+
+void depth_first(bt_root *tree, void (*action)(const bt_node*, int)) {
+    depth_first_driver(tree->root, 0, action);
+}
+
+/* Check that every key in the subtree lies in (lo, hi), where 'has_lo' and
+   'has_hi' say whether those bounds exist, and that no node's counter was
+   left odd; returns the number of nodes, or -1 if anything is wrong */
+static long verify_subtree(const bt_node *node, int has_lo, Key lo,
+                           int has_hi, Key hi) {
+    long l, r;
+
+    if (node == NULL) return 0;
+    if (node->version & 1) return -1;
+    if ((has_lo && !BT_LT(lo, node->key)) ||
+            (has_hi && !BT_LT(node->key, hi)))
+        return -1;
+    l = verify_subtree(node->left, has_lo, lo, 1, node->key);
+    r = verify_subtree(node->right, 1, node->key, has_hi, hi);
+    return (l < 0 || r < 0) ? -1 : l + r + 1;
+}
+
+/* For a tree no one is changing: besides the ordering and the size, the
+   tree's counters must be even, or every lock-free reader would spin (or
+   retry) forever */
+int verify_tree(bt_root *tree) {
+    Key none;
+    long n;
+
+    if ((tree->version & 1) || (tree->moves & 1)) return 0;
+    memset(&none, 0, sizeof(none));
+    n = verify_subtree(tree->root, 0, none, 0, none);
+    return n >= 0 && (size_t) n == tree->node_count;
+}
+
+#ifdef BT_DEFAULT
+static void *ops_initialize(void) { return initialize(); }
+static void ops_destroy(void *tree) { destroy(tree); }
+static int ops_add(void *tree, Key key, int value) {
+    return add(tree, key, value);
+}
+static int ops_delete(void *tree, Key key) { return delete(tree, key); }
+static int ops_lookup(void *tree, Key key, int *value) {
+    return lookup(tree, key, value);
+}
+static int ops_lookup_locked(void *tree, Key key, int *value) {
+    return lookup_locked(tree, key, value);
+}
+static int ops_verify(void *tree) { return verify_tree(tree); }
+
+const tree_ops bt_ops = {
+    "bst", ops_initialize, ops_destroy, ops_add, ops_delete, ops_lookup,
+    ops_verify
+};
+
+const tree_ops bt_locked_ops = {
+    "bst-locked", ops_initialize, ops_destroy, ops_add, ops_delete,
+    ops_lookup_locked, ops_verify
+};
+#endif
@@ -0,0 +1,16 @@
+/*
+  Thread-safe unbalanced binary search tree (see binary_tree.c), with the
+  Key of tree_ops.h and int values: bt_root, bt_node, initialize(), add(),
+  delete(), lookup() and the rest, as declared in bt_template.h.
+*/
+#ifndef BINARY_TREE_H
+#define BINARY_TREE_H
+
+#include "tree_ops.h"               // Key, and bt_ops for this tree
+
+#define BT_PREFIX
+#define BT_KEY      Key
+#define BT_VALUE    int
+#include "bt_template.h"
+
+#endif
@@ -0,0 +1,461 @@
+/*
+  A B+tree, as a cache-friendlier alternative to binary_tree.c.
+
+  A bt_node spends a cache miss on one 4-byte key. Here a node holds
+  BP_KEYS sorted keys in a few consecutive cache lines, so a lookup in a
+  million keys visits four or five nodes instead of some forty, and the
+  search within a node compares all its keys at once with SIMD (SSE2, or
+  AVX2 if the compiler is allowed it) -- unused slots are padded with the
+  largest key, so the position of 'key' is simply the number of slots
+  that hold something smaller, with no branch on the node's count. The
+  values live in the leaves, which are linked left to right for scans.
+
+  Concurrency is optimistic lock coupling (Leis et al., "Optimistic Lock
+  Coupling: A Scalable and Efficient General-Purpose Synchronization
+  Method", 2019). Each node's version word is both a lock (bit 1) and a
+  counter: a writer sets the bit with a CAS, and clearing it (by adding
+  2 again) also moves the counter on. Readers take no locks: they note a
+  node's version, read it, and check the version again before trusting
+  what they read -- in particular before following a child pointer -- and
+  start again from the root if it changed. Writers descend the same way
+  and only lock the node they change (and its parent, for a split), by
+  upgrading the version they read, which fails if anything happened to
+  the node in between.
+
+  Inserts split full nodes on the way down, so the parent of a split
+  always has room for the new separator, and a split never has to go
+  back up the tree. Deletes just remove the key from its leaf: nodes are
+  never merged or freed (until bp_destroy()), which makes a stale pointer
+  harmless -- it still points to a node -- at the cost of leaving sparse
+  leaves behind after mass deletions.
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "bplus_tree.h"
+
+#define BP_PAD      UINT_MAX        // in unused key slots
+#define LOCKED      2UL             // in a node's version
+
+// the SIMD search assumes Key is a 32-bit unsigned integer
+typedef char bp_key_is_32_bits[sizeof(Key) == 4 ? 1 : -1];
+
+static void die(int err, const char *what) {
+    fprintf(stderr, "bplus_tree: %s: %s\n", what, strerror(err));
+    abort();
+}
+
+/* Optimistic locks. read_lock() waits for any writer to finish, and
+   returns the version to validate() against or upgrade() from; those two
+   return 0 if the node has changed since, and the caller must restart. */
+
+static unsigned long read_lock(bp_node *node) {
+    unsigned long version;
+    int spins = 0;
+
+    while ((version = __atomic_load_n(&node->version, __ATOMIC_ACQUIRE))
+            & LOCKED) {
+        if (++spins % 64 == 0)
+            sched_yield();          // the holder may not be running
+    }
+    return version;
+}
+
+static int validate(bp_node *node, unsigned long version) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&node->version, __ATOMIC_RELAXED) == version;
+}
+
+static int upgrade(bp_node *node, unsigned long version) {
+    return __atomic_compare_exchange_n(&node->version, &version,
+                                       version + LOCKED, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void write_unlock(bp_node *node) {
+    __atomic_add_fetch(&node->version, LOCKED, __ATOMIC_RELEASE);
+}
+
+/* The number of keys in the node that are less than 'key': for a leaf,
+   where 'key' is or would be; for an inner node, which child to take */
+static int lower_bound(const bp_node *node, Key key) {
+    int i, n = 0;
+#if defined(__AVX2__)
+    const __m256i flip = _mm256_set1_epi32(INT_MIN);
+    const __m256i k = _mm256_xor_si256(_mm256_set1_epi32(key), flip);
+    __m256i v, sum = _mm256_setzero_si256();
+    __m128i s;
+
+    for (i = 0; i < BP_KEYS; i += 8) {  // unsigned a < b: signed a^m < b^m
+        v = _mm256_loadu_si256((const __m256i *) &node->keys[i]);
+        v = _mm256_xor_si256(v, flip);
+        sum = _mm256_sub_epi32(sum, _mm256_cmpgt_epi32(k, v));  // -1: true
+    }
+    s = _mm_add_epi32(_mm256_castsi256_si128(sum),
+                      _mm256_extracti128_si256(sum, 1));
+#elif defined(__SSE2__)
+    const __m128i flip = _mm_set1_epi32(INT_MIN);
+    const __m128i k = _mm_xor_si128(_mm_set1_epi32(key), flip);
+    __m128i v, s = _mm_setzero_si128();
+
+    for (i = 0; i < BP_KEYS; i += 4) {  // unsigned a < b: signed a^m < b^m
+        v = _mm_loadu_si128((const __m128i *) &node->keys[i]);
+        v = _mm_xor_si128(v, flip);
+        s = _mm_sub_epi32(s, _mm_cmpgt_epi32(k, v));        // -1: true
+    }
+#else
+    for (i = 0; i < BP_KEYS; i++)
+        n += node->keys[i] < key;
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    n = _mm_cvtsi128_si32(s);
+#endif
+    return n;
+}
+
+static int load_count(bp_node *node) {
+    int count = __atomic_load_n(&node->count, __ATOMIC_RELAXED);
+    return count < 0 ? 0 : count > BP_KEYS ? BP_KEYS : count;
+}
+
+static void pad_keys(bp_node *node, int from) {
+    for (; from < BP_KEYS; from++)
+        node->keys[from] = BP_PAD;
+}
+
+static bp_leaf *new_leaf(bp_tree *tree) {
+    bp_leaf *leaf = pool_alloc(tree->leaf_pool);
+
+    leaf->n.count = 0;
+    leaf->n.leaf = 1;
+    leaf->next = NULL;
+    pad_keys(&leaf->n, 0);
+    return leaf;
+}
+
+static bp_inner *new_inner(bp_tree *tree) {
+    bp_inner *inner = pool_alloc(tree->inner_pool);
+
+    inner->n.count = 0;
+    inner->n.leaf = 0;
+    pad_keys(&inner->n, 0);
+    return inner;
+}
+
+bp_tree *bp_initialize(void) {
+    bp_tree *tree = calloc(1, sizeof(bp_tree));
+    if (tree == NULL) { die(ENOMEM, "calloc"); }
+    tree->inner_pool = pool_create(sizeof(bp_inner),
+                                   offsetof(bp_inner, children), NULL);
+    tree->leaf_pool = pool_create(sizeof(bp_leaf),
+                                  offsetof(bp_leaf, next), NULL);
+    tree->root = &new_leaf(tree)->n;
+    tree->node_count = 0;
+    return tree;
+}
+
+void bp_destroy(bp_tree *tree) {
+    pool_destroy(tree->inner_pool);
+    pool_destroy(tree->leaf_pool);
+    free(tree);
+}
+
+size_t bp_size(bp_tree *tree) {
+    return __atomic_load_n(&tree->node_count, __ATOMIC_RELAXED);
+}
+
+/* Splits: the caller holds the node's lock (and its parent's). The new
+   right-hand node is returned, and *sep set to the largest key left in
+   'node', which is what the parent must separate them by. */
+
+static bp_node *split_leaf(bp_tree *tree, bp_leaf *leaf, Key *sep) {
+    bp_leaf *right = new_leaf(tree);
+    int mid = leaf->n.count / 2, n = leaf->n.count - mid;
+
+    memcpy(right->n.keys, &leaf->n.keys[mid], n * sizeof(Key));
+    memcpy(right->values, &leaf->values[mid], n * sizeof(int));
+    right->n.count = n;
+    right->next = leaf->next;
+    __atomic_store_n(&leaf->next, right, __ATOMIC_RELEASE);
+    leaf->n.count = mid;
+    pad_keys(&leaf->n, mid);
+    *sep = leaf->n.keys[mid - 1];
+    return &right->n;
+}
+
+static bp_node *split_inner(bp_tree *tree, bp_inner *inner, Key *sep) {
+    bp_inner *right = new_inner(tree);
+    int mid = inner->n.count / 2, n = inner->n.count - mid - 1;
+
+    // keys[mid] moves up; the right node takes what is beyond it
+    memcpy(right->n.keys, &inner->n.keys[mid + 1], n * sizeof(Key));
+    memcpy(right->children, &inner->children[mid + 1],
+           (n + 1) * sizeof(bp_node *));
+    right->n.count = n;
+    *sep = inner->n.keys[mid];
+    inner->n.count = mid;
+    pad_keys(&inner->n, mid);
+    return &right->n;
+}
+
+/* Add separator 'sep' to a locked inner node that has room, with 'child'
+   to its right */
+static void insert_child(bp_inner *inner, Key sep, bp_node *child) {
+    int pos = lower_bound(&inner->n, sep), n = inner->n.count;
+
+    memmove(&inner->n.keys[pos + 1], &inner->n.keys[pos],
+            (n - pos) * sizeof(Key));
+    memmove(&inner->children[pos + 2], &inner->children[pos + 1],
+            (n - pos) * sizeof(bp_node *));
+    inner->n.keys[pos] = sep;
+    inner->children[pos + 1] = child;
+    inner->n.count = n + 1;
+}
+
+/* Split the full, read-locked 'node' (at 'version'), below 'parent' (at
+   'pversion'; NULL if node is the root). Returns 0 if it couldn't get the
+   locks; either way the caller restarts. */
+static int split(bp_tree *tree, bp_node *node, unsigned long version,
+                 bp_node *parent, unsigned long pversion) {
+    bp_inner *root;
+    bp_node *right;
+    Key sep;
+
+    if (parent != NULL && !upgrade(parent, pversion))
+        return 0;
+    if (!upgrade(node, version)) {
+        if (parent != NULL) write_unlock(parent);
+        return 0;
+    }
+    if (parent == NULL &&
+            __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE) != node) {
+        write_unlock(node);         // someone grew the tree above it
+        return 0;
+    }
+
+    right = node->leaf ? split_leaf(tree, (bp_leaf *) node, &sep)
+                       : split_inner(tree, (bp_inner *) node, &sep);
+    if (parent != NULL) {
+        insert_child((bp_inner *) parent, sep, right);
+    } else {
+        root = new_inner(tree);
+        root->n.keys[0] = sep;
+        root->n.count = 1;
+        root->children[0] = node;
+        root->children[1] = right;
+        __atomic_store_n(&tree->root, &root->n, __ATOMIC_RELEASE);
+    }
+
+    write_unlock(node);
+    if (parent != NULL) write_unlock(parent);
+    return 1;
+}
+
+int bp_add(bp_tree *tree, Key key, int value) {
+    bp_node *node, *parent, *child;
+    bp_leaf *leaf;
+    unsigned long version, pversion = 0;
+    int pos, count;
+
+restart:
+    node = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+    version = read_lock(node);
+    if (node != __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE))
+        goto restart;
+    parent = NULL;
+
+    for (;;) {
+        count = load_count(node);
+        if (count == BP_KEYS) {     // full: split it first, and start again
+            split(tree, node, version, parent, pversion);
+            goto restart;
+        }
+        if (node->leaf)
+            break;
+
+        child = ((bp_inner *) node)->children[lower_bound(node, key)];
+        if (parent != NULL && !validate(parent, pversion))
+            goto restart;
+        if (!validate(node, version))
+            goto restart;
+        parent = node;
+        pversion = version;
+        node = child;
+        version = read_lock(node);
+    }
+
+    leaf = (bp_leaf *) node;
+    if (!upgrade(node, version))
+        goto restart;
+    if (parent != NULL && !validate(parent, pversion)) {
+        write_unlock(node);
+        goto restart;
+    }
+
+    pos = lower_bound(node, key);
+    count = node->count;
+    if (pos < count && node->keys[pos] == key) {
+        write_unlock(node);
+        return 0;
+    }
+    memmove(&node->keys[pos + 1], &node->keys[pos],
+            (count - pos) * sizeof(Key));
+    memmove(&leaf->values[pos + 1], &leaf->values[pos],
+            (count - pos) * sizeof(int));
+    node->keys[pos] = key;
+    leaf->values[pos] = value;
+    node->count = count + 1;
+    write_unlock(node);
+
+    __atomic_add_fetch(&tree->node_count, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/* Find the leaf for 'key', read-locked at *version */
+static bp_leaf *find_leaf(bp_tree *tree, Key key, unsigned long *version) {
+    bp_node *node, *child;
+    unsigned long pversion;
+
+restart:
+    node = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+    *version = read_lock(node);
+    if (node != __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE))
+        goto restart;
+
+    while (!node->leaf) {
+        child = ((bp_inner *) node)->children[lower_bound(node, key)];
+        if (!validate(node, *version))
+            goto restart;
+        pversion = *version;
+        *version = read_lock(child);
+
+        /* Only now is it certain that the child still holds the key's
+           range: it may have been split after we read the pointer */
+        if (!validate(node, pversion))
+            goto restart;
+        node = child;
+    }
+    return (bp_leaf *) node;
+}
+
+int bp_delete(bp_tree *tree, Key key) {
+    bp_leaf *leaf;
+    unsigned long version;
+    int pos, count;
+
+    do {
+        leaf = find_leaf(tree, key, &version);
+    } while (!upgrade(&leaf->n, version));
+
+    pos = lower_bound(&leaf->n, key);
+    count = leaf->n.count;
+    if (pos >= count || leaf->n.keys[pos] != key) {
+        write_unlock(&leaf->n);
+        return 0;
+    }
+    memmove(&leaf->n.keys[pos], &leaf->n.keys[pos + 1],
+            (count - pos - 1) * sizeof(Key));
+    memmove(&leaf->values[pos], &leaf->values[pos + 1],
+            (count - pos - 1) * sizeof(int));
+    leaf->n.keys[count - 1] = BP_PAD;
+    leaf->n.count = count - 1;
+    write_unlock(&leaf->n);
+
+    __atomic_sub_fetch(&tree->node_count, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+int bp_lookup(bp_tree *tree, Key key, int *value) {
+    bp_leaf *leaf;
+    unsigned long version;
+    int pos, found, val = 0;
+
+    do {
+        leaf = find_leaf(tree, key, &version);
+        pos = lower_bound(&leaf->n, key);
+        found = pos < load_count(&leaf->n) && leaf->n.keys[pos] == key;
+        if (found) val = leaf->values[pos];
+    } while (!validate(&leaf->n, version));
+
+    if (found && value != NULL) *value = val;
+    return found;
+}
+
+/* Check the subtree, all of whose keys must lie in (lo, hi] (where there
+   are such bounds), and whose leaves must all be 'depth' levels down, and
+   be next in the leaf chain from *next_leaf; returns its number of keys,
+   or -1 if anything is wrong */
+static long verify_node(const bp_node *node, int has_lo, Key lo, int has_hi,
+                        Key hi, int depth, const bp_leaf **next_leaf) {
+    const bp_inner *inner = (const bp_inner *) node;
+    long n, total = 0;
+    int i;
+
+    if (node->count < 0 || node->count > BP_KEYS ||
+            node->leaf != (depth == 0))
+        return -1;
+    for (i = 0; i < BP_KEYS; i++) {
+        if (i >= node->count) {
+            if (node->keys[i] != BP_PAD) return -1;
+        } else if ((i > 0 && node->keys[i] <= node->keys[i - 1]) ||
+                   (has_lo && node->keys[i] <= lo) ||
+                   (has_hi && node->keys[i] > hi)) {
+            return -1;
+        }
+    }
+    if (node->leaf) {
+        if (node != &(*next_leaf)->n) return -1;
+        *next_leaf = (*next_leaf)->next;
+        return node->count;
+    }
+
+    for (i = 0; i <= node->count; i++) {
+        n = verify_node(inner->children[i],
+                        i > 0 ? 1 : has_lo, i > 0 ? node->keys[i - 1] : lo,
+                        i < node->count ? 1 : has_hi,
+                        i < node->count ? node->keys[i] : hi,
+                        depth - 1, next_leaf);
+        if (n < 0) return -1;
+        total += n;
+    }
+    return total;
+}
+
+int bp_verify(bp_tree *tree) {
+    const bp_node *node;
+    const bp_leaf *next_leaf;
+    long n;
+    int depth;
+
+    for (depth = 0, node = tree->root; !node->leaf; depth++)
+        node = ((const bp_inner *) node)->children[0];
+
+    next_leaf = (const bp_leaf *) node;
+    n = verify_node(tree->root, 0, 0, 0, 0, depth, &next_leaf);
+    return n >= 0 && next_leaf == NULL && (size_t) n == tree->node_count;
+}
+
+static void *ops_initialize(void) { return bp_initialize(); }
+static void ops_destroy(void *tree) { bp_destroy(tree); }
+static int ops_add(void *tree, Key key, int value) {
+    return bp_add(tree, key, value);
+}
+static int ops_delete(void *tree, Key key) { return bp_delete(tree, key); }
+static int ops_lookup(void *tree, Key key, int *value) {
+    return bp_lookup(tree, key, value);
+}
+static int ops_verify(void *tree) { return bp_verify(tree); }
+
+const tree_ops bp_ops = {
+    "bplus", ops_initialize, ops_destroy, ops_add, ops_delete, ops_lookup,
+    ops_verify
+};
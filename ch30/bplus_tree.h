@@ -0,0 +1,59 @@
+/*
+  Concurrent B+tree (see bplus_tree.c), with the same operations as
+  binary_tree.h: bp_add(), bp_delete() and bp_lookup() may be called from
+  any number of threads, and bp_lookup() never writes to shared memory.
+*/
+#ifndef BPLUS_TREE_H
+#define BPLUS_TREE_H
+
+#include <stddef.h>
+#include "node_pool.h"
+#include "tree_ops.h"               // Key, and bp_ops for this tree
+
+#define BP_KEYS 32                  // keys per node
+
+/* The part common to inner nodes and leaves. Unused key slots hold
+   BP_PAD, so a search can compare all BP_KEYS of them. */
+typedef struct bp_node {
+    unsigned long version;          // lock bit and counter; see bplus_tree.c
+    int count;                      // keys in use
+    int leaf;
+    Key keys[BP_KEYS];              // sorted
+} bp_node;
+
+typedef struct bp_inner {
+    bp_node n;
+    bp_node *children[BP_KEYS + 1]; // [i]: keys in (keys[i-1], keys[i]]
+} bp_inner;
+
+typedef struct bp_leaf {
+    bp_node n;
+    int values[BP_KEYS];
+    struct bp_leaf *next;           // the leaf to the right
+} bp_leaf;
+
+typedef struct bp_tree {
+    bp_node *root;
+    size_t node_count;              // keys, updated atomically
+    node_pool *inner_pool;
+    node_pool *leaf_pool;
+} bp_tree;
+
+bp_tree *bp_initialize(void);
+void bp_destroy(bp_tree *tree);
+
+// Returns 1 if 'key' was added, 0 if it was already present (unchanged)
+int bp_add(bp_tree *tree, Key key, int value);
+
+// Returns 1 if 'key' was removed, 0 if it wasn't present
+int bp_delete(bp_tree *tree, Key key);
+
+// Returns 1 and sets *value if 'key' is present, else returns 0
+int bp_lookup(bp_tree *tree, Key key, int *value);
+
+size_t bp_size(bp_tree *tree);
+
+// Checks ordering, separators, leaf depth, the leaf chain and node_count
+int bp_verify(bp_tree *tree);
+
+#endif
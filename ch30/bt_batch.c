@@ -0,0 +1,207 @@
+/*
+  add()/lookup()/delete() one key at a time, against add_batch(),
+  lookup_batch() and delete_batch() (binary_tree.c).
+
+  Usage: bt_batch [-t threads] [-n keys] [-b batch-size] [-s seed]
+
+  The keys 0..keys-1, shuffled, are split between the threads; each adds
+  its share to a fresh tree, then looks it all up, then deletes it all
+  again -- first singly, then (with a second tree) in batches of
+  batch-size. The time of each phase and the batch speedup are printed.
+*/
+
+#include <pthread.h>
+#include <time.h>
+#include "../lib/tlpi_hdr.h"
+#include "binary_tree.h"
+
+enum phase { ADD, LOOKUP, DELETE, NPHASES };
+
+static const char *phase_names[NPHASES] = { "add", "lookup", "delete" };
+
+typedef struct batch_args {
+    pthread_t tid;
+    bt_root *tree;
+    const Key *keys;                // this thread's share
+    const int *values;
+    size_t nkeys;
+    size_t batch;                   // 0: one key at a time
+    long errors;
+} batch_args;
+
+static pthread_barrier_t barrier;
+
+static unsigned long xorshift(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void do_phase(batch_args *a, enum phase phase) {
+    size_t i, m;
+    int value, *values, *found;
+
+    if (a->batch == 0) {
+        for (i = 0; i < a->nkeys; i++) {
+            switch (phase) {
+            case ADD:
+                a->errors += add(a->tree, a->keys[i], a->values[i]) != 1;
+                break;
+            case LOOKUP:
+                a->errors += !lookup(a->tree, a->keys[i], &value) ||
+                             value != a->values[i];
+                break;
+            default:
+                a->errors += delete(a->tree, a->keys[i]) != 1;
+                break;
+            }
+        }
+        return;
+    }
+
+    values = malloc(a->batch * sizeof(int));
+    found = malloc(a->batch * sizeof(int));
+    if (values == NULL || found == NULL) errExit("malloc");
+
+    for (i = 0; i < a->nkeys; i += m) {
+        m = a->nkeys - i < a->batch ? a->nkeys - i : a->batch;
+        switch (phase) {
+        case ADD:
+            a->errors += m - add_batch(a->tree, a->keys + i, a->values + i,
+                                       m);
+            break;
+        case LOOKUP:
+            a->errors += m - lookup_batch(a->tree, a->keys + i, values,
+                                          found, m);
+            break;
+        default:
+            a->errors += m - delete_batch(a->tree, a->keys + i, m);
+            break;
+        }
+    }
+
+    free(values);
+    free(found);
+}
+
+static void *worker(void *arg) {
+    batch_args *a = arg;
+    int phase;
+
+    for (phase = 0; phase < NPHASES; phase++) {
+        pthread_barrier_wait(&barrier);
+        do_phase(a, phase);
+        pthread_barrier_wait(&barrier);
+    }
+    return NULL;
+}
+
+/* Run the three phases with 'nthreads' threads; fills in secs[] */
+static void run(const Key *keys, const int *values, size_t nkeys,
+                unsigned nthreads, size_t batch, double *secs) {
+    batch_args *args;
+    bt_root *tree = initialize();
+    size_t share = nkeys / nthreads;
+    long errors = 0;
+    unsigned i;
+    int s, phase;
+    double t0;
+
+    args = calloc(nthreads, sizeof(batch_args));
+    if (args == NULL) errExit("calloc");
+    s = pthread_barrier_init(&barrier, NULL, nthreads + 1);
+    if (s != 0) errExitEN(s, "pthread_barrier_init");
+
+    for (i = 0; i < nthreads; i++) {
+        args[i].tree = tree;
+        args[i].keys = keys + i * share;
+        args[i].values = values + i * share;
+        args[i].nkeys = i < nthreads - 1 ? share : nkeys - i * share;
+        args[i].batch = batch;
+        s = pthread_create(&args[i].tid, NULL, worker, &args[i]);
+        if (s != 0) errExitEN(s, "pthread_create");
+    }
+
+    for (phase = 0; phase < NPHASES; phase++) {
+        t0 = now();
+        pthread_barrier_wait(&barrier);
+        pthread_barrier_wait(&barrier);
+        secs[phase] = now() - t0;
+        if (phase == ADD && (tree_size(tree) != nkeys || !verify_tree(tree)))
+            fatal("tree is inconsistent after adding");
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        s = pthread_join(args[i].tid, NULL);
+        if (s != 0) errExitEN(s, "pthread_join");
+        errors += args[i].errors;
+    }
+    pthread_barrier_destroy(&barrier);
+
+    if (errors != 0)
+        fatal("%ld operations failed (batch size %zu)", errors, batch);
+    if (tree_size(tree) != 0 || !verify_tree(tree))
+        fatal("tree is inconsistent after deleting");
+
+    destroy(tree);
+    free(args);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned nthreads = 4;
+    size_t nkeys = 1000000, batch = 4096, k, j;
+    unsigned long seed = 1, rng;
+    double single[NPHASES], batched[NPHASES];
+    Key *keys, t;
+    int *values, opt, phase;
+
+    while ((opt = getopt(argc, argv, "t:n:b:s:")) != -1) {
+        switch (opt) {
+        case 't': nthreads = getInt(optarg, GN_GT_0, "threads");   break;
+        case 'n': nkeys = getLong(optarg, GN_GT_0, "keys");        break;
+        case 'b': batch = getLong(optarg, GN_GT_0, "batch-size");  break;
+        case 's': seed = getLong(optarg, GN_GT_0, "seed");         break;
+        default:
+            usageErr("%s [-t threads] [-n keys] [-b batch-size] [-s seed]\n",
+                     argv[0]);
+        }
+    }
+
+    keys = malloc(nkeys * sizeof(Key));
+    values = malloc(nkeys * sizeof(int));
+    if (keys == NULL || values == NULL) errExit("malloc");
+    for (k = 0; k < nkeys; k++)
+        keys[k] = k;
+    rng = seed;
+    for (k = nkeys - 1; k > 0; k--) {
+        j = xorshift(&rng) % (k + 1);
+        t = keys[k]; keys[k] = keys[j]; keys[j] = t;
+    }
+    for (k = 0; k < nkeys; k++)
+        values[k] = (int) (keys[k] * 2654435761u);
+
+    run(keys, values, nkeys, nthreads, 0, single);
+    run(keys, values, nkeys, nthreads, batch, batched);
+
+    printf("%zu keys, %u threads, batches of %zu\n", nkeys, nthreads, batch);
+    printf("%-8s %10s %10s %10s %10s %8s\n", "", "single (s)", "Mops/s",
+           "batch (s)", "Mops/s", "speedup");
+    for (phase = 0; phase < NPHASES; phase++)
+        printf("%-8s %10.3f %10.2f %10.3f %10.2f %8.2f\n",
+               phase_names[phase], single[phase],
+               nkeys / single[phase] / 1e6, batched[phase],
+               nkeys / batched[phase] / 1e6, single[phase] / batched[phase]);
+
+    free(keys);
+    free(values);
+    exit(EXIT_SUCCESS);
+}
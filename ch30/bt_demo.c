@@ -0,0 +1,86 @@
+/*
+  Demonstration of binary_tree.c: keys 1..99 are added to a shared tree by
+  NUM_THREADS threads, each with one add_batch() of every NUM_THREADS'th
+  key (a thread per add() would spend far longer creating threads than
+  adding keys), and the tree is then printed depth first.
+*/
+
+#include <ctype.h>
+#include <alloca.h>
+#include "../lib/tlpi_hdr.h"
+#include "binary_tree.h"
+
+#define NUM_THREADS 4
+
+// pthread_create arguments
+typedef struct mt_node_arguments {
+    Key keys[100];
+    int values[100];
+    size_t count;
+    bt_root *root;
+} mt_args;
+
+void print_node_depth(const bt_node *node, int depth) {
+    (void) depth;                   // keys go on one line, unindented
+    if (isalnum(node->key)) {
+        printf("%c ", node->key);
+    } else {
+        printf("%X ", node->key);
+    }
+}
+
+void print_node(const bt_node *node) {
+    if (node != NULL) {
+        printf("node: %c\n", node->key);
+    }
+}
+
+void *mt_add(void *arg) {
+    mt_args *parameters = (mt_args*)arg;
+    add_batch(parameters->root, parameters->keys, parameters->values,
+              parameters->count);
+    return NULL;
+}
+
+int main() {
+    bt_root *root = initialize();
+    add(root, 'M', 1);
+
+    char __attribute__((__unused__)) letters[25] = {'G', 'A', 'Q', 'Z', 'J', 'C', 'L', 'U', 'P', 'V', 'T', 'O', 'E',
+                        'X', 'N', 'S', 'R', 'W', 'B', 'F', 'H', 'I', 'D', 'K', 'Y'};
+
+    int num = 100;
+    pthread_t threads[NUM_THREADS];
+    mt_args args[NUM_THREADS];
+
+    /* for(int i = 0; i < num; i++) { */
+    /*     mt_args *args = alloca(sizeof(mt_args)); */
+    /*     args->key = letters[i]; args->value = i; args->root = root; */
+    /*     int s = pthread_create(&threads[i], NULL, mt_add, args); */
+    /*     if (s != 0) errExitEN(s, "pthread_create"); */
+    /* } */
+
+    for(int t = 0; t < NUM_THREADS; t++) {
+        args[t].count = 0; args[t].root = root;
+    }
+    for(int i = 1; i < num; i++) {
+        mt_args *a = &args[i % NUM_THREADS];
+        a->keys[a->count] = i; a->values[a->count] = i; a->count++;
+    }
+
+    for(int t = 0; t < NUM_THREADS; t++) {
+        int s = pthread_create(&threads[t], NULL, mt_add, &args[t]);
+        if (s != 0) errExitEN(s, "pthread_create");
+    }
+
+    for(int t = 0; t < NUM_THREADS; t++) {
+        int s = pthread_join(threads[t], NULL);
+        if (s != 0) errExitEN(s, "pthread_join");
+    }
+
+    depth_first(root, &print_node_depth);
+    printf("\nnumber: %zd\n", tree_size(root));
+    if (!verify_tree(root)) fatal("tree is inconsistent");
+    destroy(root);
+    return 0;
+}
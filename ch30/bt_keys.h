@@ -0,0 +1,87 @@
+/*
+  Key types for the instantiations of binary_tree.c other than the
+  default one (see bt_template.h), with their comparisons and their
+  seqlock-safe loads and stores. All are inline, so that each
+  instantiation compiles them into its searches.
+*/
+#ifndef BT_KEYS_H
+#define BT_KEYS_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* 128-bit keys. There's no 16-byte atomic load short of libatomic (which
+   may take a lock), so a key is read and written as two 64-bit halves: a
+   reader can see half of an old key and half of a new one, but the
+   node's counter will have moved, and it will throw the key away. */
+
+typedef __uint128_t u128_key;
+typedef uint64_t u128_half __attribute__((may_alias));
+
+static inline u128_key u128_key_load(const u128_key *key) {
+    const u128_half *half = (const u128_half *) key;
+
+    return (u128_key) __atomic_load_n(&half[1], __ATOMIC_RELAXED) << 64 |
+           __atomic_load_n(&half[0], __ATOMIC_RELAXED);
+}
+
+static inline void u128_key_store(u128_key *key, u128_key value) {
+    u128_half *half = (u128_half *) key;
+
+    __atomic_store_n(&half[0], (uint64_t) value, __ATOMIC_RELAXED);
+    __atomic_store_n(&half[1], (uint64_t) (value >> 64), __ATOMIC_RELAXED);
+}
+
+/* String keys. The tree keeps a pointer to the caller's string, which
+   must stay valid (and unchanged) until the tree is destroyed, deleted or
+   not (see delete() in bt_template.h): a lock-free reader may still be
+   comparing against a key after it is deleted. Next
+   to the pointer is a copy of the string's first 8 bytes, as a big-endian
+   number (zero-padded), so that comparing two prefixes as numbers orders
+   them as strcmp() would. Most comparisons are decided by the prefixes
+   alone, without touching either string; and if they're equal and
+   contain the terminating null, so are the strings. Otherwise strcmp()
+   compares the strings whole (not from the ninth byte: a reader's torn
+   key can pair one key's prefix with a shorter key's string). */
+
+typedef struct str_key {
+    uint64_t prefix;
+    const char *str;
+} str_key;
+
+static inline str_key make_str_key(const char *str) {
+    str_key key;
+    int i;
+
+    key.prefix = 0;
+    for (i = 0; i < 8 && str[i] != '\0'; i++)
+        key.prefix |= (uint64_t) (unsigned char) str[i] << (56 - 8 * i);
+    key.str = str;
+    return key;
+}
+
+static inline int str_key_lt(str_key a, str_key b) {
+    if (a.prefix != b.prefix) return a.prefix < b.prefix;
+    if ((a.prefix & 0xff) == 0) return 0;       // both shorter than 8
+    return strcmp(a.str, b.str) < 0;
+}
+
+static inline int str_key_eq(str_key a, str_key b) {
+    return a.prefix == b.prefix &&
+           ((a.prefix & 0xff) == 0 || strcmp(a.str, b.str) == 0);
+}
+
+static inline str_key str_key_load(const str_key *key) {
+    str_key k;
+
+    k.prefix = __atomic_load_n(&key->prefix, __ATOMIC_RELAXED);
+    k.str = __atomic_load_n(&key->str, __ATOMIC_RELAXED);
+    return k;
+}
+
+static inline void str_key_store(str_key *key, str_key value) {
+    __atomic_store_n(&key->prefix, value.prefix, __ATOMIC_RELAXED);
+    __atomic_store_n(&key->str, value.str, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,161 @@
+/*
+  A restart of binary_tree.c from a snapshot (bt_snapshot.c), against
+  rebuilding the tree with add().
+
+  Usage: bt_restore [-n keys] [-t threads] [-f file] [-c] [-s seed]
+
+  A tree of 'keys' random keys is built with add() and saved to 'file'
+  (default bt_restore.snap, removed at the end). Then the snapshot is
+  just read (mapped and every key and value touched, the I/O floor), and
+  loaded with bulk_load() on one thread and on 'threads'. Each loaded
+  tree is checked against the original, and the height of each tree is
+  printed beside its time. With -c, the file's pages are dropped from the
+  page cache before each read, so that the I/O is real.
+*/
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "../lib/tlpi_hdr.h"
+#include "bt_snapshot.h"
+
+static int height;
+
+static unsigned long xorshift(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void note_depth(const bt_node *node, int depth) {
+    (void) node;
+    if (depth + 1 > height) height = depth + 1;
+}
+
+static int tree_height(bt_root *tree) {
+    height = 0;
+    depth_first(tree, note_depth);
+    return height;
+}
+
+/* Drop the file's pages from the page cache (they're clean: the snapshot
+   was fsync()ed), so the next read comes from the disk */
+static void drop_cache(const char *path) {
+    int fd, s;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) errExit("open");
+    s = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    if (s != 0) errExitEN(s, "posix_fadvise");
+    close(fd);
+}
+
+static void check(bt_root *tree, const Key *keys, const int *values,
+                  size_t nkeys, const char *what) {
+    size_t i;
+    int value;
+
+    if (tree_size(tree) != nkeys || !verify_tree(tree))
+        fatal("%s: tree is inconsistent", what);
+    for (i = 0; i < nkeys; i++)
+        if (!lookup(tree, keys[i], &value) || value != values[i])
+            fatal("%s: key %u is missing or wrong", what, keys[i]);
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = "bt_restore.snap";
+    unsigned nthreads = 4, t;
+    size_t nkeys = 1000000, i;
+    unsigned long seed = 1, rng, sum;
+    int cold = 0, opt, *values;
+    double t0, secs;
+    bt_snapshot snap;
+    bt_root *tree, *loaded;
+    struct stat sb;
+    char what[32];
+    Key *keys;
+
+    while ((opt = getopt(argc, argv, "n:t:f:cs:")) != -1) {
+        switch (opt) {
+        case 'n': nkeys = getLong(optarg, GN_GT_0, "keys");        break;
+        case 't': nthreads = getInt(optarg, GN_GT_0, "threads");   break;
+        case 'f': path = optarg;                                   break;
+        case 'c': cold = 1;                                        break;
+        case 's': seed = getLong(optarg, GN_GT_0, "seed");         break;
+        default:
+            usageErr("%s [-n keys] [-t threads] [-f file] [-c] [-s seed]\n",
+                     argv[0]);
+        }
+    }
+
+    keys = malloc(nkeys * sizeof(Key));
+    values = malloc(nkeys * sizeof(int));
+    if (keys == NULL || values == NULL) errExit("malloc");
+    rng = seed;
+    for (i = 0; i < nkeys; i++) {
+        keys[i] = (Key) xorshift(&rng);
+        values[i] = (int) (keys[i] * 2654435761u);
+    }
+
+    printf("%zu keys, %u threads%s\n", nkeys, nthreads,
+           cold ? ", cold page cache" : "");
+    printf("%-14s %10s %8s\n", "", "seconds", "height");
+
+    tree = initialize();
+    t0 = now();
+    for (i = 0; i < nkeys; i++)
+        add(tree, keys[i], values[i]);
+    secs = now() - t0;
+    printf("%-14s %10.3f %8d\n", "add()", secs, tree_height(tree));
+    nkeys = tree_size(tree);        // less any duplicate keys
+
+    t0 = now();
+    if (snapshot_save(tree, path) == -1) errExit("snapshot_save");
+    secs = now() - t0;
+    if (stat(path, &sb) == -1) errExit("stat");
+    printf("%-14s %10.3f %8s  (%.1f MB)\n", "save", secs, "",
+           sb.st_size / 1e6);
+
+    // Lookups below need the keys and values as the tree has them
+    if (snapshot_open(&snap, path) == -1) errExit("snapshot_open");
+    if (snap.count != nkeys) fatal("snapshot has %zu keys", snap.count);
+    memcpy(keys, snap.keys, nkeys * sizeof(Key));
+    memcpy(values, snap.values, nkeys * sizeof(int));
+    snapshot_close(&snap);
+
+    if (cold) drop_cache(path);
+    t0 = now();
+    if (snapshot_open(&snap, path) == -1) errExit("snapshot_open");
+    for (sum = 0, i = 0; i < snap.count; i++)
+        sum += snap.keys[i] + snap.values[i];
+    snapshot_close(&snap);
+    secs = now() - t0;
+    printf("%-14s %10.3f %8s  (checksum %lx)\n", "read", secs, "", sum);
+
+    for (t = 1; t <= nthreads; t = t < nthreads ? nthreads : t + 1) {
+        if (cold) drop_cache(path);
+        t0 = now();
+        loaded = snapshot_load(path, t);
+        secs = now() - t0;
+        if (loaded == NULL) errExit("snapshot_load");
+        snprintf(what, sizeof(what), "load, %u thr", t);
+        printf("%-14s %10.3f %8d\n", what, secs, tree_height(loaded));
+        check(loaded, keys, values, nkeys, what);
+        destroy(loaded);
+    }
+
+    destroy(tree);
+    unlink(path);
+    free(keys);
+    free(values);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,214 @@
+/*
+  Ordered scans of binary_tree.c while writers are busy, and the parallel
+  full scan.
+
+  Usage: bt_scan [-n keys] [-w writers] [-r scanners] [-t scan-threads]
+                 [-d seconds]
+
+  The tree holds the even keys 0, 2, ..., 2 * (keys - 1), which are never
+  touched, while the writers keep adding and deleting odd keys in the
+  same range. For 'seconds' the writers run alone, and then as long again
+  alongside the scanners, which range() over the whole tree again and
+  again, checking that every scan comes out in strictly increasing order
+  and includes every even key. The writers' throughput in the two cases
+  shows whether scanning holds them up.
+
+  Finally, with the writers stopped, one full range() is timed against
+  parallel_scan() with 'scan-threads' threads.
+*/
+
+#include <pthread.h>
+#include <time.h>
+#include "../lib/tlpi_hdr.h"
+#include "binary_tree.h"
+
+typedef struct thread_args {
+    pthread_t tid;
+    bt_root *tree;
+    Key nkeys;
+    unsigned long seed;
+    long count;                     // operations, or scans
+    long errors;
+} thread_args;
+
+typedef struct scan_check {
+    Key last;
+    int started;
+    long evens;
+    long errors;
+} scan_check;
+
+static int stop;
+
+static unsigned long xorshift(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *writer(void *arg) {
+    thread_args *a = arg;
+    unsigned long rng = a->seed;
+    Key key;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        key = 2 * (xorshift(&rng) % a->nkeys) + 1;
+        if (xorshift(&rng) & 1)
+            add(a->tree, key, (int) key);
+        else
+            delete(a->tree, key);
+        a->count++;
+    }
+    return NULL;
+}
+
+static int check_key(Key key, int value, void *arg) {
+    scan_check *c = arg;
+
+    if ((c->started && key <= c->last) || value != (int) key)
+        c->errors++;
+    c->started = 1;
+    c->last = key;
+    if (key % 2 == 0) c->evens++;
+    return 0;
+}
+
+static void *scanner(void *arg) {
+    thread_args *a = arg;
+    scan_check c;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        memset(&c, 0, sizeof(c));
+        range(a->tree, 0, (Key) -1, check_key, &c);
+        a->errors += c.errors + (c.evens != a->nkeys);
+        a->count++;
+    }
+    return NULL;
+}
+
+/* Run 'nwriters' writers and 'nscanners' scanners for 'secs' seconds;
+   returns the writers' operations per second */
+static double run(bt_root *tree, Key nkeys, unsigned nwriters,
+                  unsigned nscanners, double secs, long *scans) {
+    thread_args *args;
+    struct timespec ts;
+    unsigned i, n = nwriters + nscanners;
+    long ops = 0, errors = 0;
+    int s;
+
+    args = calloc(n, sizeof(thread_args));
+    if (args == NULL) errExit("calloc");
+
+    stop = 0;
+    for (i = 0; i < n; i++) {
+        args[i].tree = tree;
+        args[i].nkeys = nkeys;
+        args[i].seed = 7919 * (i + 1);
+        s = pthread_create(&args[i].tid, NULL,
+                           i < nwriters ? writer : scanner, &args[i]);
+        if (s != 0) errExitEN(s, "pthread_create");
+    }
+
+    ts.tv_sec = (time_t) secs;
+    ts.tv_nsec = (long) ((secs - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+    *scans = 0;
+    for (i = 0; i < n; i++) {
+        s = pthread_join(args[i].tid, NULL);
+        if (s != 0) errExitEN(s, "pthread_join");
+        if (i < nwriters) ops += args[i].count;
+        else *scans += args[i].count;
+        errors += args[i].errors;
+    }
+    if (errors != 0)
+        fatal("%ld scans were out of order or missed keys", errors);
+
+    free(args);
+    return ops / secs;
+}
+
+static int count_key(Key key, int value, void *arg) {
+    (void) key, (void) value, (void) arg;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned nwriters = 2, nscanners = 2, nthreads = 4;
+    Key nkeys = 200000, k, *keys;
+    int *values;
+    double secs = 2, alone, shared, t0, t_range, t_par;
+    size_t n_range, n_par;
+    long scans;
+    bt_root *tree;
+    unsigned long rng = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:w:r:t:d:")) != -1) {
+        switch (opt) {
+        case 'n': nkeys = getInt(optarg, GN_GT_0, "keys");              break;
+        case 'w': nwriters = getInt(optarg, GN_NONNEG, "writers");      break;
+        case 'r': nscanners = getInt(optarg, GN_NONNEG, "scanners");    break;
+        case 't': nthreads = getInt(optarg, GN_GT_0, "scan-threads");   break;
+        case 'd': secs = getInt(optarg, GN_GT_0, "seconds");            break;
+        default:
+            usageErr("%s [-n keys] [-w writers] [-r scanners] "
+                     "[-t scan-threads] [-d seconds]\n", argv[0]);
+        }
+    }
+
+    // the even keys, in random order so that the tree is bushy
+    keys = malloc(nkeys * sizeof(Key));
+    values = malloc(nkeys * sizeof(int));
+    if (keys == NULL || values == NULL) errExit("malloc");
+    for (k = 0; k < nkeys; k++)
+        keys[k] = 2 * k;
+    for (k = nkeys - 1; k > 0; k--) {
+        Key j = xorshift(&rng) % (k + 1), t = keys[k];
+        keys[k] = keys[j];
+        keys[j] = t;
+    }
+    for (k = 0; k < nkeys; k++)
+        values[k] = (int) keys[k];
+
+    tree = initialize();
+    add_batch(tree, keys, values, nkeys);
+
+    alone = run(tree, nkeys, nwriters, 0, secs, &scans);
+    shared = run(tree, nkeys, nwriters, nscanners, secs, &scans);
+
+    printf("%u writers, %u scanners, %u keys\n", nwriters, nscanners,
+           (unsigned) nkeys);
+    printf("writers alone:         %10.0f ops/s\n", alone);
+    printf("writers with scanners: %10.0f ops/s (%.0f%%), %ld full scans\n",
+           shared, alone > 0 ? 100 * shared / alone : 0, scans);
+
+    t0 = now();
+    n_range = range(tree, 0, (Key) -1, count_key, NULL);
+    t_range = now() - t0;
+    t0 = now();
+    n_par = parallel_scan(tree, nthreads, count_key, NULL);
+    t_par = now() - t0;
+    if (n_range != tree_size(tree) || n_par != tree_size(tree))
+        fatal("full scans found %zu and %zu keys, not %zu", n_range, n_par,
+              tree_size(tree));
+
+    printf("full scan of %zu keys: range() %.3f s, parallel_scan() with "
+           "%u threads %.3f s\n", n_range, t_range, nthreads, t_par);
+
+    if (!verify_tree(tree)) fatal("tree is inconsistent");
+    destroy(tree);
+    free(keys);
+    free(values);
+    exit(EXIT_SUCCESS);
+}
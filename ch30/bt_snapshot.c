@@ -0,0 +1,229 @@
+/*
+  Snapshots of a binary_tree.c tree, for a fast restart.
+
+  Rebuilding a tree with add() costs a search from the root and a node
+  per key; from a snapshot, bulk_load() builds it without a single
+  comparison, so a restart costs little more than reading the file.
+
+  The file is a header, then the keys (strictly increasing), then the
+  values, each an array in the machine's own representation:
+
+    offset 0                magic, key and value sizes, count,
+                            values_offset
+    offset HEADER_SIZE      Key keys[count]
+    offset values_offset    int values[count]     (8-byte aligned)
+
+  so a mapping of the file can be handed to bulk_load() as it is, with no
+  parsing or copying; the sizes in the header catch a snapshot written
+  for another Key type. It isn't portable between machines of different
+  byte order, which is the price of mapping it directly.
+
+  snapshot_save() walks the tree with the lock-free iterator, so writers
+  needn't stop: the keys come out sorted and distinct whatever they do,
+  and any key present for the whole walk is in the snapshot. It writes to
+  a temporary file and rename()s it over 'path', so a crash leaves either
+  the old snapshot or the new one; it then fsync()s the directory, so the
+  new name is on disk, too, when it returns.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bt_snapshot.h"
+
+#define SNAPSHOT_MAGIC  "BTSNAP\0\1"    // the last byte is the version
+
+typedef struct snapshot_header {
+    char magic[8];
+    uint32_t key_size;              // sizeof(Key)
+    uint32_t value_size;            // sizeof(int)
+    uint64_t count;
+    uint64_t values_offset;
+} snapshot_header;
+
+#define HEADER_SIZE     sizeof(snapshot_header)
+
+static void die(int err, const char *what) {
+    fprintf(stderr, "bt_snapshot: %s: %s\n", what, strerror(err));
+    abort();
+}
+
+static uint64_t values_offset(uint64_t count) {
+    return (HEADER_SIZE + count * sizeof(Key) + 7) & ~(uint64_t) 7;
+}
+
+// Like write(), but all of it; returns 0, or -1 with errno set
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* fsync() the directory holding 'path', making a rename() into it
+   durable; returns 0, or -1 with errno set */
+static int sync_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir;
+    int fd, s;
+
+    if (slash == NULL) {
+        dir = strdup(".");
+    } else {
+        dir = strndup(path, slash == path ? 1 : (size_t) (slash - path));
+    }
+    if (dir == NULL) die(ENOMEM, "strdup");
+    fd = open(dir, O_RDONLY | O_DIRECTORY);
+    free(dir);
+    if (fd == -1) return -1;
+
+    // Some file systems can't sync a directory (EINVAL); nothing to do then
+    s = fsync(fd) == -1 && errno != EINVAL ? errno : 0;
+    close(fd);
+    errno = s;
+    return s == 0 ? 0 : -1;
+}
+
+int snapshot_save(bt_root *tree, const char *path) {
+    static const char zeros[8];
+    snapshot_header h;
+    size_t n = 0, max, pad;
+    Key *keys, k;
+    int *values, v;
+    bt_iter it;
+    char *tmp;
+    int fd, saved;
+
+    // Collect first: the count goes in the header, before the arrays
+    max = tree_size(tree) + 1;
+    keys = malloc(max * sizeof(Key));
+    values = malloc(max * sizeof(int));
+    tmp = malloc(strlen(path) + sizeof(".tmp"));
+    if (keys == NULL || values == NULL || tmp == NULL) die(ENOMEM, "malloc");
+    iter_first(&it, tree);
+    while (iter_next(&it, &k, &v)) {
+        if (n == max) {
+            max *= 2;
+            keys = realloc(keys, max * sizeof(Key));
+            values = realloc(values, max * sizeof(int));
+            if (keys == NULL || values == NULL) die(ENOMEM, "realloc");
+        }
+        keys[n] = k;
+        values[n++] = v;
+    }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.key_size = sizeof(Key);
+    h.value_size = sizeof(int);
+    h.count = n;
+    h.values_offset = values_offset(n);
+    pad = h.values_offset - HEADER_SIZE - n * sizeof(Key);
+
+    sprintf(tmp, "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        saved = errno;
+        goto out;
+    }
+    if (write_all(fd, &h, sizeof(h)) == -1 ||
+            write_all(fd, keys, n * sizeof(Key)) == -1 ||
+            write_all(fd, zeros, pad) == -1 ||
+            write_all(fd, values, n * sizeof(int)) == -1 ||
+            fsync(fd) == -1) {
+        saved = errno;
+        close(fd);
+        unlink(tmp);
+        goto out;
+    }
+    saved = close(fd) == -1 || rename(tmp, path) == -1 ? errno : 0;
+    if (saved != 0) unlink(tmp);
+    else if (sync_dir(path) == -1) saved = errno;
+
+out:
+    free(tmp);
+    free(values);
+    free(keys);
+    errno = saved;
+    return saved == 0 ? 0 : -1;
+}
+
+int snapshot_open(bt_snapshot *snap, const char *path) {
+    const snapshot_header *h;
+    struct stat sb;
+    void *map;
+    int fd, saved;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    if (fstat(fd, &sb) == -1) {
+        saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    if ((size_t) sb.st_size < HEADER_SIZE) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    saved = errno;
+    close(fd);                      // the mapping keeps the file
+    if (map == MAP_FAILED) {
+        errno = saved;
+        return -1;
+    }
+
+    h = map;
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 ||
+            h->key_size != sizeof(Key) || h->value_size != sizeof(int) ||
+            h->count > (uint64_t) sb.st_size / sizeof(Key) ||
+            h->values_offset != values_offset(h->count) ||
+            h->values_offset + h->count * sizeof(int) !=
+                (uint64_t) sb.st_size) {
+        munmap(map, sb.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    // The whole file is about to be read; start reading it now
+    madvise(map, sb.st_size, MADV_WILLNEED);
+    snap->count = h->count;
+    snap->keys = (const Key *) ((const char *) map + HEADER_SIZE);
+    snap->values = (const int *) ((const char *) map + h->values_offset);
+    snap->map = map;
+    snap->map_size = sb.st_size;
+    return 0;
+}
+
+void snapshot_close(bt_snapshot *snap) {
+    munmap(snap->map, snap->map_size);
+    snap->map = NULL;
+}
+
+bt_root *snapshot_load(const char *path, unsigned nthreads) {
+    bt_snapshot snap;
+    bt_root *tree;
+
+    if (snapshot_open(&snap, path) == -1) return NULL;
+    tree = initialize();
+    bulk_load(tree, snap.keys, snap.values, snap.count, nthreads);
+    snapshot_close(&snap);
+    return tree;
+}
@@ -0,0 +1,33 @@
+/*
+  Snapshots of a binary_tree.c tree (see bt_snapshot.c): its keys and
+  values, sorted, in a file laid out to be used straight from mmap(), and
+  a restart that rebuilds the tree from one with bulk_load().
+*/
+#ifndef BT_SNAPSHOT_H
+#define BT_SNAPSHOT_H
+
+#include <stddef.h>
+#include "binary_tree.h"
+
+typedef struct bt_snapshot {
+    size_t count;
+    const Key *keys;                // count of them, strictly increasing
+    const int *values;
+    void *map;                      // the whole file
+    size_t map_size;
+} bt_snapshot;
+
+/* Writes the tree's keys and values to 'path', replacing it atomically
+   (by rename()). Other threads may go on changing the tree meanwhile, as
+   for iter_next(). Returns 0, or -1 with errno set. */
+int snapshot_save(bt_root *tree, const char *path);
+
+/* Maps the snapshot at 'path' read-only; returns 0, or -1 with errno set
+   (EINVAL if it isn't a snapshot of this Key and value type) */
+int snapshot_open(bt_snapshot *snap, const char *path);
+void snapshot_close(bt_snapshot *snap);
+
+// A new tree holding the snapshot at 'path', or NULL with errno set
+bt_root *snapshot_load(const char *path, unsigned nthreads);
+
+#endif
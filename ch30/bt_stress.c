@@ -0,0 +1,288 @@
+/*
+  Multi-threaded stress test and scaling benchmark for the ch30 trees.
+
+  Usage: bt_stress [-t max-threads] [-n total-ops] [-k key-range]
+                   [-l lookup-percent] [-s seed] [-i tree] [-S shards] [-p]
+
+  For 1, 2, 4, ... up to max-threads threads, a fresh tree is filled with
+  a random half of the keys 0..key-range-1 (inserted in random order, so
+  the tree is reasonably balanced), and then each thread performs its
+  share of random operations: lookups, and otherwise an even mix of add()
+  and delete(). The total number of operations is the same for every
+  thread count, so the times are directly comparable; the throughput and
+  the speedup over one thread are printed.
+
+  Each key is owned by one thread (key % threads), which is the only one
+  to operate on it, so every result can be checked exactly against the
+  owner's record of which of its keys are present -- while the other
+  threads are busy restructuring the tree around them. At the end the
+  tree's ordering, its size, and the presence of every key are checked;
+  for binary_tree.c, verify_tree() also checks that every sequence
+  counter is even again, its 'moves' included, which concurrent two-child
+  deletes once left odd (and every later failed lookup() spinning).
+
+  -i picks the implementation (see tree_ops.c): "bst" (binary_tree.c, the
+  default), "bst-locked" (the same, but with lookup_locked()), "avl"
+  (avl_tree.c), "skiplist" (skip_list.c), "bplus" (bplus_tree.c),
+  "sharded" (sharded_tree.c, over "bst"; -S sets the number of shards, by
+  default four per CPU, at most ST_MAX_SHARDS) or "bst-hash"
+  (hash_index.c: "bst" with a hash table for lookups).
+
+  -p times every add() and delete() and adds their median, 99th and 99.9th
+  percentile and worst latencies to the report: under write contention,
+  throughput can hide threads that are stuck waiting for a lock.
+*/
+
+#include <pthread.h>
+#include <time.h>
+#include "../lib/tlpi_hdr.h"
+#include "tree_ops.h"
+#include "sharded_tree.h"
+
+typedef struct stress_args {
+    pthread_t tid;
+    void *tree;
+    unsigned id;
+    unsigned nthreads;
+    long ops;
+    Key key_range;
+    int lookup_pct;
+    unsigned long seed;
+    char *present;                  // per key; only the owner writes
+    long errors;
+    long *latency;                  // ns per write, if -p; else NULL
+    long nlatency;
+} stress_args;
+
+static pthread_barrier_t start_barrier;
+static const tree_ops *ops = &bt_ops;
+static int want_latency;
+
+static unsigned long xorshift(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static long nsecs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int value_for(Key key) {
+    return (int) (key * 2654435761u);
+}
+
+static void *stress(void *arg) {
+    stress_args *a = arg;
+    unsigned long rng = a->seed;
+    long i;
+    Key key, owned;
+    int r, value;
+    long t0 = 0;
+
+    owned = (a->key_range - a->id + a->nthreads - 1) / a->nthreads;
+    pthread_barrier_wait(&start_barrier);
+
+    for (i = 0; i < a->ops; i++) {
+        key = (xorshift(&rng) % owned) * a->nthreads + a->id;
+        r = xorshift(&rng) % 100;
+
+        if (r < a->lookup_pct) {
+            if (ops->lookup(a->tree, key, &value) != a->present[key] ||
+                    (a->present[key] && value != value_for(key)))
+                a->errors++;
+        } else {
+            if (a->latency != NULL) t0 = nsecs();
+            if (r % 2 == 0) {
+                if (ops->add(a->tree, key, value_for(key)) != !a->present[key])
+                    a->errors++;
+                a->present[key] = 1;
+            } else {
+                if (ops->delete(a->tree, key) != a->present[key])
+                    a->errors++;
+                a->present[key] = 0;
+            }
+            if (a->latency != NULL) a->latency[a->nlatency++] = nsecs() - t0;
+        }
+    }
+
+    return NULL;
+}
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+/* Print the write latency percentiles of all threads, in microseconds */
+static void print_latency(stress_args *args, unsigned nthreads) {
+    long *all, n = 0;
+    unsigned i;
+
+    for (i = 0; i < nthreads; i++)
+        n += args[i].nlatency;
+    if (n == 0) {
+        printf("\n");
+        return;
+    }
+    all = malloc(n * sizeof(long));
+    if (all == NULL) errExit("malloc");
+    for (n = 0, i = 0; i < nthreads; i++) {
+        memcpy(all + n, args[i].latency, args[i].nlatency * sizeof(long));
+        n += args[i].nlatency;
+    }
+    qsort(all, n, sizeof(long), cmp_long);
+    printf(" %8.2f %8.2f %8.2f %10.2f\n", all[n / 2] / 1e3,
+           all[n * 99 / 100] / 1e3, all[n * 999 / 1000] / 1e3,
+           all[n - 1] / 1e3);
+    free(all);
+}
+
+/* Run one round with 'nthreads' threads, print its line of the report,
+   and return the elapsed seconds */
+static double run(unsigned nthreads, long total_ops, Key key_range,
+                  int lookup_pct, unsigned long seed, double base) {
+    stress_args *args;
+    void *tree;
+    char *present;
+    Key *order, k, j, t;
+    unsigned long rng;
+    long errors;
+    unsigned i;
+    int s, value;
+    struct timespec start, end;
+    double secs;
+
+    tree = ops->initialize();
+    present = calloc(key_range, 1);
+    order = malloc(key_range * sizeof(Key));
+    args = calloc(nthreads, sizeof(stress_args));
+    if (present == NULL || order == NULL || args == NULL)
+        errExit("calloc");
+
+    // prefill with a random half of the keys, in random order
+    rng = seed;
+    for (k = 0; k < key_range; k++) order[k] = k;
+    for (k = key_range - 1; k > 0; k--) {
+        j = xorshift(&rng) % (k + 1);
+        t = order[k]; order[k] = order[j]; order[j] = t;
+    }
+    for (k = 0; k < key_range / 2; k++) {
+        ops->add(tree, order[k], value_for(order[k]));
+        present[order[k]] = 1;
+    }
+
+    s = pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+    if (s != 0) errExitEN(s, "pthread_barrier_init");
+
+    for (i = 0; i < nthreads; i++) {
+        args[i].tree = tree;
+        args[i].id = i;
+        args[i].nthreads = nthreads;
+        args[i].ops = total_ops / nthreads;
+        args[i].key_range = key_range;
+        args[i].lookup_pct = lookup_pct;
+        args[i].seed = seed + 7919 * (i + 1);
+        args[i].present = present;
+        if (want_latency) {
+            args[i].latency = malloc(args[i].ops * sizeof(long));
+            if (args[i].latency == NULL) errExit("malloc");
+        }
+        s = pthread_create(&args[i].tid, NULL, stress, &args[i]);
+        if (s != 0) errExitEN(s, "pthread_create");
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    errors = 0;
+    for (i = 0; i < nthreads; i++) {
+        s = pthread_join(args[i].tid, NULL);
+        if (s != 0) errExitEN(s, "pthread_join");
+        errors += args[i].errors;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_barrier_destroy(&start_barrier);
+
+    if (errors != 0)
+        fatal("%u threads: %ld operations returned the wrong result",
+              nthreads, errors);
+    if (!ops->verify(tree))
+        fatal("%u threads: tree is inconsistent", nthreads);
+    for (k = 0; k < key_range; k++)
+        if (ops->lookup(tree, k, &value) != present[k])
+            fatal("%u threads: key %u is %s", nthreads, k,
+                  present[k] ? "missing" : "unexpectedly present");
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (nthreads == 1) base = secs;
+    printf("%8u %10.3f %10.2f %8.2f", nthreads, secs,
+           total_ops / secs / 1e6, base / secs);
+    if (want_latency)
+        print_latency(args, nthreads);
+    else
+        printf("\n");
+
+    for (i = 0; i < nthreads; i++)
+        free(args[i].latency);
+    ops->destroy(tree);
+    free(present);
+    free(order);
+    free(args);
+    return secs;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned max_threads = 8, nthreads;
+    long total_ops = 2000000;
+    Key key_range = 100000;
+    int lookup_pct = 50, opt;
+    unsigned long seed = 1;
+    double secs, base = 0;
+
+    while ((opt = getopt(argc, argv, "t:n:k:l:s:i:S:p")) != -1) {
+        switch (opt) {
+        case 't': max_threads = getInt(optarg, GN_GT_0, "max-threads"); break;
+        case 'n': total_ops = getLong(optarg, GN_GT_0, "ops");          break;
+        case 'k': key_range = getInt(optarg, GN_GT_0, "key-range");     break;
+        case 'l': lookup_pct = getInt(optarg, GN_NONNEG, "lookup-pct"); break;
+        case 's': seed = getLong(optarg, GN_GT_0, "seed");              break;
+        case 'i':
+            ops = find_tree_ops(optarg);
+            if (ops == NULL) cmdLineErr("unknown tree '%s'\n", optarg);
+            break;
+        case 'S':
+            st_ops_shards = getInt(optarg, GN_GT_0, "shards");
+            if (st_ops_shards > ST_MAX_SHARDS)
+                cmdLineErr("at most %d shards\n", ST_MAX_SHARDS);
+            break;
+        case 'p': want_latency = 1;                                      break;
+        default:
+            usageErr("%s [-t max-threads] [-n total-ops] [-k key-range] "
+                     "[-l lookup-pct] [-s seed] [-i tree] [-S shards] [-p]\n",
+                     argv[0]);
+        }
+    }
+    if (lookup_pct > 100) cmdLineErr("lookup-pct must be 0..100\n");
+    if (key_range < max_threads) cmdLineErr("key-range < max-threads\n");
+
+    printf("%s: %ld operations, %u keys, %d%% lookups\n", ops->name,
+           total_ops, key_range, lookup_pct);
+    printf("%8s %10s %10s %8s", "threads", "seconds", "Mops/s", "speedup");
+    if (want_latency)
+        printf(" %8s %8s %8s %10s", "p50 us", "p99", "p99.9", "max");
+    printf("\n");
+
+    for (nthreads = 1; ; nthreads *= 2) {
+        if (nthreads > max_threads) nthreads = max_threads;
+        secs = run(nthreads, total_ops, key_range, lookup_pct, seed, base);
+        if (nthreads == 1) base = secs;
+        if (nthreads == max_threads) break;
+    }
+
+    exit(EXIT_SUCCESS);
+}
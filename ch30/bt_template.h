@@ -0,0 +1,178 @@
+/*
+  The declarations of binary_tree.c, for any key and value types.
+
+  This header has no include guard: each inclusion declares one
+  instantiation of the tree, whose parameters the includer defines first.
+
+    BT_PREFIX   prepended to every public name (may be empty)
+    BT_KEY      the key type
+    BT_VALUE    the value type
+
+  and, used only by binary_tree.c,
+
+    BT_LT(a, b), BT_EQ(a, b)            compare two keys (default: < and ==)
+    BT_KEY_LOAD(field)                  read a key that a writer may be
+    BT_KEY_STORE(field, key)            changing, and write one (default:
+                                        LOAD() and STORE(), see seqlock.h)
+
+  binary_tree.h is the instantiation with the default names (Key and int);
+  u128_tree.h, str_tree.h and cstr_tree.h are others. The parameters are
+  undefined again at the end, unless BT_KEEP_PARAMS is defined, as it is
+  by the files that compile binary_tree.c for an instantiation.
+
+  initialize(), add(), delete() and lookup() may be called concurrently
+  from any number of threads; lookup() takes no locks. The traversal
+  helpers (breadth_first(), depth_first()) and destroy() are not
+  synchronised, and are only meant for a tree that no other thread is
+  using.
+*/
+
+#ifndef BT_TEMPLATE_COMMON
+#define BT_TEMPLATE_COMMON
+
+#include <stddef.h>
+#include <pthread.h>
+#include "node_pool.h"
+
+#define BT_CAT_(a, b)   a ## b
+#define BT_CAT(a, b)    BT_CAT_(a, b)
+#define BT_NAME(name)   BT_CAT(BT_PREFIX, name)
+
+// Where an iterator starts (see iter_start())
+enum bt_iter_from { BT_FIRST, BT_FROM_KEY, BT_AFTER_KEY };
+
+#endif
+
+#define BT_NODE BT_NAME(bt_node)
+#define BT_ROOT BT_NAME(bt_root)
+#define BT_ITER BT_NAME(bt_iter)
+#define BT_K    BT_NAME(bt_key)
+#define BT_V    BT_NAME(bt_value)
+
+// As types, so that 'const BT_K *' means what it says for pointer keys
+typedef BT_KEY BT_K;
+typedef BT_VALUE BT_V;
+
+/* What lookup() reads comes first, within one cache line (nodes are
+   cache-line aligned, see node_pool.c) */
+typedef struct BT_NODE {
+    BT_K key;
+    BT_V value;
+    struct BT_NODE *left;
+    struct BT_NODE *right;
+    unsigned long version;          // odd while they're being changed
+    pthread_mutex_t mutex;          // protects key, value, left and right
+} BT_NODE;
+
+/* Every search reads the first four fields, and every add() and delete()
+   writes the last two, so they're kept on separate cache lines */
+typedef struct BT_ROOT {
+    BT_NODE *root;
+    unsigned long version;          // odd while 'root' is being changed
+    unsigned long moves;            // odd while a key moves up (delete())
+    node_pool *pool;                // all nodes, live or unlinked
+    int shares_pool;                // 'pool' belongs to another tree
+    pthread_mutex_t mutex           // protects 'root', i.e. the root's parent
+        __attribute__((aligned(64)));
+    pthread_mutex_t moves_mutex;    // serialises writers of 'moves'
+    size_t node_count;              // updated atomically
+} BT_ROOT;
+
+BT_ROOT *BT_NAME(initialize)(void);
+void BT_NAME(destroy)(BT_ROOT *tree);
+
+/* A tree that takes its nodes from 'other''s pool, so that many small
+   trees (the shards of sharded_tree.c) share one pool and its slabs;
+   'other' must be destroyed after every tree sharing its pool */
+BT_ROOT *BT_NAME(initialize_sharing)(BT_ROOT *other);
+
+// Returns 1 if 'key' was added, 0 if it was already present (unchanged)
+int BT_NAME(add)(BT_ROOT *tree, BT_K key, BT_V value);
+
+/* Returns 1 if 'key' was removed, 0 if it wasn't present.
+
+   Key lifetime: a removed key isn't forgotten at once. A lock-free
+   reader may still be comparing against it, and its node (with the key)
+   stays in the pool until reused. So where the key points to storage --
+   the string trees, str_delete() and cstr_delete() -- that storage must
+   stay valid and unchanged until destroy(), even after delete() (or
+   delete_batch()) has removed it. The tree never copies or frees a
+   string. Callers that churn through keys should intern them (one copy
+   per distinct string, freed after destroy()) rather than allocate one
+   per add(), or the tree holds every string it has ever seen. */
+int BT_NAME(delete)(BT_ROOT *tree, BT_K key);
+
+// Returns 1 and sets *value if 'key' is present, else returns 0
+int BT_NAME(lookup)(BT_ROOT *tree, BT_K key, BT_V *value);
+int BT_NAME(lookup_locked)(BT_ROOT *tree, BT_K key,    // same, locking
+                           BT_V *value);
+
+/* Batch versions of the above, for many keys at a time (see
+   binary_tree.c). They return the number of keys added, found and
+   removed; lookup_batch() sets found[i] (if 'found' isn't NULL) and, if
+   so, values[i] (if 'values' isn't NULL) for each keys[i]. */
+size_t BT_NAME(add_batch)(BT_ROOT *tree, const BT_K *keys,
+                          const BT_V *values, size_t n);
+size_t BT_NAME(lookup_batch)(BT_ROOT *tree, const BT_K *keys,
+                             BT_V *values, int *found, size_t n);
+size_t BT_NAME(delete_batch)(BT_ROOT *tree, const BT_K *keys, size_t n);
+
+/* Fills an empty tree from keys[] (strictly increasing) and values[],
+   building it perfectly balanced in O(n), with up to 'nthreads' threads
+   (see binary_tree.c). Other threads see the tree empty until it's all
+   there. Otherwise -- the tree isn't empty, or the keys aren't sorted --
+   it's add_batch(). Returns the number of keys added. */
+size_t BT_NAME(bulk_load)(BT_ROOT *tree, const BT_K *keys,
+                          const BT_V *values, size_t n, unsigned nthreads);
+
+/* Ordered scans (see binary_tree.c): lock-free, and safe to run while
+   other threads change the tree. An iterator returns the keys from 'from'
+   upwards (or, from iter_first(), all of them), in order; range() calls
+   'callback' for each key in [lo, hi], in order, until it returns
+   nonzero; parallel_scan() calls it for every key, from 'nthreads'
+   threads at once, each working through its own stretches of the key
+   space in order. Both return the number of calls. */
+typedef struct BT_ITER {
+    BT_ROOT *tree;
+    BT_K key;                       // the last key returned, or 'from'
+    enum bt_iter_from from;
+    int done;
+} BT_ITER;
+
+void BT_NAME(iter_start)(BT_ITER *it, BT_ROOT *tree, BT_K from);
+void BT_NAME(iter_first)(BT_ITER *it, BT_ROOT *tree);
+int BT_NAME(iter_next)(BT_ITER *it, BT_K *key,         // 0 at the end
+                       BT_V *value);
+size_t BT_NAME(range)(BT_ROOT *tree, BT_K lo, BT_K hi,
+                      int (*callback)(BT_K key, BT_V value, void *arg),
+                      void *arg);
+size_t BT_NAME(parallel_scan)(BT_ROOT *tree, unsigned nthreads,
+                              int (*callback)(BT_K key, BT_V value,
+                                              void *arg),
+                              void *arg);
+
+size_t BT_NAME(tree_size)(BT_ROOT *tree);
+
+void BT_NAME(breadth_first)(BT_ROOT *tree,
+                            void (*action)(const BT_NODE *));
+void BT_NAME(depth_first)(BT_ROOT *tree,
+                          void (*action)(const BT_NODE *, int));
+
+// Checks ordering and node_count; returns 1 if consistent, else 0
+int BT_NAME(verify_tree)(BT_ROOT *tree);
+
+#undef BT_NODE
+#undef BT_ROOT
+#undef BT_ITER
+#undef BT_K
+#undef BT_V
+
+#ifndef BT_KEEP_PARAMS
+#undef BT_PREFIX
+#undef BT_KEY
+#undef BT_VALUE
+#undef BT_LT
+#undef BT_EQ
+#undef BT_KEY_LOAD
+#undef BT_KEY_STORE
+#endif
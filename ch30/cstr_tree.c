@@ -0,0 +1,7 @@
+/*
+  The plain string-key instantiation of binary_tree.c (see cstr_tree.h).
+*/
+
+#define BT_KEEP_PARAMS
+#include "cstr_tree.h"
+#include "binary_tree.c"
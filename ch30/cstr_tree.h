@@ -0,0 +1,21 @@
+/*
+  binary_tree.c with plain 'const char *' keys, compared by strcmp() at
+  every node, and void * values -- the interface the exercise asks for:
+  cstr_initialize(), cstr_add(), cstr_lookup() and so on (bt_template.h).
+  As in str_tree.h, the strings must outlive the tree, even once
+  cstr_delete() has removed them (see delete() in bt_template.h); the
+  cached prefixes of str_tree.h save most of the strcmp() calls made here.
+*/
+#ifndef CSTR_TREE_H
+#define CSTR_TREE_H
+
+#include <string.h>
+
+#define BT_PREFIX   cstr_
+#define BT_KEY      const char *
+#define BT_VALUE    void *
+#define BT_LT(a, b)             (strcmp(a, b) < 0)
+#define BT_EQ(a, b)             (strcmp(a, b) == 0)
+#include "bt_template.h"
+
+#endif
@@ -0,0 +1,191 @@
+/*
+  The cost of epoch-based reclamation (lib/ebr.c), to readers and to the
+  writer, and how much memory it leaves waiting.
+
+  Usage: ebr_bench [-t readers] [-d seconds] [-q quiescent-interval]
+
+  One writer keeps replacing a shared object with a new one, retiring the
+  old one, while the readers keep reading the current object and
+  checking that it hasn't been freed (reclaim() poisons an object before
+  it frees it). Each scheme runs for 'seconds':
+
+    none    no writer, so nothing to reclaim: the floor for the readers
+    ebr     each read inside ebr_enter() ... ebr_exit()
+    qsbr    readers stay inside and call ebr_quiescent() every
+            'quiescent-interval' reads
+
+  For each, the reads and replacements per second, the writer's mean and
+  worst time per ebr_retire(), and the most objects ever retired but not
+  yet reclaimed are printed. At the end the writer calls
+  ebr_synchronize(), after which nothing may be left unreclaimed.
+*/
+
+#include <pthread.h>
+#include <time.h>
+#include "../lib/tlpi_hdr.h"
+#include "../lib/ebr.h"
+
+#define MAGIC   0x5eedf00dUL
+#define POISON  0xdeadbeefUL
+
+enum scheme { NONE, EBR, QSBR, NSCHEMES };
+
+static const char *scheme_names[NSCHEMES] = { "none", "ebr", "qsbr" };
+
+typedef struct object {
+    unsigned long magic;
+    unsigned long payload[7];
+    ebr_entry retired;
+} object;
+
+static object *current;
+static ebr_domain *domain;
+static enum scheme scheme;
+static int quiescent_interval;
+static int stop;
+static long outstanding, peak;      // retired, not yet reclaimed
+
+static long nsecs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static object *new_object(void) {
+    object *o = malloc(sizeof(object));
+    int i;
+
+    if (o == NULL) errExit("malloc");
+    o->magic = MAGIC;
+    for (i = 0; i < 7; i++)
+        o->payload[i] = i;
+    return o;
+}
+
+static void reclaim(ebr_entry *entry) {
+    object *o = (object *) ((char *) entry - offsetof(object, retired));
+
+    o->magic = POISON;
+    free(o);
+    __atomic_sub_fetch(&outstanding, 1, __ATOMIC_RELAXED);
+}
+
+static void *reader(void *arg) {
+    long *reads = arg, n = 0;
+    unsigned long sum = 0;
+    object *o;
+    int i;
+
+    if (scheme == QSBR) ebr_enter(domain);
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        if (scheme == EBR) ebr_enter(domain);
+        o = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+        if (o->magic != MAGIC) fatal("read an object after reclaim()");
+        for (i = 0; i < 7; i++)
+            sum += o->payload[i];
+        if (scheme == EBR) ebr_exit(domain);
+        if (++n % quiescent_interval == 0 && scheme == QSBR)
+            ebr_quiescent(domain);
+    }
+    if (scheme == QSBR) ebr_exit(domain);
+    *reads = n + (sum == 42);       // keep 'sum', and so the reads
+    return NULL;
+}
+
+static void *writer(void *arg) {
+    long *stats = arg;              // replacements, total ns, worst ns
+    long t0, ns, o;
+    object *old;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        old = __atomic_exchange_n(&current, new_object(), __ATOMIC_ACQ_REL);
+        o = __atomic_add_fetch(&outstanding, 1, __ATOMIC_RELAXED);
+        if (o > peak) peak = o;
+        t0 = nsecs();
+        ebr_retire(domain, &old->retired);
+        ns = nsecs() - t0;
+        stats[0]++;
+        stats[1] += ns;
+        if (ns > stats[2]) stats[2] = ns;
+    }
+    ebr_synchronize(domain);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned nreaders = 4, i;
+    int secs = 2, opt, s;
+    pthread_t *tids, wtid;
+    long *reads, stats[3], total;
+    struct timespec ts;
+
+    quiescent_interval = 100;
+    while ((opt = getopt(argc, argv, "t:d:q:")) != -1) {
+        switch (opt) {
+        case 't': nreaders = getInt(optarg, GN_GT_0, "readers");  break;
+        case 'd': secs = getInt(optarg, GN_GT_0, "seconds");      break;
+        case 'q': quiescent_interval =
+                      getInt(optarg, GN_GT_0, "quiescent-interval");
+                  break;
+        default:
+            usageErr("%s [-t readers] [-d seconds] "
+                     "[-q quiescent-interval]\n", argv[0]);
+        }
+    }
+
+    tids = calloc(nreaders, sizeof(pthread_t));
+    reads = calloc(nreaders, sizeof(long));
+    if (tids == NULL || reads == NULL) errExit("calloc");
+
+    printf("%u readers, %d s per scheme, quiescent every %d reads\n",
+           nreaders, secs, quiescent_interval);
+    printf("%-6s %12s %12s %12s %12s %10s\n", "", "reads/s", "replaced/s",
+           "retire (ns)", "worst (us)", "peak");
+
+    for (scheme = 0; scheme < NSCHEMES; scheme++) {
+        domain = ebr_create(reclaim);
+        current = new_object();
+        outstanding = peak = 0;
+        memset(stats, 0, sizeof(stats));
+        stop = 0;
+
+        for (i = 0; i < nreaders; i++) {
+            s = pthread_create(&tids[i], NULL, reader, &reads[i]);
+            if (s != 0) errExitEN(s, "pthread_create");
+        }
+        if (scheme != NONE) {
+            s = pthread_create(&wtid, NULL, writer, stats);
+            if (s != 0) errExitEN(s, "pthread_create");
+        }
+        ts.tv_sec = secs;
+        ts.tv_nsec = 0;
+        nanosleep(&ts, NULL);
+        __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+        if (scheme != NONE) {
+            s = pthread_join(wtid, NULL);
+            if (s != 0) errExitEN(s, "pthread_join");
+        }
+        for (total = 0, i = 0; i < nreaders; i++) {
+            s = pthread_join(tids[i], NULL);
+            if (s != 0) errExitEN(s, "pthread_join");
+            total += reads[i];
+        }
+
+        printf("%-6s %12.0f %12.0f %12.0f %12.1f %10ld\n",
+               scheme_names[scheme], (double) total / secs,
+               (double) stats[0] / secs,
+               stats[0] > 0 ? (double) stats[1] / stats[0] : 0.0,
+               stats[2] / 1e3, peak);
+
+        if (outstanding != 0)
+            fatal("%s: %ld objects left after ebr_synchronize()",
+                  scheme_names[scheme], outstanding);
+        ebr_destroy(domain);
+        free(current);
+    }
+
+    free(tids);
+    free(reads);
+    exit(EXIT_SUCCESS);
+}
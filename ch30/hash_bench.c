@@ -0,0 +1,234 @@
+/*
+  binary_tree.c alone against binary_tree.c with a hash index
+  (hash_index.c), on a mix of point lookups, range queries and writes.
+
+  Usage: hash_bench [-t threads] [-n keys] [-w write-pct] [-r range-pct]
+                    [-l range-length] [-d seconds]
+
+  First each structure is filled from empty with a random half of the
+  keys 0..2*keys-1, by all the threads at once, timing every add(): the
+  hash index resizes itself many times on the way, and the worst add()
+  shows whether that ever holds writers up. Then for 'seconds' each
+  thread picks operations at random: write-pct% adds and deletes,
+  range-pct% range queries over range-length consecutive keys, and point
+  lookups otherwise. Point lookups and writes go to the hash index where
+  there is one; range queries always go to the tree.
+*/
+
+#include <pthread.h>
+#include <time.h>
+#include "../lib/tlpi_hdr.h"
+#include "hash_index.h"
+
+enum op { WRITE, RANGE, POINT, NOPS };
+
+typedef struct bench_args {
+    pthread_t tid;
+    void *tree;                     // bt_root, or hash_index
+    const Key *keys;                // fill: this thread's share
+    size_t nkeys;
+    unsigned long seed;
+    long counts[NOPS];
+    long max_ns;                    // fill: the slowest add()
+} bench_args;
+
+static int use_hash;
+static Key key_range;
+static int write_pct, range_pct;
+static Key range_len;
+static int stop;
+
+static unsigned long xorshift(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static long nsecs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int do_add(void *tree, Key key) {
+    return use_hash ? hx_add(tree, key, (int) key) : add(tree, key, (int) key);
+}
+
+static int count_key(Key key, int value, void *arg) {
+    (void) key, (void) value, (void) arg;
+    return 0;
+}
+
+static void *fill(void *arg) {
+    bench_args *a = arg;
+    size_t i;
+    long t0, ns;
+
+    for (i = 0; i < a->nkeys; i++) {
+        t0 = nsecs();
+        do_add(a->tree, a->keys[i]);
+        ns = nsecs() - t0;
+        if (ns > a->max_ns) a->max_ns = ns;
+    }
+    return NULL;
+}
+
+static void *mix(void *arg) {
+    bench_args *a = arg;
+    unsigned long rng = a->seed;
+    Key key;
+    int r, value;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        key = xorshift(&rng) % key_range;
+        r = xorshift(&rng) % 100;
+        if (r < write_pct) {
+            if (r % 2 == 0)
+                do_add(a->tree, key);
+            else if (use_hash)
+                hx_delete(a->tree, key);
+            else
+                delete(a->tree, key);
+            a->counts[WRITE]++;
+        } else if (r < write_pct + range_pct) {
+            if (use_hash)
+                hx_range(a->tree, key, key + range_len - 1, count_key, NULL);
+            else
+                range(a->tree, key, key + range_len - 1, count_key, NULL);
+            a->counts[RANGE]++;
+        } else {
+            if (use_hash)
+                hx_lookup(a->tree, key, &value);
+            else
+                lookup(a->tree, key, &value);
+            a->counts[POINT]++;
+        }
+    }
+    return NULL;
+}
+
+/* Start 'nthreads' threads running 'func' on 'tree'; if 'secs' > 0, stop
+   them after that long. Fills in the threads' args. */
+static void run_threads(bench_args *args, unsigned nthreads,
+                        void *(*func)(void *), double secs) {
+    struct timespec ts;
+    unsigned i;
+    int s;
+
+    stop = 0;
+    for (i = 0; i < nthreads; i++) {
+        s = pthread_create(&args[i].tid, NULL, func, &args[i]);
+        if (s != 0) errExitEN(s, "pthread_create");
+    }
+    if (secs > 0) {
+        ts.tv_sec = (time_t) secs;
+        ts.tv_nsec = (long) ((secs - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+        __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < nthreads; i++) {
+        s = pthread_join(args[i].tid, NULL);
+        if (s != 0) errExitEN(s, "pthread_join");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    unsigned nthreads = 4, i;
+    size_t nkeys = 500000, k, j, share;
+    double secs = 2, fill_secs;
+    long t0, max_ns, totals[NOPS];
+    bench_args *args;
+    Key *keys, t;
+    unsigned long rng = 1;
+    void *tree;
+    int opt, op;
+
+    write_pct = 10;
+    range_pct = 10;
+    range_len = 100;
+    while ((opt = getopt(argc, argv, "t:n:w:r:l:d:")) != -1) {
+        switch (opt) {
+        case 't': nthreads = getInt(optarg, GN_GT_0, "threads");        break;
+        case 'n': nkeys = getLong(optarg, GN_GT_0, "keys");             break;
+        case 'w': write_pct = getInt(optarg, GN_NONNEG, "write-pct");   break;
+        case 'r': range_pct = getInt(optarg, GN_NONNEG, "range-pct");   break;
+        case 'l': range_len = getInt(optarg, GN_GT_0, "range-length");  break;
+        case 'd': secs = getInt(optarg, GN_GT_0, "seconds");            break;
+        default:
+            usageErr("%s [-t threads] [-n keys] [-w write-pct] "
+                     "[-r range-pct] [-l range-length] [-d seconds]\n",
+                     argv[0]);
+        }
+    }
+    if (write_pct + range_pct > 100)
+        cmdLineErr("write-pct + range-pct must be at most 100\n");
+
+    // a random half of 0..2*nkeys-1, in random order
+    key_range = 2 * nkeys;
+    keys = malloc(key_range * sizeof(Key));
+    args = malloc(nthreads * sizeof(bench_args));
+    if (keys == NULL || args == NULL) errExit("malloc");
+    for (k = 0; k < key_range; k++)
+        keys[k] = k;
+    for (k = key_range - 1; k > 0; k--) {
+        j = xorshift(&rng) % (k + 1);
+        t = keys[k]; keys[k] = keys[j]; keys[j] = t;
+    }
+    share = nkeys / nthreads;
+
+    printf("%zu keys, %u threads: %d%% writes, %d%% ranges of %u keys, "
+           "%d%% point lookups\n", nkeys, nthreads, write_pct, range_pct,
+           (unsigned) range_len, 100 - write_pct - range_pct);
+    printf("%-9s %8s %10s %8s %10s %10s %10s\n", "", "fill (s)",
+           "worst add", "resizes", "points/s", "ranges/s", "writes/s");
+
+    for (use_hash = 0; use_hash <= 1; use_hash++) {
+        tree = use_hash ? (void *) hx_initialize() : (void *) initialize();
+
+        memset(args, 0, nthreads * sizeof(bench_args));
+        for (i = 0; i < nthreads; i++) {
+            args[i].tree = tree;
+            args[i].keys = keys + i * share;
+            args[i].nkeys = i < nthreads - 1 ? share : nkeys - i * share;
+        }
+        t0 = nsecs();
+        run_threads(args, nthreads, fill, 0);
+        fill_secs = (nsecs() - t0) / 1e9;
+        max_ns = 0;
+        for (i = 0; i < nthreads; i++)
+            if (args[i].max_ns > max_ns) max_ns = args[i].max_ns;
+
+        memset(args, 0, nthreads * sizeof(bench_args));
+        for (i = 0; i < nthreads; i++) {
+            args[i].tree = tree;
+            args[i].seed = 7919 * (i + 1);
+        }
+        run_threads(args, nthreads, mix, secs);
+        for (op = 0; op < NOPS; op++) {
+            totals[op] = 0;
+            for (i = 0; i < nthreads; i++)
+                totals[op] += args[i].counts[op];
+        }
+
+        printf("%-9s %8.3f %7.0f us %8lu %10.0f %10.0f %10.0f\n",
+               use_hash ? "bst-hash" : "bst", fill_secs, max_ns / 1e3,
+               use_hash ? ((hash_index *) tree)->resizes : 0,
+               totals[POINT] / secs, totals[RANGE] / secs,
+               totals[WRITE] / secs);
+
+        if (use_hash) {
+            if (!hx_verify(tree)) fatal("hash index is inconsistent");
+            hx_destroy(tree);
+        } else {
+            if (!verify_tree(tree)) fatal("tree is inconsistent");
+            destroy(tree);
+        }
+    }
+
+    free(keys);
+    free(args);
+    exit(EXIT_SUCCESS);
+}
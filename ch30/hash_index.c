@@ -0,0 +1,375 @@
+/*
+  A hash index alongside binary_tree.c.
+
+  A point lookup in the tree is a chain of dependent loads, one cache miss
+  per level; in a hash table it is, mostly, a single miss. So hx_lookup()
+  asks an open-addressing table (linear probing), and only hx_range()
+  goes to the tree.
+
+  Writers: hx_add() and hx_delete() change the tree first, and mirror the
+  result into the table. Both steps happen under the mutex of the key's
+  stripe, so that two writers of one key can't leave the tree and the
+  table disagreeing; writers of different stripes only meet inside the
+  tree (and on table slots, claimed with compare-and-swap). A point
+  lookup may see a change a moment before or after a range query does.
+
+  Readers take no locks. A slot's key, once claimed, never changes, and
+  its state -- value present, key absent, or not written yet -- is one
+  word, so a reader always sees a consistent state. Deleted keys leave
+  their slot claimed (marked absent), to be reused if the key comes back.
+
+  Resizing is incremental. When claimed slots (live or deleted) pass half
+  the table, a writer allocates a table sized for the live keys and
+  publishes it as 'next'; from then on, writers write only to the new
+  table, and each writer also moves HX_MIGRATE slots' worth of keys
+  across before its own operation. Readers look in the new table first,
+  and in the old one if the key hasn't arrived yet. Before anyone starts
+  moving keys, the resizer takes and drops each stripe mutex in turn, so
+  no writer that missed the new table is still writing to the old one; a
+  key is moved under its stripe mutex, so it can't race with its writers.
+  Whoever moves the last slot installs the new table and retires the old
+  one through EBR (lib/ebr.c), since readers may still be probing it.
+  Nothing ever waits for the whole table to be copied.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hash_index.h"
+
+#define HX_MIN      1024            // slots
+#define HX_MIGRATE  64              // slots moved per write during a resize
+
+// The state word of a slot
+#define HX_UNSET    0UL             // key claimed, state not yet written
+#define HX_ABSENT   2UL
+#define HX_PRESENT(value)   ((unsigned long) (unsigned) (value) << 2 | 1)
+#define HX_VALUE(state)     ((int) (unsigned) ((state) >> 2))
+
+typedef struct hx_slot {
+    unsigned long key;              // key + 1; 0 while the slot is empty
+    unsigned long state;
+} hx_slot;
+
+struct hx_table {
+    size_t mask;                    // slots - 1
+    int bits;                       // log2(slots)
+    size_t claimed;                 // slots with a key, updated atomically
+    ebr_entry retired;
+    // while this table is the 'next' one:
+    hx_table *from;                 // the table being moved out of
+    size_t from_slots;
+    int ready;                      // set once moving may start
+    size_t move_next;               // next slot of 'from' to take
+    size_t moved;                   // slots of 'from' done
+    hx_slot slots[];
+};
+
+static void die(int err, const char *what) {
+    fprintf(stderr, "hash_index: %s: %s\n", what, strerror(err));
+    abort();
+}
+
+static void lock_mutex(pthread_mutex_t *mutex) {
+    int s = pthread_mutex_lock(mutex);
+    if (s != 0) { die(s, "pthread_mutex_lock"); }
+}
+
+static void unlock_mutex(pthread_mutex_t *mutex) {
+    int s = pthread_mutex_unlock(mutex);
+    if (s != 0) { die(s, "pthread_mutex_unlock"); }
+}
+
+static hx_table *new_table(size_t slots) {
+    hx_table *t;
+    int bits = 0;
+
+    while (((size_t) 1 << bits) < slots) bits++;
+    t = calloc(1, sizeof(hx_table) + ((size_t) 1 << bits) * sizeof(hx_slot));
+    if (t == NULL) { die(ENOMEM, "calloc"); }
+    t->mask = ((size_t) 1 << bits) - 1;
+    t->bits = bits;
+    return t;
+}
+
+static void reclaim_table(ebr_entry *entry) {
+    free((char *) entry - offsetof(hx_table, retired));
+}
+
+// Fibonacci hashing: the top bits of the product
+static size_t home(const hx_table *t, Key key) {
+    return (size_t) (((unsigned long long) key * 0x9E3779B97F4A7C15ULL) >>
+                     (64 - t->bits));
+}
+
+static hx_stripe *stripe_of(hash_index *ix, Key key) {
+    return &ix->stripes[(unsigned) (key * 2654435761u) % HX_STRIPES];
+}
+
+/* The state of 'key' in 't', or HX_UNSET if it has no slot there */
+static unsigned long probe(const hx_table *t, Key key) {
+    size_t i;
+    unsigned long k;
+
+    for (i = home(t, key); ; i = (i + 1) & t->mask) {
+        k = __atomic_load_n(&t->slots[i].key, __ATOMIC_ACQUIRE);
+        if (k == 0) return HX_UNSET;
+        if (k == (unsigned long) key + 1)
+            return __atomic_load_n(&t->slots[i].state, __ATOMIC_ACQUIRE);
+    }
+}
+
+/* The slot of 'key' in 't', claiming one if it has none; the caller holds
+   the key's stripe */
+static hx_slot *claim(hx_table *t, Key key) {
+    unsigned long want = (unsigned long) key + 1, k;
+    size_t i;
+
+    for (i = home(t, key); ; i = (i + 1) & t->mask) {
+        k = __atomic_load_n(&t->slots[i].key, __ATOMIC_ACQUIRE);
+        if (k == 0) {
+            if (__atomic_compare_exchange_n(&t->slots[i].key, &k, want, 0,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                __atomic_add_fetch(&t->claimed, 1, __ATOMIC_RELAXED);
+                return &t->slots[i];
+            }
+            // another key took it; k is now that key
+        }
+        if (k == want) return &t->slots[i];
+    }
+}
+
+/* Move the next HX_MIGRATE slots of the table being replaced, if a resize
+   is under way; installs the new table after the last of them */
+static void move_some(hash_index *ix) {
+    hx_table *next = __atomic_load_n(&ix->next, __ATOMIC_ACQUIRE), *from;
+    size_t i, start, end;
+    unsigned long k, state;
+    hx_stripe *stripe;
+
+    if (next == NULL || !__atomic_load_n(&next->ready, __ATOMIC_ACQUIRE))
+        return;
+    start = __atomic_fetch_add(&next->move_next, HX_MIGRATE,
+                               __ATOMIC_RELAXED);
+    if (start >= next->from_slots) return;
+    end = start + HX_MIGRATE < next->from_slots ? start + HX_MIGRATE
+                                                : next->from_slots;
+    from = next->from;
+
+    for (i = start; i < end; i++) {
+        k = __atomic_load_n(&from->slots[i].key, __ATOMIC_ACQUIRE);
+        if (k == 0) continue;
+        stripe = stripe_of(ix, (Key) (k - 1));
+        lock_mutex(&stripe->mutex);
+        state = __atomic_load_n(&from->slots[i].state, __ATOMIC_ACQUIRE);
+        if ((state & 1) && probe(next, (Key) (k - 1)) == HX_UNSET)
+            __atomic_store_n(&claim(next, (Key) (k - 1))->state, state,
+                             __ATOMIC_RELEASE);
+        unlock_mutex(&stripe->mutex);
+    }
+
+    if (__atomic_add_fetch(&next->moved, end - start, __ATOMIC_ACQ_REL) ==
+            next->from_slots) {
+        __atomic_store_n(&ix->table, next, __ATOMIC_RELEASE);
+        __atomic_store_n(&ix->next, NULL, __ATOMIC_RELEASE);
+        ebr_retire(ix->ebr, &from->retired);
+    }
+}
+
+/* Start a resize if the table is over half claimed and none is running.
+   The tables are read inside an EBR section, since a resize finishing
+   meanwhile may retire the one we look at. */
+static void maybe_resize(hash_index *ix) {
+    hx_table *t, *next;
+    size_t slots, live;
+    int i;
+
+    ebr_enter(ix->ebr);
+    t = __atomic_load_n(&ix->table, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&t->claimed, __ATOMIC_RELAXED) <= (t->mask + 1) / 2 ||
+            pthread_mutex_trylock(&ix->resize_mutex) != 0) {
+        ebr_exit(ix->ebr);
+        return;
+    }
+
+    /* 'next' first, as in hx_lookup(): if it's NULL, 'table' is the
+       current table, and stays so while we hold resize_mutex */
+    next = __atomic_load_n(&ix->next, __ATOMIC_ACQUIRE);
+    t = __atomic_load_n(&ix->table, __ATOMIC_ACQUIRE);
+    if (next != NULL ||
+            __atomic_load_n(&t->claimed, __ATOMIC_RELAXED) <=
+            (t->mask + 1) / 2) {
+        unlock_mutex(&ix->resize_mutex);
+        ebr_exit(ix->ebr);
+        return;
+    }
+
+    /* Room for four times the live keys (and at least half the old size,
+       so that the writes made while moving can't fill it) */
+    live = tree_size(ix->tree);
+    slots = 4 * live > (t->mask + 1) / 2 ? 4 * live : (t->mask + 1) / 2;
+    next = new_table(slots > HX_MIN ? slots : HX_MIN);
+    next->from = t;
+    next->from_slots = t->mask + 1;
+    __atomic_store_n(&ix->next, next, __ATOMIC_RELEASE);
+
+    for (i = 0; i < HX_STRIPES; i++) {
+        lock_mutex(&ix->stripes[i].mutex);
+        unlock_mutex(&ix->stripes[i].mutex);
+    }
+    __atomic_store_n(&next->ready, 1, __ATOMIC_RELEASE);
+    ix->resizes++;
+    unlock_mutex(&ix->resize_mutex);
+    ebr_exit(ix->ebr);
+}
+
+/* Set the state of 'key' in whichever table writers use; the caller holds
+   the key's stripe */
+static void set_state(hash_index *ix, Key key, unsigned long state) {
+    hx_table *t = __atomic_load_n(&ix->next, __ATOMIC_ACQUIRE);
+
+    if (t == NULL) t = __atomic_load_n(&ix->table, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&claim(t, key)->state, state, __ATOMIC_RELEASE);
+}
+
+hash_index *hx_initialize(void) {
+    hash_index *ix;
+    int s, i;
+
+    s = posix_memalign((void **) &ix, 64, sizeof(hash_index));
+    if (s != 0) { die(s, "posix_memalign"); }
+    memset(ix, 0, sizeof(hash_index));
+    ix->tree = initialize();
+    ix->table = new_table(HX_MIN);
+    ix->next = NULL;
+    pthread_mutex_init(&ix->resize_mutex, NULL);
+    ix->ebr = ebr_create(reclaim_table);
+    for (i = 0; i < HX_STRIPES; i++)
+        pthread_mutex_init(&ix->stripes[i].mutex, NULL);
+    return ix;
+}
+
+void hx_destroy(hash_index *ix) {
+    int i;
+
+    ebr_destroy(ix->ebr);
+    if (ix->next != NULL) free(ix->next);
+    free(ix->table);
+    destroy(ix->tree);
+    pthread_mutex_destroy(&ix->resize_mutex);
+    for (i = 0; i < HX_STRIPES; i++)
+        pthread_mutex_destroy(&ix->stripes[i].mutex);
+    free(ix);
+}
+
+int hx_add(hash_index *ix, Key key, int value) {
+    hx_stripe *stripe = stripe_of(ix, key);
+    int added;
+
+    ebr_enter(ix->ebr);
+    move_some(ix);
+    lock_mutex(&stripe->mutex);
+    added = add(ix->tree, key, value);
+    if (added) set_state(ix, key, HX_PRESENT(value));
+    unlock_mutex(&stripe->mutex);
+    ebr_exit(ix->ebr);
+
+    if (added) maybe_resize(ix);
+    return added;
+}
+
+int hx_delete(hash_index *ix, Key key) {
+    hx_stripe *stripe = stripe_of(ix, key);
+    int removed;
+
+    ebr_enter(ix->ebr);
+    move_some(ix);
+    lock_mutex(&stripe->mutex);
+    removed = delete(ix->tree, key);
+    if (removed) set_state(ix, key, HX_ABSENT);
+    unlock_mutex(&stripe->mutex);
+    ebr_exit(ix->ebr);
+    return removed;
+}
+
+int hx_lookup(hash_index *ix, Key key, int *value) {
+    hx_table *next, *t;
+    unsigned long state = HX_UNSET;
+
+    ebr_enter(ix->ebr);
+    // 'next' first: once it's gone, 'table' is what it was
+    next = __atomic_load_n(&ix->next, __ATOMIC_ACQUIRE);
+    t = __atomic_load_n(&ix->table, __ATOMIC_ACQUIRE);
+    if (next != NULL) state = probe(next, key);
+    if (state == HX_UNSET) state = probe(t, key);
+    ebr_exit(ix->ebr);
+
+    if (!(state & 1)) return 0;
+    if (value != NULL) *value = HX_VALUE(state);
+    return 1;
+}
+
+size_t hx_range(hash_index *ix, Key lo, Key hi,
+                int (*callback)(Key key, int value, void *arg), void *arg) {
+    return range(ix->tree, lo, hi, callback, arg);
+}
+
+size_t hx_size(hash_index *ix) {
+    return tree_size(ix->tree);
+}
+
+typedef struct verify_args {
+    hash_index *ix;
+    int ok;
+} verify_args;
+
+static int check_key(Key key, int value, void *arg) {
+    verify_args *a = arg;
+    int v;
+
+    if (!hx_lookup(a->ix, key, &v) || v != value) a->ok = 0;
+    return 0;
+}
+
+/* Keys present in 't' (and, if 'newer' isn't NULL, with no slot there) */
+static size_t count_present(const hx_table *t, const hx_table *newer) {
+    size_t i, n = 0;
+
+    for (i = 0; i <= t->mask; i++)
+        if ((t->slots[i].state & 1) && (newer == NULL ||
+                probe(newer, (Key) (t->slots[i].key - 1)) == HX_UNSET))
+            n++;
+    return n;
+}
+
+int hx_verify(hash_index *ix) {
+    verify_args a;
+    size_t n;
+
+    if (!verify_tree(ix->tree)) return 0;
+    a.ix = ix;
+    a.ok = 1;
+    range(ix->tree, 0, (Key) -1, check_key, &a);
+
+    n = count_present(ix->table, ix->next);
+    if (ix->next != NULL) n += count_present(ix->next, NULL);
+    return a.ok && n == tree_size(ix->tree);
+}
+
+static void *ops_initialize(void) { return hx_initialize(); }
+static void ops_destroy(void *ix) { hx_destroy(ix); }
+static int ops_add(void *ix, Key key, int value) {
+    return hx_add(ix, key, value);
+}
+static int ops_delete(void *ix, Key key) { return hx_delete(ix, key); }
+static int ops_lookup(void *ix, Key key, int *value) {
+    return hx_lookup(ix, key, value);
+}
+static int ops_verify(void *ix) { return hx_verify(ix); }
+
+const tree_ops hx_ops = {
+    "bst-hash", ops_initialize, ops_destroy, ops_add, ops_delete, ops_lookup,
+    ops_verify
+};
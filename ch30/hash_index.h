@@ -0,0 +1,50 @@
+/*
+  binary_tree.c with a hash index (see hash_index.c): point lookups go to
+  a concurrent hash table, range queries to the tree, and hx_add() and
+  hx_delete() keep the two in step. Any number of threads may call any of
+  these at once; hx_lookup() takes no locks.
+*/
+#ifndef HASH_INDEX_H
+#define HASH_INDEX_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "binary_tree.h"
+#include "../lib/ebr.h"
+
+#define HX_STRIPES 64               // writer locks, by key
+
+typedef struct hx_table hx_table;
+
+typedef struct hx_stripe {
+    pthread_mutex_t mutex;
+} __attribute__((aligned(64))) hx_stripe;
+
+typedef struct hash_index {
+    bt_root *tree;                  // the keys, in order
+    hx_table *table;                // a hash table of them ...
+    hx_table *next;                 // ... and, while it's resized, the new one
+    pthread_mutex_t resize_mutex;   // held to start a resize
+    unsigned long resizes;
+    ebr_domain *ebr;                // for the tables replaced
+    hx_stripe stripes[HX_STRIPES];  // each writer holds its key's stripe
+} hash_index;
+
+hash_index *hx_initialize(void);
+void hx_destroy(hash_index *ix);
+
+// As add(), delete() and lookup() in binary_tree.h
+int hx_add(hash_index *ix, Key key, int value);
+int hx_delete(hash_index *ix, Key key);
+int hx_lookup(hash_index *ix, Key key, int *value);
+
+// As range() in binary_tree.h, from the tree
+size_t hx_range(hash_index *ix, Key lo, Key hi,
+                int (*callback)(Key key, int value, void *arg), void *arg);
+
+size_t hx_size(hash_index *ix);
+
+// Checks the tree, and that the table holds exactly its keys and values
+int hx_verify(hash_index *ix);
+
+#endif
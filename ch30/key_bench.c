@@ -0,0 +1,156 @@
+/*
+  The instantiations of binary_tree.c compared: 32-bit keys
+  (binary_tree.h), 128-bit keys (u128_tree.h), strings with a cached
+  prefix (str_tree.h) and strings compared by strcmp() alone
+  (cstr_tree.h).
+
+  Usage: key_bench [-n keys] [-c common-prefix] [-s seed]
+
+  Each tree gets the same keys -- 'keys' distinct 32-bit numbers, widened
+  for the 128-bit tree, and printed in hex after 'common-prefix' for the
+  string trees -- added in random order, looked up in another random
+  order, and deleted; the time of each phase is printed. A common prefix
+  of 8 characters or more leaves the cached prefixes nothing to decide,
+  which shows what they save.
+*/
+
+#include <time.h>
+#include "../lib/tlpi_hdr.h"
+#include "binary_tree.h"
+#include "u128_tree.h"
+#include "str_tree.h"
+#include "cstr_tree.h"
+
+enum phase { ADD, LOOKUP, DELETE, NPHASES };
+
+static size_t nkeys;
+static Key *keys;                   // insertion order
+static size_t *order;               // lookup order
+static u128_key *wide_keys;
+static char **strings;
+
+static unsigned long xorshift(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* time_<prefix>(secs): time the three phases on the instantiation with
+   the given prefix, whose i'th key is KEY(i) */
+#define TIME_TREE(name, P, KEY)                                         \
+static void time_##name(double *secs) {                                 \
+    P##bt_root *tree = P##initialize();                                 \
+    size_t i;                                                           \
+    long errors = 0;                                                    \
+    double t0;                                                          \
+                                                                        \
+    t0 = now();                                                         \
+    for (i = 0; i < nkeys; i++)                                         \
+        errors += P##add(tree, KEY(i), 0) != 1;                         \
+    secs[ADD] = now() - t0;                                             \
+    if (!P##verify_tree(tree)) fatal(#name ": tree is inconsistent");   \
+                                                                        \
+    t0 = now();                                                         \
+    for (i = 0; i < nkeys; i++)                                         \
+        errors += P##lookup(tree, KEY(order[i]), NULL) != 1;            \
+    secs[LOOKUP] = now() - t0;                                          \
+                                                                        \
+    t0 = now();                                                         \
+    for (i = 0; i < nkeys; i++)                                         \
+        errors += P##delete(tree, KEY(order[i])) != 1;                  \
+    secs[DELETE] = now() - t0;                                          \
+                                                                        \
+    if (errors != 0 || P##tree_size(tree) != 0)                         \
+        fatal(#name ": %ld operations failed", errors);                 \
+    P##destroy(tree);                                                   \
+}
+
+#define INT_KEY(i)      (keys[i])
+#define WIDE_KEY(i)     (wide_keys[i])
+#define STR_KEY(i)      make_str_key(strings[i])
+#define CSTR_KEY(i)     ((const char *) strings[i])
+
+TIME_TREE(int, , INT_KEY)
+TIME_TREE(u128, u128_, WIDE_KEY)
+TIME_TREE(str, str_, STR_KEY)
+TIME_TREE(cstr, cstr_, CSTR_KEY)
+
+int main(int argc, char *argv[]) {
+    static const struct {
+        const char *name;
+        void (*time)(double *secs);
+    } trees[] = {
+        { "32-bit", time_int },
+        { "128-bit", time_u128 },
+        { "string", time_str },
+        { "strcmp", time_cstr },
+    };
+    const char *common = "";
+    unsigned long seed = 1, rng;
+    double secs[NPHASES];
+    size_t i, j, t, len;
+    int opt;
+
+    nkeys = 1000000;
+    while ((opt = getopt(argc, argv, "n:c:s:")) != -1) {
+        switch (opt) {
+        case 'n': nkeys = getLong(optarg, GN_GT_0, "keys");    break;
+        case 'c': common = optarg;                             break;
+        case 's': seed = getLong(optarg, GN_GT_0, "seed");     break;
+        default:
+            usageErr("%s [-n keys] [-c common-prefix] [-s seed]\n", argv[0]);
+        }
+    }
+
+    // distinct keys: i times an odd constant is a bijection on 32 bits
+    keys = malloc(nkeys * sizeof(Key));
+    order = malloc(nkeys * sizeof(size_t));
+    wide_keys = malloc(nkeys * sizeof(u128_key));
+    strings = malloc(nkeys * sizeof(char *));
+    if (keys == NULL || order == NULL || wide_keys == NULL ||
+            strings == NULL)
+        errExit("malloc");
+    len = strlen(common) + 9;
+    for (i = 0; i < nkeys; i++) {
+        keys[i] = (Key) (i * 2654435761u);
+        order[i] = i;
+    }
+    rng = seed;
+    for (i = nkeys - 1; i > 0; i--) {
+        j = xorshift(&rng) % (i + 1);
+        t = order[i]; order[i] = order[j]; order[j] = t;
+    }
+    for (i = 0; i < nkeys; i++) {
+        wide_keys[i] = (u128_key) keys[i] << 64 | keys[i];
+        strings[i] = malloc(len);
+        if (strings[i] == NULL) errExit("malloc");
+        snprintf(strings[i], len, "%s%08x", common, keys[i]);
+    }
+
+    printf("%zu keys, common prefix \"%s\"\n", nkeys, common);
+    printf("%-8s %10s %10s %10s  (Mops/s)\n", "keys", "add", "lookup",
+           "delete");
+    for (i = 0; i < sizeof(trees) / sizeof(trees[0]); i++) {
+        trees[i].time(secs);
+        printf("%-8s %10.2f %10.2f %10.2f\n", trees[i].name,
+               nkeys / secs[ADD] / 1e6, nkeys / secs[LOOKUP] / 1e6,
+               nkeys / secs[DELETE] / 1e6);
+    }
+
+    for (i = 0; i < nkeys; i++)
+        free(strings[i]);
+    free(strings);
+    free(wide_keys);
+    free(order);
+    free(keys);
+    exit(EXIT_SUCCESS);
+}
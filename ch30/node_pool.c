@@ -0,0 +1,244 @@
+/*
+  A node pool: the trees allocate and free a node per add() and delete(),
+  and going to malloc() for each means contention on its arenas when many
+  threads insert at once, nodes scattered across the heap, and -- for
+  bt_node -- a pthread_mutex_init() every time.
+
+  Objects are carved from 64 KiB slabs, each rounded up to a whole number
+  of cache lines and aligned on one, so that no two nodes share a line
+  (and a reader touching a node's first fields touches one line). Every
+  thread has its own cache: a free list plus the uncarved rest of a slab,
+  which it uses without any synchronisation. Only when its free list
+  grows past 2 * POOL_BATCH objects does a thread hand POOL_BATCH of them
+  to the pool's shared list, and only when it runs dry does it take a
+  batch back (or a new slab), under the pool's mutex, so the mutex is
+  taken once per POOL_BATCH operations at most.
+
+  Slabs are only freed by pool_destroy(), which drops them all at once,
+  without visiting the objects.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "node_pool.h"
+
+#define POOL_ALIGN  64              // cache line
+#define POOL_SLAB   (64 * 1024)
+#define POOL_BATCH  64
+
+typedef struct pool_cache {
+    struct node_pool *pool;
+    void *free;                     // this thread's free objects
+    size_t nfree;
+    char *bump, *end;               // uncarved part of its current slab
+    int in_use;                     // owned by a live thread
+    struct pool_cache *next;        // all caches of the pool
+} pool_cache;
+
+struct node_pool {
+    size_t size;                    // rounded up to POOL_ALIGN
+    size_t link;                    // offset of the free-list link
+    void (*init)(void *obj);
+    size_t slab_size;
+    pthread_key_t key;              // -> the calling thread's cache
+    pthread_mutex_t mutex;          // protects everything below
+    void *slabs;                    // linked through their first word
+    void *free;                     // shared free list
+    size_t nfree;
+    pool_cache *caches;
+};
+
+static void die(int err, const char *what) {
+    fprintf(stderr, "node_pool: %s: %s\n", what, strerror(err));
+    abort();
+}
+
+static void lock_pool(node_pool *pool) {
+    int s = pthread_mutex_lock(&pool->mutex);
+    if (s != 0) { die(s, "pthread_mutex_lock"); }
+}
+
+static void unlock_pool(node_pool *pool) {
+    int s = pthread_mutex_unlock(&pool->mutex);
+    if (s != 0) { die(s, "pthread_mutex_unlock"); }
+}
+
+static void *get_link(node_pool *pool, void *obj) {
+    return __atomic_load_n((void **) ((char *) obj + pool->link),
+                           __ATOMIC_RELAXED);
+}
+
+static void set_link(node_pool *pool, void *obj, void *next) {
+    __atomic_store_n((void **) ((char *) obj + pool->link), next,
+                     __ATOMIC_RELAXED);
+}
+
+/* Move the first 'n' objects of 'list' onto the shared list, returning
+   the rest; the caller holds the pool's mutex */
+static void *give_back(node_pool *pool, void *list, size_t n) {
+    void *tail = list, *rest;
+    size_t i;
+
+    for (i = 1; i < n; i++)
+        tail = get_link(pool, tail);
+    rest = get_link(pool, tail);
+    set_link(pool, tail, pool->free);
+    pool->free = list;
+    pool->nfree += n;
+    return rest;
+}
+
+/* Thread exit: the thread's free objects, and the uncarved rest of its
+   slab, go to the shared list, and the cache is left for another thread */
+static void release_cache(void *arg) {
+    pool_cache *c = arg;
+    node_pool *pool = c->pool;
+
+    for (; c->bump < c->end; c->bump += pool->size) {
+        if (pool->init != NULL) pool->init(c->bump);
+        set_link(pool, c->bump, c->free);
+        c->free = c->bump;
+        c->nfree++;
+    }
+
+    lock_pool(pool);
+    if (c->nfree > 0)
+        give_back(pool, c->free, c->nfree);
+    c->free = NULL;
+    c->nfree = 0;
+    c->in_use = 0;
+    unlock_pool(pool);
+}
+
+node_pool *pool_create(size_t size, size_t link_offset,
+                       void (*init)(void *obj)) {
+    node_pool *pool = calloc(1, sizeof(node_pool));
+    int s;
+
+    if (pool == NULL) { die(ENOMEM, "calloc"); }
+    pool->size = (size + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN;
+    pool->link = link_offset;
+    pool->init = init;
+    pool->slab_size = POOL_SLAB;
+    if (pool->slab_size < POOL_ALIGN + 16 * pool->size)
+        pool->slab_size = POOL_ALIGN + 16 * pool->size;
+    pool->slabs = NULL;
+    pool->free = NULL;
+    pool->nfree = 0;
+    pool->caches = NULL;
+    pthread_mutex_init(&pool->mutex, NULL);
+    s = pthread_key_create(&pool->key, release_cache);
+    if (s != 0) { die(s, "pthread_key_create"); }
+    return pool;
+}
+
+void pool_destroy(node_pool *pool) {
+    pool_cache *c, *next_cache;
+    void *slab, *next_slab;
+
+    pthread_key_delete(pool->key);
+    for (slab = pool->slabs; slab != NULL; slab = next_slab) {
+        next_slab = *(void **) slab;
+        free(slab);
+    }
+    for (c = pool->caches; c != NULL; c = next_cache) {
+        next_cache = c->next;
+        free(c);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+static pool_cache *get_cache(node_pool *pool) {
+    pool_cache *c = pthread_getspecific(pool->key);
+    int s;
+
+    if (c != NULL) return c;
+
+    lock_pool(pool);
+    for (c = pool->caches; c != NULL && c->in_use; c = c->next)
+        ;
+    if (c == NULL) {
+        c = calloc(1, sizeof(pool_cache));
+        if (c == NULL) { die(ENOMEM, "calloc"); }
+        c->pool = pool;
+        c->next = pool->caches;
+        pool->caches = c;
+    }
+    c->in_use = 1;
+    unlock_pool(pool);
+
+    s = pthread_setspecific(pool->key, c);
+    if (s != 0) { die(s, "pthread_setspecific"); }
+    return c;
+}
+
+/* The thread's cache is empty: take a batch from the shared list, or
+   failing that a new slab */
+static void refill(node_pool *pool, pool_cache *c) {
+    void *slab, *tail;
+    size_t n, i;
+    int s;
+
+    lock_pool(pool);
+    if (pool->nfree > 0) {
+        n = pool->nfree < POOL_BATCH ? pool->nfree : POOL_BATCH;
+        c->free = tail = pool->free;
+        for (i = 1; i < n; i++)
+            tail = get_link(pool, tail);
+        pool->free = get_link(pool, tail);
+        pool->nfree -= n;
+        set_link(pool, tail, NULL);
+        c->nfree = n;
+        unlock_pool(pool);
+        return;
+    }
+    unlock_pool(pool);
+
+    s = posix_memalign(&slab, POOL_ALIGN, pool->slab_size);
+    if (s != 0) { die(s, "posix_memalign"); }
+    memset(slab, 0, pool->slab_size);
+    c->bump = (char *) slab + POOL_ALIGN;
+    c->end = c->bump +
+             (pool->slab_size - POOL_ALIGN) / pool->size * pool->size;
+
+    lock_pool(pool);
+    *(void **) slab = pool->slabs;
+    pool->slabs = slab;
+    unlock_pool(pool);
+}
+
+void *pool_alloc(node_pool *pool) {
+    pool_cache *c = get_cache(pool);
+    void *obj;
+
+    if (c->free == NULL && c->bump == c->end)
+        refill(pool, c);
+
+    if (c->free != NULL) {
+        obj = c->free;
+        c->free = get_link(pool, obj);
+        c->nfree--;
+    } else {
+        obj = c->bump;
+        c->bump += pool->size;
+        if (pool->init != NULL) pool->init(obj);
+    }
+    return obj;
+}
+
+void pool_free(node_pool *pool, void *obj) {
+    pool_cache *c = get_cache(pool);
+
+    set_link(pool, obj, c->free);
+    c->free = obj;
+    if (++c->nfree >= 2 * POOL_BATCH) {
+        lock_pool(pool);
+        c->free = give_back(pool, c->free, POOL_BATCH);
+        unlock_pool(pool);
+        c->nfree -= POOL_BATCH;
+    }
+}
@@ -0,0 +1,27 @@
+/*
+  Fixed-size object pool (see node_pool.c), for the nodes of the ch30
+  trees: per-thread caches, cache-line-aligned objects, and one release
+  of everything at the end. Objects are never returned to malloc() while
+  the pool exists, so they stay valid (if stale) for lock-free readers.
+*/
+#ifndef NODE_POOL_H
+#define NODE_POOL_H
+
+#include <stddef.h>
+
+typedef struct node_pool node_pool;
+
+/* Objects of 'size' bytes; the pointer-sized field at 'link_offset' is
+   used to chain free objects (with atomic stores, so readers of a stale
+   object see some pointer, never a torn one). 'init', if not NULL, is
+   called once on each object, when it is first carved out of a slab. */
+node_pool *pool_create(size_t size, size_t link_offset,
+                       void (*init)(void *obj));
+
+// Releases every object at once, in use or not
+void pool_destroy(node_pool *pool);
+
+void *pool_alloc(node_pool *pool);
+void pool_free(node_pool *pool, void *obj);
+
+#endif
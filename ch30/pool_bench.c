@@ -0,0 +1,173 @@
+/*
+  Small tasks on the thread pool of lib/thread_pool.c, against a thread
+  created for each task.
+
+  Usage: pool_bench [-t threads] [-n tasks] [-w work]
+
+  Each task spins through 'work' rounds of a random-number generator and
+  stores the result. The same 'tasks' tasks are run three ways:
+
+    pthread     'threads' tasks at a time, each in a thread of its own
+                (pthread_create() and pthread_join() per task)
+    submit      the main thread submits them all to a pool of 'threads'
+                workers, then waits (the pool's shared queue)
+    fork-join   one task splits the range of tasks in two, submits one
+                half and carries on with the other, down to single tasks
+                (the workers' own deques, and stealing)
+
+  Every way must produce the same results. The time, tasks per second and
+  speedup over 'pthread' are printed.
+*/
+
+#include <pthread.h>
+#include <time.h>
+#include "../lib/tlpi_hdr.h"
+#include "../lib/thread_pool.h"
+
+enum mode { PTHREAD, SUBMIT, FORK_JOIN, NMODES };
+
+static const char *mode_names[NMODES] = { "pthread", "submit", "fork-join" };
+
+static long work;
+static unsigned long *results;
+static thread_pool *pool;
+
+typedef struct span {
+    size_t lo, hi;                  // tasks [lo, hi)
+} span;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void task(size_t i) {
+    unsigned long x = i + 1;
+    long k;
+
+    for (k = 0; k < work; k++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+    }
+    results[i] = x;
+}
+
+static void *thread_task(void *arg) {
+    task((size_t) arg);
+    return NULL;
+}
+
+static void pool_task(void *arg) {
+    task((size_t) arg);
+}
+
+static void split(void *arg) {
+    span *s = arg, left, right;
+    wait_group wg;
+
+    if (s->hi - s->lo == 1) {
+        task(s->lo);
+        return;
+    }
+    left.lo = s->lo;
+    left.hi = right.lo = s->lo + (s->hi - s->lo) / 2;
+    right.hi = s->hi;
+    wg_init(&wg);
+    tp_submit(pool, &wg, split, &right);
+    split(&left);
+    wg_wait(pool, &wg);
+    wg_destroy(&wg);
+}
+
+static void run(enum mode mode, size_t ntasks, unsigned nthreads) {
+    pthread_t *tids;
+    wait_group wg;
+    size_t i, j, m;
+    span all;
+    int s;
+
+    switch (mode) {
+    case PTHREAD:
+        tids = malloc(nthreads * sizeof(pthread_t));
+        if (tids == NULL) errExit("malloc");
+        for (i = 0; i < ntasks; i += m) {
+            m = ntasks - i < nthreads ? ntasks - i : nthreads;
+            for (j = 0; j < m; j++) {
+                s = pthread_create(&tids[j], NULL, thread_task,
+                                   (void *) (i + j));
+                if (s != 0) errExitEN(s, "pthread_create");
+            }
+            for (j = 0; j < m; j++) {
+                s = pthread_join(tids[j], NULL);
+                if (s != 0) errExitEN(s, "pthread_join");
+            }
+        }
+        free(tids);
+        break;
+    case SUBMIT:
+        wg_init(&wg);
+        for (i = 0; i < ntasks; i++)
+            tp_submit(pool, &wg, pool_task, (void *) i);
+        wg_wait(pool, &wg);
+        wg_destroy(&wg);
+        break;
+    default:
+        all.lo = 0;
+        all.hi = ntasks;
+        wg_init(&wg);
+        tp_submit(pool, &wg, split, &all);
+        wg_wait(pool, &wg);
+        wg_destroy(&wg);
+        break;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    unsigned nthreads = 4;
+    size_t ntasks = 100000, i;
+    unsigned long *expected;
+    double secs[NMODES], t0;
+    int opt, mode;
+
+    work = 100;
+    while ((opt = getopt(argc, argv, "t:n:w:")) != -1) {
+        switch (opt) {
+        case 't': nthreads = getInt(optarg, GN_GT_0, "threads");   break;
+        case 'n': ntasks = getLong(optarg, GN_GT_0, "tasks");      break;
+        case 'w': work = getLong(optarg, GN_NONNEG, "work");       break;
+        default:
+            usageErr("%s [-t threads] [-n tasks] [-w work]\n", argv[0]);
+        }
+    }
+
+    results = malloc(ntasks * sizeof(unsigned long));
+    expected = malloc(ntasks * sizeof(unsigned long));
+    if (results == NULL || expected == NULL) errExit("malloc");
+    for (i = 0; i < ntasks; i++)
+        task(i);
+    memcpy(expected, results, ntasks * sizeof(unsigned long));
+
+    pool = tp_create(nthreads);
+    for (mode = 0; mode < NMODES; mode++) {
+        memset(results, 0, ntasks * sizeof(unsigned long));
+        t0 = now();
+        run(mode, ntasks, nthreads);
+        secs[mode] = now() - t0;
+        if (memcmp(results, expected, ntasks * sizeof(unsigned long)) != 0)
+            fatal("%s: wrong results", mode_names[mode]);
+    }
+    tp_destroy(pool);
+
+    printf("%zu tasks of %ld rounds, %u threads\n", ntasks, work, nthreads);
+    printf("%-10s %10s %12s %8s\n", "", "seconds", "tasks/s", "speedup");
+    for (mode = 0; mode < NMODES; mode++)
+        printf("%-10s %10.3f %12.0f %8.1f\n", mode_names[mode], secs[mode],
+               ntasks / secs[mode], secs[PTHREAD] / secs[mode]);
+
+    free(results);
+    free(expected);
+    exit(EXIT_SUCCESS);
+}
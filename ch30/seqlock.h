@@ -0,0 +1,38 @@
+/*
+  Sequence counters, as used by the ch30 trees for lock-free readers.
+
+  A writer, which must already exclude other writers of the same data
+  (by holding a mutex), brackets its stores with write_begin() and
+  write_end(); the counter is odd in between. A reader takes
+  v = read_begin(), reads the data with LOAD(), and keeps what it read
+  only if read_valid(v) says no writer has been there since. Writers use
+  STORE() for any field a reader may be looking at.
+*/
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#define LOAD(field)         __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define STORE(field, val)   __atomic_store_n(&(field), (val), __ATOMIC_RELAXED)
+
+static inline void write_begin(unsigned long *seq) {
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_end(unsigned long *seq) {
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline unsigned long read_begin(const unsigned long *seq) {
+    unsigned long v;
+    while ((v = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1)
+        ;                           // a writer is in the middle of it
+    return v;
+}
+
+static inline int read_valid(const unsigned long *seq, unsigned long v) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) == v;
+}
+
+#endif
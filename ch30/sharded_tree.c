@@ -0,0 +1,258 @@
+/*
+  Sharded front-end over binary_tree.c.
+
+  However fine-grained its locking, one tree makes every writer start at
+  the same place: the root's mutex (each add() and delete() locks it on
+  its way down) and the tree's node count, both on one cache line that
+  bounces between all the writing CPUs. Splitting the keys between
+  several trees gives each shard its own root, mutex and count -- each
+  bt_root is allocated on its own cache lines -- so writers only meet
+  when they work on the same shard. With more shards than CPUs, that is
+  seldom.
+
+  By hash, the keys are spread evenly whatever their distribution, but an
+  ordered scan has to merge all the shards. By range, a scan can take the
+  shards one after the other, but a skewed workload piles onto a few of
+  them. The iterator here merges in either case (through a small heap of
+  the shards' next keys), which costs O(log nshards) per key on top of
+  the shards' own iterators; with range sharding, the shards below 'from'
+  drop out at once.
+
+  The shards all take their nodes from shard 0's pool (see
+  initialize_sharing() in binary_tree.c): a pool per shard would mean a
+  thread-specific data key and a 64 KiB slab per shard, however few keys
+  each holds, and the keys run out (PTHREAD_KEYS_MAX) at about a thousand
+  shards. Shard 0 is thus destroyed last.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sharded_tree.h"
+
+static void die(int err, const char *what) {
+    fprintf(stderr, "sharded_tree: %s: %s\n", what, strerror(err));
+    abort();
+}
+
+static void *xcalloc(size_t n, size_t size) {
+    void *p = calloc(n, size);
+    if (p == NULL) { die(ENOMEM, "calloc"); }
+    return p;
+}
+
+unsigned st_default_shards(void) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    unsigned n = 4 * (ncpus > 0 ? (unsigned) ncpus : 1);
+
+    return n < ST_MAX_SHARDS ? n : ST_MAX_SHARDS;
+}
+
+sharded_tree *st_initialize(unsigned nshards, Key range_max) {
+    sharded_tree *tree = xcalloc(1, sizeof(sharded_tree));
+    unsigned i;
+
+    if (nshards == 0) nshards = st_default_shards();
+    if (nshards > ST_MAX_SHARDS) { die(EINVAL, "too many shards"); }
+    tree->nshards = nshards;
+    tree->range_max = range_max;
+    tree->stretch = range_max == 0 ? 0 : (range_max - 1) / nshards + 1;
+    tree->shards = xcalloc(nshards, sizeof(bt_root *));
+    tree->shards[0] = initialize();
+    for (i = 1; i < nshards; i++)
+        tree->shards[i] = initialize_sharing(tree->shards[0]);
+    return tree;
+}
+
+void st_destroy(sharded_tree *tree) {
+    unsigned i;
+
+    for (i = tree->nshards; i-- > 0; )    // shard 0 owns the pool
+        destroy(tree->shards[i]);
+    free(tree->shards);
+    free(tree);
+}
+
+/* By hash: the top bits of a multiplicative hash, scaled to nshards (so
+   any shard count works, not just powers of two) */
+static unsigned shard_of(sharded_tree *tree, Key key) {
+    unsigned s;
+
+    if (tree->range_max == 0)
+        return ((unsigned long long) (unsigned) (key * 2654435761u) *
+                tree->nshards) >> 32;
+    s = key / tree->stretch;
+    return s < tree->nshards ? s : tree->nshards - 1;
+}
+
+int st_add(sharded_tree *tree, Key key, int value) {
+    return add(tree->shards[shard_of(tree, key)], key, value);
+}
+
+int st_delete(sharded_tree *tree, Key key) {
+    return delete(tree->shards[shard_of(tree, key)], key);
+}
+
+int st_lookup(sharded_tree *tree, Key key, int *value) {
+    return lookup(tree->shards[shard_of(tree, key)], key, value);
+}
+
+size_t st_size(sharded_tree *tree) {
+    size_t n = 0;
+    unsigned i;
+
+    for (i = 0; i < tree->nshards; i++)
+        n += tree_size(tree->shards[i]);
+    return n;
+}
+
+size_t st_shard_size(sharded_tree *tree, unsigned shard) {
+    return tree_size(tree->shards[shard]);
+}
+
+/* The heap holds the shards that still have keys, ordered by it->keys[] */
+
+static int heap_less(st_iter *it, unsigned a, unsigned b) {
+    return it->keys[it->heap[a]] < it->keys[it->heap[b]];
+}
+
+static void heap_swap(st_iter *it, unsigned a, unsigned b) {
+    unsigned t = it->heap[a];
+    it->heap[a] = it->heap[b];
+    it->heap[b] = t;
+}
+
+static void sift_down(st_iter *it, unsigned i) {
+    unsigned child;
+
+    for (; (child = 2 * i + 1) < it->nheap; i = child) {
+        if (child + 1 < it->nheap && heap_less(it, child + 1, child))
+            child++;
+        if (!heap_less(it, child, i)) break;
+        heap_swap(it, i, child);
+    }
+}
+
+void st_iter_start(st_iter *it, sharded_tree *tree, Key from) {
+    unsigned i, n = tree->nshards;
+
+    it->tree = tree;
+    it->its = xcalloc(n, sizeof(bt_iter));
+    it->keys = xcalloc(n, sizeof(Key));
+    it->values = xcalloc(n, sizeof(int));
+    it->heap = xcalloc(n, sizeof(unsigned));
+    it->nheap = 0;
+
+    for (i = 0; i < n; i++) {
+        iter_start(&it->its[i], tree->shards[i], from);
+        if (iter_next(&it->its[i], &it->keys[i], &it->values[i]))
+            it->heap[it->nheap++] = i;
+    }
+    for (i = it->nheap / 2; i-- > 0; )
+        sift_down(it, i);
+}
+
+int st_iter_next(st_iter *it, Key *key, int *value) {
+    unsigned s;
+
+    if (it->nheap == 0) return 0;
+    s = it->heap[0];
+    if (key != NULL) *key = it->keys[s];
+    if (value != NULL) *value = it->values[s];
+
+    // replace the smallest with its shard's next key, or drop the shard
+    if (!iter_next(&it->its[s], &it->keys[s], &it->values[s]))
+        it->heap[0] = it->heap[--it->nheap];
+    sift_down(it, 0);
+    return 1;
+}
+
+void st_iter_end(st_iter *it) {
+    free(it->its);
+    free(it->keys);
+    free(it->values);
+    free(it->heap);
+}
+
+size_t st_range(sharded_tree *tree, Key lo, Key hi,
+                int (*callback)(Key key, int value, void *arg), void *arg) {
+    st_iter it;
+    size_t n = 0;
+    Key k;
+    int v;
+
+    st_iter_start(&it, tree, lo);
+    while (st_iter_next(&it, &k, &v) && k <= hi) {
+        n++;
+        if (callback(k, v, arg) != 0) break;
+    }
+    st_iter_end(&it);
+    return n;
+}
+
+typedef struct verify_args {
+    sharded_tree *tree;
+    unsigned shard;
+    Key last;
+    int started;
+    int ok;
+} verify_args;
+
+static int check_shard(Key key, int value, void *arg) {
+    verify_args *a = arg;
+
+    (void) value;
+    if (shard_of(a->tree, key) != a->shard) a->ok = 0;
+    return 0;
+}
+
+static int check_order(Key key, int value, void *arg) {
+    verify_args *a = arg;
+
+    (void) value;
+    if (a->started && key <= a->last) a->ok = 0;
+    a->last = key;
+    a->started = 1;
+    return 0;
+}
+
+/* Also checks the merge: one strictly increasing sequence of all the
+   shards' keys */
+int st_verify(sharded_tree *tree) {
+    verify_args a;
+
+    a.tree = tree;
+    a.ok = 1;
+    for (a.shard = 0; a.shard < tree->nshards; a.shard++) {
+        if (!verify_tree(tree->shards[a.shard])) return 0;
+        range(tree->shards[a.shard], 0, (Key) -1, check_shard, &a);
+    }
+
+    a.started = 0;
+    if (st_range(tree, 0, (Key) -1, check_order, &a) != st_size(tree))
+        return 0;
+    return a.ok;
+}
+
+unsigned st_ops_shards;
+
+static void *ops_initialize(void) {
+    return st_initialize(st_ops_shards, 0);
+}
+static void ops_destroy(void *tree) { st_destroy(tree); }
+static int ops_add(void *tree, Key key, int value) {
+    return st_add(tree, key, value);
+}
+static int ops_delete(void *tree, Key key) { return st_delete(tree, key); }
+static int ops_lookup(void *tree, Key key, int *value) {
+    return st_lookup(tree, key, value);
+}
+static int ops_verify(void *tree) { return st_verify(tree); }
+
+const tree_ops st_ops = {
+    "sharded", ops_initialize, ops_destroy, ops_add, ops_delete, ops_lookup,
+    ops_verify
+};
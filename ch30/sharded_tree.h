@@ -0,0 +1,69 @@
+/*
+  Sharded front-end over binary_tree.c (see sharded_tree.c): the keys are
+  divided between 'nshards' independent trees, by hash or by range, so
+  that writers working on different shards share no lock and no counter.
+  st_add(), st_delete() and st_lookup() may be called from any number of
+  threads; the iterator and st_range() return the keys of all the shards,
+  merged into one ordered sequence.
+*/
+#ifndef SHARDED_TREE_H
+#define SHARDED_TREE_H
+
+#include <stddef.h>
+#include "binary_tree.h"
+
+typedef struct sharded_tree {
+    unsigned nshards;
+    Key range_max;                  // 0: shards by hash, else by range
+    Key stretch;                    // keys per shard, if by range
+    bt_root **shards;               // each on its own cache lines
+} sharded_tree;
+
+/* With range_max 0, a key goes to the shard picked by its hash; else keys
+   0..range_max-1 are split into 'nshards' equal stretches (and any larger
+   key goes to the last shard). nshards 0 means st_default_shards(); more
+   than ST_MAX_SHARDS is an error. All the shards share one node pool. */
+sharded_tree *st_initialize(unsigned nshards, Key range_max);
+void st_destroy(sharded_tree *tree);
+
+#define ST_MAX_SHARDS 4096
+
+// Four shards per online CPU (at most ST_MAX_SHARDS), so that two writers
+// seldom meet on one
+unsigned st_default_shards(void);
+
+// The shard count of the trees made by st_ops (hashed); 0: the default
+extern unsigned st_ops_shards;
+
+// As add(), delete() and lookup() in binary_tree.h
+int st_add(sharded_tree *tree, Key key, int value);
+int st_delete(sharded_tree *tree, Key key);
+int st_lookup(sharded_tree *tree, Key key, int *value);
+
+size_t st_size(sharded_tree *tree);
+size_t st_shard_size(sharded_tree *tree, unsigned shard);
+
+/* Ordered iteration over all the shards, from 'from' upwards: a k-way
+   merge of the shards' own iterators (lock-free, see binary_tree.h).
+   st_iter_end() releases what st_iter_start() allocated. st_range()
+   calls 'callback' for each key in [lo, hi], in order, until it returns
+   nonzero, and returns the number of calls. */
+typedef struct st_iter {
+    sharded_tree *tree;
+    bt_iter *its;                   // one per shard
+    Key *keys;                      // the next key of each shard ...
+    int *values;
+    unsigned *heap;                 // ... and a min-heap of those shards
+    unsigned nheap;
+} st_iter;
+
+void st_iter_start(st_iter *it, sharded_tree *tree, Key from);
+int st_iter_next(st_iter *it, Key *key, int *value);     // 0 at the end
+void st_iter_end(st_iter *it);
+size_t st_range(sharded_tree *tree, Key lo, Key hi,
+                int (*callback)(Key key, int value, void *arg), void *arg);
+
+// Checks every shard, and that each key lives in the right one
+int st_verify(sharded_tree *tree);
+
+#endif
@@ -0,0 +1,308 @@
+/*
+  A lock-free skip list, as an alternative to binary_tree.c.
+
+  The tree's writers lock their way down from the root, so under heavy
+  write contention they queue behind one another on the upper nodes, and
+  a thread descheduled while holding a lock stalls everyone behind it.
+  Here no operation ever waits for another: every change is a single
+  compare-and-swap, and a thread whose CAS fails because someone else got
+  there first just looks again.
+
+  Each node is linked into levels 0 .. levels - 1; level 0 holds every key
+  in order, and each level above holds about half of the one below, so a
+  search drops through O(log n) nodes. The height of a node is a function
+  of its key (the number of trailing zeroes of a hash of it), which needs
+  no per-thread random state.
+
+  Insertion (Herlihy & Shavit, "The Art of Multiprocessor Programming",
+  ch. 14, after Fraser): find the predecessor and successor at each level,
+  CAS the new node in at level 0 -- which is when it becomes present --
+  and then at each level above, looking again whenever a CAS fails.
+
+  Deletion is logical, then physical. The low bit of each of a node's
+  next pointers marks the node as deleted at that level; they are marked
+  from the top down, and whoever marks level 0 has deleted the key. Any
+  search that meets a marked node snips it out with a CAS on its
+  predecessor, and the deleter finishes the job with one more search.
+  Since a marked pointer can no longer change, nothing can ever be linked
+  in behind a deleted node.
+
+  Memory: a search may be standing on a node at the moment it is snipped
+  out, so nodes are retired to an epoch-based reclamation domain (lib/ebr.c)
+  rather than freed, and every operation runs inside ebr_enter() ...
+  ebr_exit(). A node is only unreachable once both the deleter and its
+  adder (which may still be linking its upper levels when it is deleted)
+  have done their final search, so each holds a reference, and whichever
+  drops the last one retires it.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "skip_list.h"
+
+#define MARK            ((uintptr_t) 1)
+#define MARKED(p)       ((p) & MARK)
+#define NODE(p)         ((sl_node *) ((p) & ~MARK))
+
+#define LOAD_NEXT(n, i) __atomic_load_n(&(n)->next[i], __ATOMIC_ACQUIRE)
+
+static void die(int err, const char *what) {
+    fprintf(stderr, "skip_list: %s: %s\n", what, strerror(err));
+    abort();
+}
+
+static int cas_next(sl_node *node, int level, uintptr_t *expected,
+                    uintptr_t desired) {
+    return __atomic_compare_exchange_n(&node->next[level], expected,
+                                       desired, 0, __ATOMIC_ACQ_REL,
+                                       __ATOMIC_ACQUIRE);
+}
+
+static sl_node *alloc_node(Key key, int value, int levels) {
+    sl_node *node = calloc(1, sizeof(sl_node) + levels * sizeof(uintptr_t));
+    if (node == NULL) { die(ENOMEM, "calloc"); }
+    node->key = key;
+    node->value = value;
+    node->levels = levels;
+    node->refs = 2;
+    return node;
+}
+
+static void reclaim_node(ebr_entry *entry) {
+    free((char *) entry - offsetof(sl_node, retired));
+}
+
+skip_list *sl_initialize(void) {
+    skip_list *list = calloc(1, sizeof(skip_list));
+    if (list == NULL) { die(ENOMEM, "calloc"); }
+    list->head = alloc_node(0, 0, SL_MAX_LEVEL);
+    list->node_count = 0;
+    list->seed = 0x9e3779b97f4a7c15UL;
+    list->ebr = ebr_create(reclaim_node);
+    return list;
+}
+
+void sl_destroy(skip_list *list) {
+    sl_node *node, *next;
+
+    for (node = list->head; node != NULL; node = next) {
+        next = NODE(node->next[0]);
+        free(node);
+    }
+    ebr_destroy(list->ebr);         // and everything retired to it
+    free(list);
+}
+
+size_t sl_size(skip_list *list) {
+    return __atomic_load_n(&list->node_count, __ATOMIC_RELAXED);
+}
+
+/* 1 + the number of trailing zeroes of a hash of the key: 1 with
+   probability 1/2, 2 with probability 1/4, ... */
+static int node_levels(skip_list *list, Key key) {
+    unsigned long h = (key ^ list->seed) * 0xff51afd7ed558ccdUL;
+
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53UL;
+    h ^= h >> 33;
+    return 1 + __builtin_ctzl(h | (1UL << (SL_MAX_LEVEL - 1)));
+}
+
+/* Fill in, at every level, the last node with a key below 'key' and the
+   node after it, snipping out any deleted nodes on the way; returns 1 if
+   succs[0] holds 'key' */
+static int find(skip_list *list, Key key, sl_node **preds, sl_node **succs) {
+    sl_node *pred, *curr;
+    uintptr_t next, expected;
+    int level;
+
+retry:
+    pred = list->head;
+    for (level = SL_MAX_LEVEL - 1; level >= 0; level--) {
+        curr = NODE(LOAD_NEXT(pred, level));
+        while (curr != NULL) {
+            next = LOAD_NEXT(curr, level);
+            if (MARKED(next)) {
+                /* If pred has been deleted (or pred->next has moved on)
+                   the CAS fails, and we start again */
+                expected = (uintptr_t) curr;
+                if (!cas_next(pred, level, &expected, (uintptr_t) NODE(next)))
+                    goto retry;
+                curr = NODE(next);
+                continue;
+            }
+            if (curr->key >= key)
+                break;
+            pred = curr;
+            curr = NODE(next);
+        }
+        preds[level] = pred;
+        succs[level] = curr;
+    }
+    return succs[0] != NULL && succs[0]->key == key;
+}
+
+static void release(skip_list *list, sl_node *node) {
+    if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        ebr_retire(list->ebr, &node->retired);
+}
+
+int sl_add(skip_list *list, Key key, int value) {
+    sl_node *preds[SL_MAX_LEVEL], *succs[SL_MAX_LEVEL], *node = NULL;
+    uintptr_t next, expected;
+    int levels = node_levels(list, key), i;
+
+    ebr_enter(list->ebr);
+    for (;;) {
+        if (find(list, key, preds, succs)) {
+            ebr_exit(list->ebr);
+            free(node);             // never published
+            return 0;
+        }
+        if (node == NULL) node = alloc_node(key, value, levels);
+        for (i = 0; i < levels; i++)
+            node->next[i] = (uintptr_t) succs[i];
+
+        expected = (uintptr_t) succs[0];
+        if (cas_next(preds[0], 0, &expected, (uintptr_t) node))
+            break;
+    }
+    __atomic_add_fetch(&list->node_count, 1, __ATOMIC_RELAXED);
+
+    for (i = 1; i < levels; i++) {
+        for (;;) {
+            next = LOAD_NEXT(node, i);
+            if (MARKED(next))       // deleted already: stop linking it
+                goto done;
+            if (NODE(next) != succs[i] &&
+                    !cas_next(node, i, &next, (uintptr_t) succs[i]))
+                continue;           // it has just been marked
+            expected = (uintptr_t) succs[i];
+            if (cas_next(preds[i], i, &expected, (uintptr_t) node))
+                break;
+            if (!find(list, key, preds, succs) || succs[0] != node)
+                goto done;          // deleted, and unlinked at level 0
+        }
+    }
+
+done:
+    /* If it was deleted while we were linking it, the deleter's search may
+       have run before our last link: search again to snip it out */
+    if (MARKED(LOAD_NEXT(node, 0)))
+        find(list, key, preds, succs);
+    release(list, node);
+    ebr_exit(list->ebr);
+    return 1;
+}
+
+int sl_delete(skip_list *list, Key key) {
+    sl_node *preds[SL_MAX_LEVEL], *succs[SL_MAX_LEVEL], *node;
+    uintptr_t next;
+    int i;
+
+    ebr_enter(list->ebr);
+    if (!find(list, key, preds, succs)) {
+        ebr_exit(list->ebr);
+        return 0;
+    }
+    node = succs[0];
+
+    for (i = node->levels - 1; i > 0; i--) {
+        next = LOAD_NEXT(node, i);
+        while (!MARKED(next) && !cas_next(node, i, &next, next | MARK))
+            ;
+    }
+
+    next = LOAD_NEXT(node, 0);
+    for (;;) {
+        if (MARKED(next)) {         // another delete() got there first
+            ebr_exit(list->ebr);
+            return 0;
+        }
+        if (cas_next(node, 0, &next, next | MARK))
+            break;
+    }
+    __atomic_sub_fetch(&list->node_count, 1, __ATOMIC_RELAXED);
+
+    find(list, key, preds, succs);  // unlink it at every level
+    release(list, node);
+    ebr_exit(list->ebr);
+    return 1;
+}
+
+/* A search that skips over deleted nodes rather than snipping them out,
+   and so never writes anything */
+int sl_lookup(skip_list *list, Key key, int *value) {
+    sl_node *pred, *curr;
+    uintptr_t next;
+    int level, found = 0;
+
+    ebr_enter(list->ebr);
+    pred = list->head;
+    curr = NULL;
+    for (level = SL_MAX_LEVEL - 1; level >= 0; level--) {
+        curr = NODE(LOAD_NEXT(pred, level));
+        while (curr != NULL) {
+            next = LOAD_NEXT(curr, level);
+            if (!MARKED(next)) {
+                if (curr->key >= key)
+                    break;
+                pred = curr;
+            }
+            curr = NODE(next);
+        }
+    }
+    if (curr != NULL && curr->key == key) {
+        if (value != NULL) *value = curr->value;
+        found = 1;
+    }
+    ebr_exit(list->ebr);
+    return found;
+}
+
+/* With no other threads about: no marks, every level in order, and each
+   level a subsequence of the one below */
+int sl_verify(skip_list *list) {
+    sl_node *node, *succ, *below;
+    size_t count = 0;
+    int level;
+
+    for (level = 0; level < SL_MAX_LEVEL; level++) {
+        below = list->head;
+        for (node = list->head; node->next[level] != 0; node = succ) {
+            if (MARKED(node->next[level]))
+                return 0;
+            succ = NODE(node->next[level]);
+            if ((node != list->head && succ->key <= node->key) ||
+                    succ->levels <= level)
+                return 0;
+            if (level == 0) {
+                count++;
+                continue;
+            }
+            while (below != NULL && below != succ)
+                below = NODE(below->next[level - 1]);
+            if (below == NULL)
+                return 0;
+        }
+    }
+    return count == list->node_count;
+}
+
+static void *ops_initialize(void) { return sl_initialize(); }
+static void ops_destroy(void *list) { sl_destroy(list); }
+static int ops_add(void *list, Key key, int value) {
+    return sl_add(list, key, value);
+}
+static int ops_delete(void *list, Key key) { return sl_delete(list, key); }
+static int ops_lookup(void *list, Key key, int *value) {
+    return sl_lookup(list, key, value);
+}
+static int ops_verify(void *list) { return sl_verify(list); }
+
+const tree_ops sl_ops = {
+    "skiplist", ops_initialize, ops_destroy, ops_add, ops_delete, ops_lookup,
+    ops_verify
+};
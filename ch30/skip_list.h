@@ -0,0 +1,49 @@
+/*
+  Lock-free skip list (see skip_list.c): an ordered map with the same keys
+  and values as binary_tree.h. sl_add(), sl_delete() and sl_lookup() may
+  be called from any number of threads, and none of them takes a lock.
+*/
+#ifndef SKIP_LIST_H
+#define SKIP_LIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../lib/ebr.h"
+#include "tree_ops.h"               // Key, and sl_ops for this list
+
+#define SL_MAX_LEVEL 24             // plenty for 2^24 keys and well beyond
+
+typedef struct sl_node {
+    Key key;
+    int value;
+    int levels;                     // next[0 .. levels - 1]
+    int refs;                       // adder and deleter; see skip_list.c
+    ebr_entry retired;
+    uintptr_t next[];               // low bit set: this node is deleted
+} sl_node;
+
+typedef struct skip_list {
+    sl_node *head;                  // sentinel, SL_MAX_LEVEL high
+    size_t node_count;              // updated atomically
+    unsigned long seed;             // for the node heights
+    ebr_domain *ebr;
+} skip_list;
+
+skip_list *sl_initialize(void);
+void sl_destroy(skip_list *list);
+
+// Returns 1 if 'key' was added, 0 if it was already present (unchanged)
+int sl_add(skip_list *list, Key key, int value);
+
+// Returns 1 if 'key' was removed, 0 if it wasn't present
+int sl_delete(skip_list *list, Key key);
+
+// Returns 1 and sets *value if 'key' is present, else returns 0
+int sl_lookup(skip_list *list, Key key, int *value);
+
+size_t sl_size(skip_list *list);
+
+// Checks ordering, every level and node_count; 1 if all consistent
+int sl_verify(skip_list *list);
+
+#endif
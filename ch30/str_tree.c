@@ -0,0 +1,7 @@
+/*
+  The string-key instantiation of binary_tree.c (see str_tree.h).
+*/
+
+#define BT_KEEP_PARAMS
+#include "str_tree.h"
+#include "binary_tree.c"
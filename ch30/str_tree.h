@@ -0,0 +1,23 @@
+/*
+  binary_tree.c with string keys (and a cached prefix of each in its
+  node; see bt_keys.h) and void * values: str_bt_root, str_initialize(),
+  str_add(), str_lookup() and so on (bt_template.h). Keys are made with
+  make_str_key(). The tree only points at the strings: each must outlive
+  the tree, even once str_delete() has removed it (see delete() in
+  bt_template.h).
+*/
+#ifndef STR_TREE_H
+#define STR_TREE_H
+
+#include "bt_keys.h"
+
+#define BT_PREFIX   str_
+#define BT_KEY      str_key
+#define BT_VALUE    void *
+#define BT_LT(a, b)             str_key_lt(a, b)
+#define BT_EQ(a, b)             str_key_eq(a, b)
+#define BT_KEY_LOAD(field)      str_key_load(&(field))
+#define BT_KEY_STORE(field, k)  str_key_store(&(field), k)
+#include "bt_template.h"
+
+#endif
@@ -0,0 +1,191 @@
+/*
+  Sorted versus random key streams, for each of the ch30 trees.
+
+  Usage: tree_bench [-t threads] [-n keys] [-s seed] [-i tree]
+                    [-o sorted|random]
+
+  For each implementation (or just the one named by -i), and for each of
+  two orders of the keys 0..keys-1 -- ascending, and shuffled -- 'threads'
+  threads insert the keys into a fresh tree, thread i taking every
+  threads'th key of the stream, starting at the i'th; then they all look
+  every key up again, in the same order. With ascending keys, the
+  unbalanced binary_tree.c degenerates into a linked list and both phases
+  cost O(n) per key, whereas the AVL tree stays O(log n) whatever the
+  order.
+
+  The default number of keys is kept small, since the degenerate case is
+  quadratic; -o runs just one of the two orders (e.g. "-o random" for a
+  large tree).
+*/
+
+#include <pthread.h>
+#include <time.h>
+#include "../lib/tlpi_hdr.h"
+#include "tree_ops.h"
+
+typedef struct bench_args {
+    pthread_t tid;
+    const tree_ops *ops;
+    void *tree;
+    const Key *keys;
+    long nkeys;
+    unsigned id;
+    unsigned nthreads;
+    long errors;
+} bench_args;
+
+static pthread_barrier_t barrier;
+
+static unsigned long xorshift(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Two phases, each begun and ended at the barrier so that the main thread
+   can time them: add this thread's keys, then look them all up */
+static void *bench(void *arg) {
+    bench_args *a = arg;
+    long i;
+    int value;
+
+    pthread_barrier_wait(&barrier);
+    for (i = a->id; i < a->nkeys; i += a->nthreads)
+        if (a->ops->add(a->tree, a->keys[i], (int) a->keys[i]) != 1)
+            a->errors++;
+    pthread_barrier_wait(&barrier);
+
+    pthread_barrier_wait(&barrier);
+    for (i = a->id; i < a->nkeys; i += a->nthreads)
+        if (a->ops->lookup(a->tree, a->keys[i], &value) != 1 ||
+                value != (int) a->keys[i])
+            a->errors++;
+    pthread_barrier_wait(&barrier);
+
+    return NULL;
+}
+
+static void run(const tree_ops *ops, const char *order, const Key *keys,
+                long nkeys, unsigned nthreads) {
+    bench_args *args;
+    void *tree;
+    double t0, t_add, t_lookup;
+    long errors;
+    unsigned i;
+    int s;
+
+    tree = ops->initialize();
+    args = calloc(nthreads, sizeof(bench_args));
+    if (args == NULL) errExit("calloc");
+
+    s = pthread_barrier_init(&barrier, NULL, nthreads + 1);
+    if (s != 0) errExitEN(s, "pthread_barrier_init");
+
+    for (i = 0; i < nthreads; i++) {
+        args[i].ops = ops;
+        args[i].tree = tree;
+        args[i].keys = keys;
+        args[i].nkeys = nkeys;
+        args[i].id = i;
+        args[i].nthreads = nthreads;
+        s = pthread_create(&args[i].tid, NULL, bench, &args[i]);
+        if (s != 0) errExitEN(s, "pthread_create");
+    }
+
+    t0 = now();
+    pthread_barrier_wait(&barrier);
+    pthread_barrier_wait(&barrier);
+    t_add = now() - t0;
+
+    t0 = now();
+    pthread_barrier_wait(&barrier);
+    pthread_barrier_wait(&barrier);
+    t_lookup = now() - t0;
+
+    errors = 0;
+    for (i = 0; i < nthreads; i++) {
+        s = pthread_join(args[i].tid, NULL);
+        if (s != 0) errExitEN(s, "pthread_join");
+        errors += args[i].errors;
+    }
+    pthread_barrier_destroy(&barrier);
+
+    if (errors != 0)
+        fatal("%s, %s keys: %ld operations failed", ops->name, order, errors);
+    if (!ops->verify(tree))
+        fatal("%s, %s keys: tree is inconsistent", ops->name, order);
+
+    printf("%-12s %-8s %10.3f %10.2f %10.3f %10.2f\n", ops->name, order,
+           t_add, nkeys / t_add / 1e6, t_lookup, nkeys / t_lookup / 1e6);
+
+    ops->destroy(tree);
+    free(args);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned nthreads = 4;
+    long nkeys = 10000, k, j;
+    unsigned long seed = 1, rng;
+    const tree_ops *only = NULL;
+    const char *order = NULL;
+    Key *sorted, *shuffled, t;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "t:n:s:i:o:")) != -1) {
+        switch (opt) {
+        case 't': nthreads = getInt(optarg, GN_GT_0, "threads"); break;
+        case 'n': nkeys = getLong(optarg, GN_GT_0, "keys");      break;
+        case 's': seed = getLong(optarg, GN_GT_0, "seed");       break;
+        case 'i':
+            only = find_tree_ops(optarg);
+            if (only == NULL) cmdLineErr("unknown tree '%s'\n", optarg);
+            break;
+        case 'o':
+            order = optarg;
+            if (strcmp(order, "sorted") != 0 && strcmp(order, "random") != 0)
+                cmdLineErr("order must be 'sorted' or 'random'\n");
+            break;
+        default:
+            usageErr("%s [-t threads] [-n keys] [-s seed] [-i tree] "
+                     "[-o sorted|random]\n", argv[0]);
+        }
+    }
+
+    sorted = malloc(nkeys * sizeof(Key));
+    shuffled = malloc(nkeys * sizeof(Key));
+    if (sorted == NULL || shuffled == NULL) errExit("malloc");
+
+    for (k = 0; k < nkeys; k++)
+        sorted[k] = shuffled[k] = k;
+    rng = seed;
+    for (k = nkeys - 1; k > 0; k--) {
+        j = xorshift(&rng) % (k + 1);
+        t = shuffled[k]; shuffled[k] = shuffled[j]; shuffled[j] = t;
+    }
+
+    printf("%ld keys, %u threads\n", nkeys, nthreads);
+    printf("%-12s %-8s %10s %10s %10s %10s\n", "tree", "order",
+           "add (s)", "Mops/s", "lookup (s)", "Mops/s");
+
+    for (i = 0; all_tree_ops[i] != NULL; i++) {
+        if (only != NULL && all_tree_ops[i] != only)
+            continue;
+        if (order == NULL || strcmp(order, "sorted") == 0)
+            run(all_tree_ops[i], "sorted", sorted, nkeys, nthreads);
+        if (order == NULL || strcmp(order, "random") == 0)
+            run(all_tree_ops[i], "random", shuffled, nkeys, nthreads);
+    }
+
+    free(sorted);
+    free(shuffled);
+    exit(EXIT_SUCCESS);
+}
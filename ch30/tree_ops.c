@@ -0,0 +1,20 @@
+/*
+  The list of tree implementations behind tree_ops.h.
+*/
+
+#include <string.h>
+#include "tree_ops.h"
+
+const tree_ops *const all_tree_ops[] = {
+    &bt_ops, &bt_locked_ops, &avl_ops, &sl_ops, &bp_ops, &st_ops, &hx_ops,
+    NULL
+};
+
+const tree_ops *find_tree_ops(const char *name) {
+    int i;
+
+    for (i = 0; all_tree_ops[i] != NULL; i++)
+        if (strcmp(all_tree_ops[i]->name, name) == 0)
+            return all_tree_ops[i];
+    return NULL;
+}
@@ -0,0 +1,33 @@
+/*
+  The operations common to the ch30 tree implementations, so that test and
+  benchmark programs can run the same workload against each of them.
+*/
+#ifndef TREE_OPS_H
+#define TREE_OPS_H
+
+typedef unsigned int Key;
+
+typedef struct tree_ops {
+    const char *name;
+    void *(*initialize)(void);
+    void (*destroy)(void *tree);
+    int (*add)(void *tree, Key key, int value);
+    int (*delete)(void *tree, Key key);
+    int (*lookup)(void *tree, Key key, int *value);
+    int (*verify)(void *tree);
+} tree_ops;
+
+extern const tree_ops bt_ops;       // binary_tree.c
+extern const tree_ops bt_locked_ops;    // ...with lookup_locked()
+extern const tree_ops avl_ops;      // avl_tree.c
+extern const tree_ops sl_ops;       // skip_list.c
+extern const tree_ops bp_ops;       // bplus_tree.c
+extern const tree_ops st_ops;       // sharded_tree.c, over binary_tree.c
+extern const tree_ops hx_ops;       // hash_index.c, binary_tree.c + a hash
+
+extern const tree_ops *const all_tree_ops[];    // NULL-terminated
+
+// Returns the implementation called 'name', or NULL
+const tree_ops *find_tree_ops(const char *name);
+
+#endif
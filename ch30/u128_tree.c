@@ -0,0 +1,7 @@
+/*
+  The 128-bit instantiation of binary_tree.c (see u128_tree.h).
+*/
+
+#define BT_KEEP_PARAMS
+#include "u128_tree.h"
+#include "binary_tree.c"
@@ -0,0 +1,17 @@
+/*
+  binary_tree.c with 128-bit keys and int values: u128_bt_root,
+  u128_initialize(), u128_add(), u128_lookup() and so on (bt_template.h).
+*/
+#ifndef U128_TREE_H
+#define U128_TREE_H
+
+#include "bt_keys.h"
+
+#define BT_PREFIX   u128_
+#define BT_KEY      u128_key
+#define BT_VALUE    int
+#define BT_KEY_LOAD(field)      u128_key_load(&(field))
+#define BT_KEY_STORE(field, k)  u128_key_store(&(field), k)
+#include "bt_template.h"
+
+#endif
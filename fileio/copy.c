@@ -13,46 +13,412 @@
 /* copy.c
 
    Copy the file named argv[1] to a new file named in argv[2].
+
+   The data is moved by copyFd() (copy_engine.c), which keeps the transfer
+   inside the kernel where it can and falls back to a read()/write() loop
+   otherwise. The loop's buffer size adapts at run time unless fixed with
+   -b/--bufsize (which accepts a K, M or G suffix). With -v, report (on
+   stderr, so that copying to stdout works) which path and buffer size
+   were used, the elapsed time and the throughput.
+
+   --engine selects how the data is moved: "auto" (the default, as above),
+   "rw" (the read()/write() loop only), "uring" (an io_uring pipeline
+   keeping -q/--queue-depth buffers in flight; see copy_uring.c) or "mmap"
+   (windows of the mapped input are written out, or with --mmap-dest
+   copied into a mapping of the output; see copy_mmap.c).
+
+   With -j N, a regular file is copied as N byte ranges by N threads (see
+   copy_parallel.c).
+
+   --sparse controls holes: "auto" (the default) copies only the data
+   extents of an input that has holes, leaving holes in the output;
+   "always" also turns blocks of zeros into holes; "never" writes holes out
+   as zeros. See copy_sparse.c.
+
+   --reflink controls cloning on copy-on-write filesystems, as for cp(1):
+   "auto" (the default) shares the input's extents when the filesystem can
+   and copies otherwise; "always" fails if it can't; "never" always copies.
+   reflink_test.sh checks these on a loopback btrfs or XFS image.
+
+   --nocache keeps the copy from flooding the page cache (and evicting
+   other processes' data): pages are dropped behind the cursor, and those
+   of the input only if they weren't already cached. --direct uses O_DIRECT
+   where the filesystem allows it, and --nocache otherwise. With -v, the
+   amount of each file resident in the page cache is reported before and
+   after the copy. See copy_nocache.c.
+
+   --checksum computes the CRC-32C of the data as it's copied (while each
+   buffer is still in the CPU cache, so at no extra I/O), and prints it.
+   --verify also reads the new file back (from the device, not the page
+   cache) and checks that its CRC matches. These need the data to pass
+   through user space, so they disable the in-kernel paths.
+
+   If argv[1] is a directory, the whole tree is copied into the directory
+   argv[2] (created if need be), with -j N worker threads copying files
+   (default: TREE_WORKERS); permissions, timestamps and symbolic links are
+   preserved. See copy_tree.c.
 */
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
 #include "tlpi_hdr.h"
+#include "copy_engine.h"
+#include "crc32c.h"
 
-#ifndef BUF_SIZE        /* Allow "cc -D" to override definition */
-#define BUF_SIZE 1024
-#endif
+#define OPT_SPARSE 256          /* Long options with no short form */
+#define OPT_REFLINK 257
+#define OPT_MMAP_DEST 258
+#define OPT_NOCACHE 259
+#define OPT_DIRECT 260
+#define OPT_CHECKSUM 261
+#define OPT_VERIFY 262
+
+#define TREE_WORKERS 8          /* Default -j in directory mode */
+
+static void
+usage(const char *progName)
+{
+    usageErr("%s [-v] [-b size] [-e engine] [-q depth] [-j jobs] "
+             "old-file new-file\n"
+             "       %s [-v] [-j jobs] [options] old-dir new-dir\n"
+             "        -b, --bufsize=N        chunk size "
+             "(default: adaptive)\n"
+             "        -e, --engine=ENGINE    auto, rw, uring or mmap "
+             "(default: auto)\n"
+             "            --mmap-dest        mmap engine: map the output too\n"
+             "        -q, --queue-depth=N    io_uring buffers in flight "
+             "(default: %d)\n"
+             "        -j, --jobs=N           copy byte ranges (or a tree's "
+             "files) in N threads\n"
+             "            --sparse=WHEN      auto, always or never "
+             "(default: auto)\n"
+             "            --reflink=WHEN     auto, always or never "
+             "(default: auto)\n"
+             "            --nocache          don't leave the data in the "
+             "page cache\n"
+             "            --direct           use O_DIRECT (else --nocache)\n"
+             "            --checksum         print the CRC-32C of the data\n"
+             "            --verify           ...and check it against a "
+             "re-read of new-file\n"
+             "        -v, --verbose          report the transfer path used\n",
+             progName, progName, COPY_URING_DEPTH);
+}
+
+/* Convert 'arg' (a number with an optional K, M or G suffix) to a size
+   in bytes, terminating with a diagnostic if it isn't valid */
+
+static size_t
+getSize(const char *arg, const char *name)
+{
+    char *endptr;
+    unsigned long long n;
+    int shift;
+
+    errno = 0;
+    n = strtoull(arg, &endptr, 10);
+    if (errno != 0 || endptr == arg || *arg == '-')
+        cmdLineErr("%s: invalid size '%s'\n", name, arg);
+
+    switch (*endptr) {
+    case 'k': case 'K': shift = 10; endptr++; break;
+    case 'm': case 'M': shift = 20; endptr++; break;
+    case 'g': case 'G': shift = 30; endptr++; break;
+    default:            shift = 0;            break;
+    }
+    if (*endptr != '\0' || n == 0 ||
+            n > ((unsigned long long) COPY_MAX_BUF_SIZE >> shift))
+        cmdLineErr("%s: invalid size '%s' (must be 1..%d)\n", name, arg,
+                   COPY_MAX_BUF_SIZE);
+
+    return (size_t) n << shift;
+}
+
+/* Return the number of KiB of the file open on 'fd' (or, if 'fd' is -1,
+   named by 'path') that are in the page cache, or -1 if we can't tell */
+
+static long
+residentKiB(int fd, const char *path)
+{
+    long pages;
+    int savedErrno;
+
+    if (fd == -1) {
+        fd = open(path, O_RDONLY);
+        if (fd == -1)
+            return -1;
+        pages = copyResidentPages(fd);
+        savedErrno = errno;
+        close(fd);
+        errno = savedErrno;
+    } else {
+        pages = copyResidentPages(fd);
+    }
+
+    return pages == -1 ? -1 : pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Read back the file 'path' just written through 'outFd' and check that
+   its length and CRC-32C match what copyFd() reported in 'stats' */
+
+static void
+verifyCopy(int outFd, const char *path, const struct copyStats *stats)
+{
+    const size_t bufSize = 1024 * 1024;
+    ssize_t numRead;
+    uint32_t crc;
+    off_t total;
+    char *buf;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        errExit("opening %s to verify", path);
+
+    /* Make the data reach the device, then drop it from the page cache,
+       so that what we check is what was actually stored */
+
+    if (fdatasync(outFd) == -1 && errno != EINVAL)
+        errExit("fdatasync %s", path);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    buf = malloc(bufSize);
+    if (buf == NULL)
+        errExit("malloc");
+
+    crc = 0;
+    total = 0;
+    while ((numRead = read(fd, buf, bufSize)) > 0) {
+        crc = crc32c(crc, buf, numRead);
+        total += numRead;
+    }
+    if (numRead == -1)
+        errExit("reading %s to verify", path);
+
+    free(buf);
+    if (close(fd) == -1)
+        errExit("close");
+
+    if (total != stats->bytes || crc != stats->crc)
+        fatal("verify: %s has %lld bytes, crc32c %08x; expected %lld bytes, "
+              "crc32c %08x", path, (long long) total, (unsigned) crc,
+              (long long) stats->bytes, (unsigned) stats->crc);
+}
+
+/* Copy the tree 'srcDir' into 'dstDir' and exit */
+
+static void
+copyDirectory(const char *srcDir, const char *dstDir,
+              const struct copyOpts *opts, Boolean verbose)
+{
+    struct treeStats ts;
+    struct timespec start, end;
+    double secs;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (copyTree(srcDir, dstDir, opts,
+                 opts->jobs != 0 ? opts->jobs : TREE_WORKERS, &ts) == -1)
+        errExit("copying %s to %s: %s %s", srcDir, dstDir, ts.errOp,
+                ts.errName);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (verbose) {
+        secs = (end.tv_sec - start.tv_sec) +
+               (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "%lu files (%lld bytes), %lu directories, "
+                "%lu symlinks copied", ts.files, (long long) ts.bytes,
+                ts.dirs, ts.symlinks);
+        if (ts.skipped != 0)
+            fprintf(stderr, ", %lu special files skipped", ts.skipped);
+        fprintf(stderr, " by %u worker%s, %.3f s", ts.workers,
+                ts.workers == 1 ? "" : "s", secs);
+        if (secs > 0)
+            fprintf(stderr, ", %.0f files/s", ts.files / secs);
+        fprintf(stderr, "\n");
+    }
+
+    exit(EXIT_SUCCESS);
+}
 
 int
 main(int argc, char *argv[])
 {
-    int inputFd, outputFd, openFlags;
+    int inputFd, outputFd, openFlags, opt;
     mode_t filePerms;
-    ssize_t numRead;
-    char buf[BUF_SIZE];
+    Boolean verbose, verify;
+    struct copyOpts opts;
+    struct copyStats stats;
+    struct timespec start, end;
+    struct stat sb;
+    double secs;
+    long inCached, outCached;
+    static const struct option longOpts[] = {
+        { "bufsize",     required_argument, NULL, 'b' },
+        { "engine",      required_argument, NULL, 'e' },
+        { "queue-depth", required_argument, NULL, 'q' },
+        { "jobs",        required_argument, NULL, 'j' },
+        { "sparse",      required_argument, NULL, OPT_SPARSE },
+        { "reflink",     required_argument, NULL, OPT_REFLINK },
+        { "mmap-dest",   no_argument,       NULL, OPT_MMAP_DEST },
+        { "nocache",     no_argument,       NULL, OPT_NOCACHE },
+        { "direct",      no_argument,       NULL, OPT_DIRECT },
+        { "checksum",    no_argument,       NULL, OPT_CHECKSUM },
+        { "verify",      no_argument,       NULL, OPT_VERIFY },
+        { "verbose",     no_argument,       NULL, 'v' },
+        { "help",        no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
 
-    if (argc != 3 || strcmp(argv[1], "--help") == 0)
-        usageErr("%s old-file new-file\n", argv[0]);
+    verbose = FALSE;
+    verify = FALSE;
+    memset(&opts, 0, sizeof(opts));
+    opts.engine = CE_AUTO;
+    opts.sparse = CS_AUTO;
+    opts.reflink = CR_AUTO;
+    while ((opt = getopt_long(argc, argv, "b:e:q:j:vh", longOpts,
+                              NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            opts.bufSize = getSize(optarg, "bufsize");
+            break;
+        case 'e':
+            if (strcmp(optarg, "auto") == 0)
+                opts.engine = CE_AUTO;
+            else if (strcmp(optarg, "rw") == 0)
+                opts.engine = CE_RW;
+            else if (strcmp(optarg, "uring") == 0)
+                opts.engine = CE_URING;
+            else if (strcmp(optarg, "mmap") == 0)
+                opts.engine = CE_MMAP;
+            else
+                cmdLineErr("engine: unknown engine '%s'\n", optarg);
+            break;
+        case 'q':
+            opts.queueDepth = getInt(optarg, GN_GT_0, "queue-depth");
+            if (opts.queueDepth > COPY_MAX_URING_DEPTH)
+                cmdLineErr("queue-depth: at most %d\n", COPY_MAX_URING_DEPTH);
+            break;
+        case 'j':
+            opts.jobs = getInt(optarg, GN_GT_0, "jobs");
+            if (opts.jobs > COPY_MAX_JOBS)
+                cmdLineErr("jobs: at most %d\n", COPY_MAX_JOBS);
+            break;
+        case OPT_SPARSE:
+            if (strcmp(optarg, "auto") == 0)
+                opts.sparse = CS_AUTO;
+            else if (strcmp(optarg, "always") == 0)
+                opts.sparse = CS_ALWAYS;
+            else if (strcmp(optarg, "never") == 0)
+                opts.sparse = CS_NEVER;
+            else
+                cmdLineErr("sparse: expected auto, always or never\n");
+            break;
+        case OPT_REFLINK:
+            if (strcmp(optarg, "auto") == 0)
+                opts.reflink = CR_AUTO;
+            else if (strcmp(optarg, "always") == 0)
+                opts.reflink = CR_ALWAYS;
+            else if (strcmp(optarg, "never") == 0)
+                opts.reflink = CR_NEVER;
+            else
+                cmdLineErr("reflink: expected auto, always or never\n");
+            break;
+        case OPT_MMAP_DEST:
+            opts.mmapOut = 1;
+            break;
+        case OPT_NOCACHE:
+            opts.cache = CC_NOCACHE;
+            break;
+        case OPT_DIRECT:
+            opts.cache = CC_DIRECT;
+            break;
+        case OPT_VERIFY:
+            verify = TRUE;
+            /* FALLTHROUGH */           /* --verify implies --checksum */
+        case OPT_CHECKSUM:
+            opts.checksum = 1;
+            break;
+        case 'v':
+            verbose = TRUE;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 2)
+        usage(argv[0]);
+
+    if (stat(argv[optind], &sb) == 0 && S_ISDIR(sb.st_mode)) {
+        if (opts.checksum)
+            cmdLineErr("--checksum and --verify are for single files\n");
+        copyDirectory(argv[optind], argv[optind + 1], &opts, verbose);
+    }
 
     /* Open input and output files */
 
-    inputFd = open(argv[1], O_RDONLY);
+    inputFd = open(argv[optind], O_RDONLY);
     if (inputFd == -1)
-        errExit("opening file %s", argv[1]);
+        errExit("opening file %s", argv[optind]);
 
     openFlags = O_CREAT | O_WRONLY | O_TRUNC;
+
+    /* A shared writable mapping of the output needs read access too */
+
+    if (opts.mmapOut)
+        openFlags = (openFlags & ~O_ACCMODE) | O_RDWR;
     filePerms = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP |
                 S_IROTH | S_IWOTH;      /* rw-rw-rw- */
-    outputFd = open(argv[2], openFlags, filePerms);
+    outputFd = open(argv[optind + 1], openFlags, filePerms);
     if (outputFd == -1)
-        errExit("opening file %s", argv[2]);
+        errExit("opening file %s", argv[optind + 1]);
 
     /* Transfer data until we encounter end of input or an error */
 
-    while ((numRead = read(inputFd, buf, BUF_SIZE)) > 0)
-        if (write(outputFd, buf, numRead) != numRead)
-            fatal("couldn't write whole buffer");
-    if (numRead == -1)
-        errExit("read");
+    inCached = verbose ? residentKiB(inputFd, NULL) : -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (copyFd(inputFd, outputFd, &opts, &stats) == -1)
+        errExit("copying %s to %s", argv[optind], argv[optind + 1]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (verbose) {
+        fprintf(stderr, "%lld bytes copied via %s", (long long) stats.bytes,
+                copyPathName(stats.path));
+        if (stats.queueDepth != 0)
+            fprintf(stderr, " (%u x %zu-byte buffers)", stats.queueDepth,
+                    stats.bufSize);
+        else if (stats.bufSize != 0)
+            fprintf(stderr, " (%zu-byte chunks)", stats.bufSize);
+        if (stats.jobs != 0)
+            fprintf(stderr, " in %u thread%s", stats.jobs,
+                    stats.jobs == 1 ? "" : "s");
+        if (stats.sparse)
+            fprintf(stderr, ", %lld bytes left as holes",
+                    (long long) stats.holeBytes);
+
+        secs = (end.tv_sec - start.tv_sec) +
+               (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, ", %.3f s", secs);
+        if (secs > 0)
+            fprintf(stderr, ", %.1f MB/s", stats.bytes / secs / 1e6);
+        fprintf(stderr, "\n");
+
+        if (inCached != -1) {
+            fprintf(stderr, "page cache: input %ld -> %ld KiB resident",
+                    inCached, residentKiB(inputFd, NULL));
+            outCached = residentKiB(-1, argv[optind + 1]);
+            if (outCached != -1)
+                fprintf(stderr, ", output %ld KiB", outCached);
+            fprintf(stderr, "\n");
+        }
+    }
+
+    if (opts.checksum)
+        fprintf(stderr, "crc32c %08x  %s\n", (unsigned) stats.crc,
+                argv[optind + 1]);
+    if (verify)
+        verifyCopy(outputFd, argv[optind + 1], &stats);
 
     if (close(inputFd) == -1)
         errExit("close input");
@@ -0,0 +1,251 @@
+/* copy_bench.c
+
+   Compare the throughput of the engines behind copyFd() (copy_engine.h)
+   across a range of file sizes, to see where each one wins.
+
+   Usage: copy_bench [-c] [-d dir] [-r reps] [size...]
+
+   For each size (default: 4K 64K 1M 16M 256M), a source file of that size
+   is created in 'dir' (default: the current directory) and copied 'reps'
+   times with each engine (by default, as many times as it takes to move at
+   least 256 MB, but at least 3). The best run is reported, in MB/s.
+
+   Normally the source stays in the page cache, so the figures show what
+   each engine costs in CPU and system calls. With -c, both files are
+   flushed and dropped from the page cache (fsync() plus
+   POSIX_FADV_DONTNEED) before every run, so device I/O is included.
+
+   The "rw+crc" column is the read()/write() loop computing a CRC-32C as it
+   goes; each run's CRC is checked against one computed by the portable
+   crc32cScalar(), so this doubles as a test of the accelerated crc32c().
+*/
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include "tlpi_hdr.h"
+#include "copy_engine.h"
+#include "crc32c.h"
+
+#define BENCH_BYTES (256LL * 1024 * 1024)  /* Move at least this per size */
+#define MIN_REPS 3
+#define MAX_REPS 10000
+
+static const struct {
+    const char *name;
+    enum copyEngine engine;
+    int mmapOut;
+    int checksum;
+} engines[] = {
+    { "rw",         CE_RW,      0,  0 },
+    { "rw+crc",     CE_RW,      0,  1 },
+    { "mmap",       CE_MMAP,    0,  0 },
+    { "mmap-dest",  CE_MMAP,    1,  0 },
+    { "uring",      CE_URING,   0,  0 },
+    { "auto",       CE_AUTO,    0,  0 },
+};
+
+#define NUM_ENGINES (sizeof(engines) / sizeof(engines[0]))
+
+static off_t
+parseSize(const char *arg)
+{
+    char *endptr;
+    long long n;
+
+    n = strtoll(arg, &endptr, 10);
+    switch (*endptr) {
+    case 'k': case 'K': n <<= 10; endptr++; break;
+    case 'm': case 'M': n <<= 20; endptr++; break;
+    case 'g': case 'G': n <<= 30; endptr++; break;
+    }
+    if (endptr == arg || *endptr != '\0' || n <= 0)
+        cmdLineErr("bad size '%s'\n", arg);
+    return n;
+}
+
+static void
+makeSource(const char *path, off_t size)
+{
+    char buf[65536];
+    unsigned long x;
+    size_t j, len;
+    off_t off;
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        errExit("open %s", path);
+
+    x = 12345;                          /* Nonzero data; no holes */
+    for (off = 0; off < size; off += len) {
+        for (j = 0; j < sizeof(buf); j++) {
+            x = x * 1103515245 + 12345;
+            buf[j] = x >> 16;
+        }
+        len = (size - off < (off_t) sizeof(buf)) ? (size_t) (size - off)
+                                                 : sizeof(buf);
+        if (write(fd, buf, len) != (ssize_t) len)
+            fatal("couldn't write %s", path);
+    }
+
+    if (fsync(fd) == -1)
+        errExit("fsync");
+    if (close(fd) == -1)
+        errExit("close");
+}
+
+/* Return the CRC-32C of the file 'path', computed by crc32cScalar() */
+
+static uint32_t
+referenceCrc(const char *path)
+{
+    char buf[65536];
+    ssize_t numRead;
+    uint32_t crc;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        errExit("open %s", path);
+    crc = 0;
+    while ((numRead = read(fd, buf, sizeof(buf))) > 0)
+        crc = crc32cScalar(crc, buf, numRead);
+    if (numRead == -1)
+        errExit("read %s", path);
+    close(fd);
+    return crc;
+}
+
+static void
+dropCache(const char *path)
+{
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return;                         /* E.g., no destination yet */
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+/* Copy 'src' to 'dst' once with engine 'e'; return the elapsed seconds.
+   If the engine computes a checksum, it must come to 'crc'. */
+
+static double
+timeCopy(const char *src, const char *dst, size_t e, uint32_t crc)
+{
+    struct copyOpts opts;
+    struct copyStats stats;
+    struct timespec start, end;
+    int inFd, outFd;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.engine = engines[e].engine;
+    opts.mmapOut = engines[e].mmapOut;
+    opts.checksum = engines[e].checksum;
+    opts.sparse = CS_NEVER;
+    opts.reflink = CR_NEVER;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    inFd = open(src, O_RDONLY);
+    if (inFd == -1)
+        errExit("open %s", src);
+    outFd = open(dst, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (outFd == -1)
+        errExit("open %s", dst);
+
+    if (copyFd(inFd, outFd, &opts, &stats) == -1)
+        errExit("copyFd (%s)", engines[e].name);
+    if (opts.checksum && stats.crc != crc)
+        fatal("%s: crc32c (%s) gave %08x, expected %08x", engines[e].name,
+              crc32cImpl(), (unsigned) stats.crc, (unsigned) crc);
+
+    if (close(inFd) == -1 || close(outFd) == -1)
+        errExit("close");
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const char *defaultSizes[] = { "4K", "64K", "1M", "16M", "256M" };
+    char src[PATH_MAX], dst[PATH_MAX];
+    const char *dir;
+    const char **sizes;
+    int numSizes, reps, opt, j, k, r;
+    Boolean cold;
+    double secs, best;
+    off_t size;
+    size_t e;
+    uint32_t crc;
+
+    dir = ".";
+    reps = 0;
+    cold = FALSE;
+    while ((opt = getopt(argc, argv, "cd:r:")) != -1) {
+        switch (opt) {
+        case 'c':   cold = TRUE;                                    break;
+        case 'd':   dir = optarg;                                   break;
+        case 'r':   reps = getInt(optarg, GN_GT_0, "reps");         break;
+        default:    usageErr("%s [-c] [-d dir] [-r reps] [size...]\n",
+                             argv[0]);
+        }
+    }
+
+    if (optind < argc) {
+        sizes = (const char **) &argv[optind];
+        numSizes = argc - optind;
+    } else {
+        sizes = defaultSizes;
+        numSizes = sizeof(defaultSizes) / sizeof(defaultSizes[0]);
+    }
+
+    snprintf(src, sizeof(src), "%s/copy_bench.src", dir);
+    snprintf(dst, sizeof(dst), "%s/copy_bench.dst", dir);
+
+    printf("%10s %6s", "size", "reps");
+    for (e = 0; e < NUM_ENGINES; e++)
+        printf(" %10s", engines[e].name);
+    printf("   (MB/s, best run%s; crc32c: %s)\n", cold ? ", cold cache" : "",
+           crc32cImpl());
+
+    for (j = 0; j < numSizes; j++) {
+        size = parseSize(sizes[j]);
+        makeSource(src, size);
+        crc = referenceCrc(src);
+
+        r = reps;
+        if (r == 0) {
+            r = BENCH_BYTES / size;
+            r = max(r, MIN_REPS);
+            r = min(r, MAX_REPS);
+        }
+
+        printf("%10s %6d", sizes[j], r);
+        fflush(stdout);
+        for (e = 0; e < NUM_ENGINES; e++) {
+            best = 0;
+            for (k = 0; k < r; k++) {
+                if (cold) {
+                    dropCache(src);
+                    dropCache(dst);
+                }
+                secs = timeCopy(src, dst, e, crc);
+                if (best == 0 || secs < best)
+                    best = secs;
+            }
+            printf(" %10.1f", best > 0 ? size / best / 1e6 : 0.0);
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+
+    unlink(src);
+    unlink(dst);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,560 @@
+/* copy_engine.c
+
+   Data-transfer engine for copy.c. See copy_engine.h for the interface.
+
+   The paths are tried in order of how little work they leave to user space:
+
+     FICLONE            - on a CoW filesystem (btrfs, XFS with reflink, ...)
+                          the output just shares the input's extents, in
+                          constant time (subject to opts->reflink);
+     copy_file_range()  - the filesystem may copy (or share) extents without
+                          the data ever leaving the page cache/device;
+     sendfile()         - one copy, page cache to page cache, in the kernel;
+     splice()           - input -> pipe -> output, again without a copy to
+                          user space (and usable when the input is a pipe);
+     read()/write()     - the classic loop through a user-space buffer.
+
+   The read()/write() buffer is page-aligned and allocated at run time. When
+   its size isn't fixed by the caller, we start from the larger st_blksize
+   of the two files (but at least AUTO_START_BUF), never allocate more than
+   the input could fill, and tune the chunk by timing PROBE_ROUNDS
+   iterations at each size: double while that buys at least 10% more
+   throughput, otherwise (if the very first doubling didn't help) try
+   halving instead, and then settle on the best size seen.
+
+   Each call moves as much as the kernel will take. A path is abandoned (and
+   the next one tried from the current file offsets) only for errors that
+   mean "not supported for these file descriptors"; anything else is a real
+   I/O error and is returned to the caller.
+
+   With opts->checksum, only the read()/write() loop is used (or the mmap or
+   no-cache engine, if asked for), and the CRC-32C of the data is computed
+   from its buffer between the read() and the write(), while the data is
+   still in the CPU's cache.
+*/
+#define _GNU_SOURCE             /* copy_file_range(), splice(), F_SETPIPE_SZ */
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <linux/fs.h>           /* FICLONE, FICLONERANGE */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "copy_engine.h"
+#include "crc32c.h"
+
+#define AUTO_START_BUF (128 * 1024)     /* Smallest automatic starting chunk */
+#define AUTO_MAX_BUF (8 * 1024 * 1024)  /* Largest automatically chosen chunk */
+#define PROBE_ROUNDS 4                  /* Iterations timed per trial size */
+#define PROBE_GAIN 1.10                 /* Improvement needed to keep going */
+
+#define XFER_CHUNK (1 << 30)    /* Most we ask the kernel for per call */
+#define PIPE_SIZE (1 << 20)     /* Requested capacity of the splice() pipe */
+
+typedef ssize_t (*xferFunc)(int inFd, int outFd, void *arg);
+
+/* Return nonzero if 'err' means that a path can't be used for this pair of
+   file descriptors (as opposed to the copy itself having failed) */
+
+int
+copyUnsupported(int err)
+{
+    return err == ENOSYS || err == EXDEV || err == EINVAL ||
+           err == EOPNOTSUPP || err == ENOTSUP || err == EBADF;
+}
+
+static ssize_t
+xferCopyFileRange(int inFd, int outFd, void *arg)
+{
+    (void) arg;
+    return copy_file_range(inFd, NULL, outFd, NULL, XFER_CHUNK, 0);
+}
+
+static ssize_t
+xferSendfile(int inFd, int outFd, void *arg)
+{
+    (void) arg;
+    return sendfile(outFd, inFd, NULL, XFER_CHUNK);
+}
+
+struct splicePipe {
+    int pfd[2];
+    int outRefused;             /* Output turned out not to take splice() */
+};
+
+/* Write the 'len' bytes waiting in the pipe 'pipeFd' to 'outFd' using
+   read() and write() */
+
+static int
+drainPipe(int pipeFd, int outFd, ssize_t len)
+{
+    char buf[4096];
+    ssize_t numRead, numWritten, off;
+
+    while (len > 0) {
+        numRead = read(pipeFd, buf, len < (ssize_t) sizeof(buf) ?
+                                    (size_t) len : sizeof(buf));
+        if (numRead == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for (off = 0; off < numRead; off += numWritten) {
+            numWritten = write(outFd, buf + off, numRead - off);
+            if (numWritten == -1) {
+                if (errno != EINTR)
+                    return -1;
+                numWritten = 0;
+            }
+        }
+        len -= numRead;
+    }
+
+    return 0;
+}
+
+/* Move one pipe-load: input -> pipe, then drain the pipe into the output.
+   'arg' points to a struct splicePipe. */
+
+static ssize_t
+xferSplice(int inFd, int outFd, void *arg)
+{
+    struct splicePipe *sp = arg;
+    ssize_t numIn, numOut, left;
+
+    if (sp->outRefused) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    numIn = splice(inFd, NULL, sp->pfd[1], NULL, XFER_CHUNK,
+                   SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (numIn <= 0)
+        return numIn;
+
+    for (left = numIn; left > 0; left -= numOut) {
+        numOut = splice(sp->pfd[0], NULL, outFd, NULL, left,
+                        SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (numOut == -1 && errno == EINTR) {
+            numOut = 0;
+            continue;
+        }
+        if (numOut == -1 && copyUnsupported(errno)) {
+            /* What we took from the input is stranded in the pipe, so
+               write it out by hand; the next call then reports the path
+               as unsupported and runPath() moves on */
+
+            if (drainPipe(sp->pfd[0], outFd, left) == -1)
+                return -1;
+            sp->outRefused = 1;
+            break;
+        }
+        if (numOut <= 0) {
+            if (numOut == 0)
+                errno = EIO;
+            return -1;
+        }
+    }
+
+    return numIn;
+}
+
+/* Run 'xfer' until end of input, accounting in 'stats' for the data moved
+   (and recording 'path' as the one in use once it has moved something).
+   Returns 1 if this path reached end of input, 0 if the caller should try
+   the next path, or -1 on error. */
+
+static int
+runPath(enum copyPath path, xferFunc xfer, int inFd, int outFd, void *arg,
+        struct copyStats *stats)
+{
+    ssize_t numXfer;
+    int moved = 0;
+
+    for (;;) {
+        numXfer = xfer(inFd, outFd, arg);
+        if (numXfer > 0) {
+            stats->bytes += numXfer;
+            stats->path = path;
+            moved = 1;
+        } else if (numXfer == 0) {
+            /* Some pseudo-files (e.g., under /proc) report 0 to the
+               in-kernel paths even though read() would return data, so a
+               path that moved nothing is not trusted to have seen EOF */
+
+            return moved;
+        } else if (errno != EINTR) {
+            return copyUnsupported(errno) ? 0 : -1;
+        }
+    }
+}
+
+struct chunkTuner {
+    size_t chunk;               /* Current read()/write() size */
+    size_t cap;                 /* Allocated buffer size */
+    size_t minChunk;
+    size_t bestChunk;
+    double bestRate;            /* Bytes/second measured at 'bestChunk' */
+    int dir;                    /* +1 growing, -1 shrinking, 0 settled */
+    int grown;                  /* Has a doubling ever paid off? */
+    int rounds;                 /* Iterations timed at current size */
+    off_t roundBytes;
+    struct timespec start;
+};
+
+static size_t
+roundUp(size_t n, size_t multiple)
+{
+    return (n + multiple - 1) / multiple * multiple;
+}
+
+/* Decide the buffer size ('cap') and the starting chunk for copying from
+   'inFd' to 'outFd' */
+
+static void
+tunerInit(struct chunkTuner *t, int inFd, int outFd, size_t bufSize,
+          size_t pageSize)
+{
+    struct stat inSb, outSb;
+    size_t blk;
+
+    t->minChunk = pageSize;
+    t->bestRate = 0;
+    t->grown = 0;
+    t->rounds = 0;
+    t->roundBytes = 0;
+
+    if (bufSize != 0) {                 /* Caller's choice; don't tune */
+        t->chunk = bufSize;
+        t->cap = roundUp(bufSize, pageSize);
+        t->dir = 0;
+        return;
+    }
+
+    blk = pageSize;
+    t->cap = AUTO_MAX_BUF;
+    if (fstat(inFd, &inSb) == 0) {
+        if ((size_t) inSb.st_blksize > blk)
+            blk = inSb.st_blksize;
+        if (S_ISREG(inSb.st_mode) && inSb.st_size > 0 &&
+                inSb.st_size < (off_t) t->cap)
+            t->cap = roundUp(inSb.st_size, pageSize);
+    }
+    if (fstat(outFd, &outSb) == 0 && (size_t) outSb.st_blksize > blk)
+        blk = outSb.st_blksize;
+
+    t->chunk = roundUp(blk > AUTO_START_BUF ? blk : AUTO_START_BUF, blk);
+    if (t->chunk > t->cap)
+        t->chunk = t->cap;
+    t->bestChunk = t->chunk;
+    t->dir = 1;
+    clock_gettime(CLOCK_MONOTONIC, &t->start);
+}
+
+/* Account for an iteration that moved 'numBytes', and once PROBE_ROUNDS
+   iterations have been timed at the current size, pick the next size */
+
+static void
+tunerUpdate(struct chunkTuner *t, size_t numBytes)
+{
+    struct timespec now;
+    double secs, rate;
+    size_t next;
+
+    if (t->dir == 0)
+        return;
+
+    t->roundBytes += numBytes;
+    if (++t->rounds < PROBE_ROUNDS)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = (now.tv_sec - t->start.tv_sec) +
+           (now.tv_nsec - t->start.tv_nsec) / 1e9;
+    rate = secs > 0 ? t->roundBytes / secs : 0;
+
+    if (t->bestRate == 0 || rate > t->bestRate * PROBE_GAIN) {
+        if (t->bestRate != 0 && t->dir > 0)
+            t->grown = 1;
+        t->bestRate = rate;
+        t->bestChunk = t->chunk;
+        next = t->dir > 0 ? t->chunk * 2 : t->chunk / 2;
+    } else if (t->dir > 0 && !t->grown) {
+        t->dir = -1;                    /* Growing didn't help; try smaller */
+        next = t->bestChunk / 2;
+    } else {
+        next = 0;
+    }
+
+    if (next < t->minChunk || next > t->cap) {
+        t->chunk = t->bestChunk;        /* Settle on the best size seen */
+        t->dir = 0;
+    } else {
+        t->chunk = next;
+    }
+
+    t->rounds = 0;
+    t->roundBytes = 0;
+    t->start = now;
+}
+
+static int
+readWrite(int inFd, int outFd, const struct copyOpts *opts,
+          struct copyStats *stats)
+{
+    struct chunkTuner t;
+    char *buf;
+    size_t pageSize;
+    ssize_t numRead, numWritten, off;
+    int savedErrno;
+
+    pageSize = sysconf(_SC_PAGESIZE);
+    tunerInit(&t, inFd, outFd, opts->bufSize, pageSize);
+
+    errno = posix_memalign((void **) &buf, pageSize, t.cap);
+    if (errno != 0)
+        return -1;
+
+    while ((numRead = read(inFd, buf, t.chunk)) != 0) {
+        if (numRead == -1) {
+            if (errno == EINTR)
+                continue;
+            goto fail;
+        }
+
+        if (opts->checksum)             /* While the data is in cache */
+            stats->crc = crc32c(stats->crc, buf, numRead);
+
+        for (off = 0; off < numRead; off += numWritten) {
+            numWritten = write(outFd, buf + off, numRead - off);
+            if (numWritten == -1) {
+                if (errno != EINTR)
+                    goto fail;
+                numWritten = 0;
+            }
+        }
+        stats->bytes += numRead;
+        stats->path = CP_READ_WRITE;
+        stats->bufSize = t.chunk;
+
+        tunerUpdate(&t, numRead);
+    }
+
+    free(buf);
+    return 0;
+
+fail:
+    savedErrno = errno;
+    free(buf);
+    errno = savedErrno;
+    return -1;
+}
+
+/* Make the output share the input's extents from the current offsets on.
+   Returns 1 on success, 0 (with errno saying why) if that isn't possible
+   for these files, or -1 on error. */
+
+static int
+tryClone(int inFd, int outFd, struct copyStats *stats)
+{
+    struct stat inSb, outSb;
+    struct file_clone_range fcr;
+    off_t inOff, outOff;
+    int s;
+
+    if (fstat(inFd, &inSb) == -1 || fstat(outFd, &outSb) == -1)
+        return -1;
+    if (!S_ISREG(inSb.st_mode) || !S_ISREG(outSb.st_mode)) {
+        errno = EINVAL;
+        return 0;
+    }
+    inOff = lseek(inFd, 0, SEEK_CUR);
+    outOff = lseek(outFd, 0, SEEK_CUR);
+    if (inOff == -1 || outOff == -1)
+        return -1;
+
+    /* Pseudo-files (e.g., under /proc) report st_size 0 but have data, so
+       a size that leaves nothing to share only means that the copy engines
+       must find EOF by reading */
+
+    if (inOff >= inSb.st_size) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    if (inOff == 0 && outOff == 0) {
+        s = ioctl(outFd, FICLONE, inFd);
+    } else {
+        fcr.src_fd = inFd;
+        fcr.src_offset = inOff;
+        fcr.src_length = 0;             /* To end of file */
+        fcr.dest_offset = outOff;
+        s = ioctl(outFd, FICLONERANGE, &fcr);
+    }
+    if (s == -1)
+        return (copyUnsupported(errno) || errno == ENOTTY ||
+                errno == ETXTBSY) ? 0 : -1;
+
+    stats->bytes = inSb.st_size - inOff;
+    stats->path = CP_CLONE;
+
+    /* Leave the offsets where a copy would have left them */
+
+    if (lseek(inFd, inSb.st_size, SEEK_SET) == -1 ||
+            lseek(outFd, outOff + stats->bytes, SEEK_SET) == -1)
+        return -1;
+    return 1;
+}
+
+/* Should copySparse() be used for 'inFd'? With CS_ALWAYS, any regular file
+   with a nonzero size qualifies; otherwise, only one that occupies fewer
+   blocks than its size would need. A size of 0 may be a pseudo-file with
+   data (e.g., under /proc), which is left to the plain copy paths. */
+
+static int
+hasHoles(int inFd, enum copySparse sparse)
+{
+    struct stat sb;
+
+    if (fstat(inFd, &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_size == 0)
+        return 0;
+    return sparse == CS_ALWAYS || (off_t) sb.st_blocks * 512 < sb.st_size;
+}
+
+int
+copyFd(int inFd, int outFd, const struct copyOpts *opts,
+       struct copyStats *stats)
+{
+    struct splicePipe sp;
+    int s, savedErrno;
+
+    stats->bytes = 0;
+    stats->path = CP_NONE;
+    stats->bufSize = 0;
+    stats->queueDepth = 0;
+    stats->jobs = 0;
+    stats->sparse = 0;
+    stats->holeBytes = 0;
+    stats->crc = 0;
+
+    if (opts->bufSize > COPY_MAX_BUF_SIZE ||
+            opts->queueDepth > COPY_MAX_URING_DEPTH ||
+            opts->jobs > COPY_MAX_JOBS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* A checksum needs the data to pass through a user-space buffer, which
+       only the read()/write() loop and the mmap and no-cache engines do */
+
+    if (opts->checksum) {
+        if (opts->reflink == CR_ALWAYS) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (opts->cache != CC_NORMAL)
+            return copyNocache(inFd, outFd, opts, stats);
+        if (opts->engine == CE_MMAP) {
+            if (copyMmap(inFd, outFd, opts, stats) == 0)
+                return 0;
+            if (!copyUnsupported(errno) || stats->bytes != 0)
+                return -1;
+            stats->bufSize = 0;
+        }
+        return readWrite(inFd, outFd, opts, stats);
+    }
+
+    if (opts->reflink != CR_NEVER) {
+        s = tryClone(inFd, outFd, stats);
+        if (s != 0)
+            return s == 1 ? 0 : -1;
+        if (opts->reflink == CR_ALWAYS)
+            return -1;
+    }
+
+    if (opts->cache != CC_NORMAL)
+        return copyNocache(inFd, outFd, opts, stats);
+
+    if (opts->sparse != CS_NEVER && hasHoles(inFd, opts->sparse)) {
+        if (copySparse(inFd, outFd, opts, stats) == 0)
+            return 0;
+        if (!copyUnsupported(errno) || stats->bytes != 0)
+            return -1;
+        stats->sparse = 0;
+        stats->holeBytes = 0;
+    }
+
+    if (opts->jobs > 1) {
+        if (copyParallel(inFd, outFd, opts, stats) == 0)
+            return 0;
+        if (!copyUnsupported(errno) || stats->bytes != 0)
+            return -1;
+    }
+
+    if (opts->engine == CE_URING) {
+        if (copyUring(inFd, outFd, opts, stats) == 0)
+            return 0;
+        if (!copyUnsupported(errno) || stats->bytes != 0)
+            return -1;
+        stats->bufSize = 0;
+        stats->queueDepth = 0;
+        return readWrite(inFd, outFd, opts, stats);
+    }
+
+    if (opts->engine == CE_MMAP) {
+        if (copyMmap(inFd, outFd, opts, stats) == 0)
+            return 0;
+        if (!copyUnsupported(errno) || stats->bytes != 0)
+            return -1;
+        stats->bufSize = 0;
+        return readWrite(inFd, outFd, opts, stats);
+    }
+
+    if (opts->engine == CE_RW)
+        return readWrite(inFd, outFd, opts, stats);
+
+    s = runPath(CP_COPY_FILE_RANGE, xferCopyFileRange, inFd, outFd, NULL,
+                stats);
+    if (s != 0)
+        return s == 1 ? 0 : -1;
+
+    s = runPath(CP_SENDFILE, xferSendfile, inFd, outFd, NULL, stats);
+    if (s != 0)
+        return s == 1 ? 0 : -1;
+
+    if (pipe(sp.pfd) == 0) {
+        fcntl(sp.pfd[1], F_SETPIPE_SZ, PIPE_SIZE);  /* Best effort */
+        sp.outRefused = 0;
+        s = runPath(CP_SPLICE, xferSplice, inFd, outFd, &sp, stats);
+        savedErrno = errno;
+        close(sp.pfd[0]);
+        close(sp.pfd[1]);
+        errno = savedErrno;
+        if (s != 0)
+            return s == 1 ? 0 : -1;
+    }
+
+    return readWrite(inFd, outFd, opts, stats);
+}
+
+const char *
+copyPathName(enum copyPath path)
+{
+    switch (path) {
+    case CP_CLONE:              return "reflink";
+    case CP_COPY_FILE_RANGE:    return "copy_file_range";
+    case CP_SENDFILE:           return "sendfile";
+    case CP_SPLICE:             return "splice";
+    case CP_URING:              return "io_uring";
+    case CP_READ_WRITE:         return "read/write";
+    case CP_PREAD_PWRITE:       return "pread/pwrite";
+    case CP_MMAP_WRITE:         return "mmap/write";
+    case CP_MMAP_MEMCPY:        return "mmap/memcpy";
+    case CP_NOCACHE:            return "read/write, uncached";
+    case CP_DIRECT:             return "O_DIRECT read/write";
+    default:                    return "none";
+    }
+}
@@ -0,0 +1,172 @@
+/* copy_engine.h
+
+   Interface to the data-transfer engine used by copy.c.
+
+   copyFd() moves everything from the current offset of 'inFd' to the
+   current offset of 'outFd'. Unless opts->reflink is CR_NEVER, it first
+   asks the filesystem to clone the data (FICLONE/FICLONERANGE), which on
+   CoW filesystems shares the input's extents instead of copying them; with
+   CR_ALWAYS, failure to clone is an error. Whether a clone is possible is
+   left to the ioctl (which fails with EXDEV across filesystems): btrfs
+   subvolumes have st_dev values of their own, yet can share extents.
+
+   Otherwise copyFd() prefers transfers that stay inside the kernel
+   (copy_file_range(), sendfile(), splice() through a pipe). It falls back
+   to a read()/write() loop through a user-space buffer only when the
+   kernel refuses all of them for this pair of file descriptors.
+
+   With opts->engine set to CE_URING, the data is instead moved by an
+   io_uring pipeline (copy_uring.c) that keeps several reads and writes in
+   flight at once; if the kernel (or the file types) don't allow that, the
+   read()/write() loop is used. CE_RW goes straight to the loop. CE_MMAP
+   maps the input a window at a time (copy_mmap.c) and writes each window
+   out with write(), or with opts->mmapOut, memcpy()s it into a mapping of
+   the output.
+
+   A regular input that has holes (or any regular input, with CS_ALWAYS) is
+   copied by copy_sparse.c instead, which transfers only the data extents
+   found with lseek(SEEK_DATA/SEEK_HOLE) and leaves holes in the output.
+   This takes precedence over the io_uring and parallel engines.
+
+   With opts->jobs greater than 1, a regular file is instead split into
+   that many byte ranges, each copied by its own thread (copy_parallel.c)
+   using copy_file_range() (CE_AUTO only) or pread()/pwrite().
+
+   With opts->cache other than CC_NORMAL, the copy (after any reflink) is
+   done by copy_nocache.c instead of any of the above, so that it doesn't
+   fill the page cache: either with O_DIRECT, or with a read()/write() loop
+   that drops the pages it has used behind it. copyResidentPages() reports
+   how much of a file is in the page cache, to measure the effect.
+
+   With opts->checksum, the CRC-32C (crc32c.h) of everything copied is
+   computed along the way and returned in stats->crc. This rules out the
+   clone, in-kernel, sparse, parallel and io_uring paths, none of which
+   bring the data into user space.
+
+   The read()/write() loop sizes its buffer at run time: either exactly as
+   asked for in 'opts', or starting from the files' st_blksize (capped by the
+   input size) and then doubling/halving the chunk over the first few
+   iterations while the measured throughput keeps improving.
+
+   copyTree() (copy_tree.c) copies a directory tree, using copyFd() for
+   each regular file in a pool of worker threads.
+
+   The functions here do not print anything or terminate the process: on
+   error they return -1 with errno set, so the caller decides how to report.
+*/
+#ifndef COPY_ENGINE_H
+#define COPY_ENGINE_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+enum copyPath {                 /* How the data was (mostly) moved */
+    CP_NONE,                    /* Nothing to move (empty input) */
+    CP_CLONE,                   /* Extents shared, nothing copied */
+    CP_COPY_FILE_RANGE,
+    CP_SENDFILE,
+    CP_SPLICE,
+    CP_URING,
+    CP_READ_WRITE,
+    CP_PREAD_PWRITE,
+    CP_MMAP_WRITE,
+    CP_MMAP_MEMCPY,
+    CP_NOCACHE,                 /* read()/write(), pages dropped behind us */
+    CP_DIRECT                   /* read()/write() with O_DIRECT */
+};
+
+enum copyReflink {
+    CR_AUTO,                    /* Clone if possible, else copy */
+    CR_ALWAYS,                  /* Clone or fail */
+    CR_NEVER                    /* Always copy the data */
+};
+
+enum copySparse {
+    CS_AUTO,                    /* Preserve holes if the input has any */
+    CS_ALWAYS,                  /* ...and also skip all-zero blocks */
+    CS_NEVER                    /* Write holes out as zeros */
+};
+
+enum copyEngine {
+    CE_AUTO,                    /* In-kernel paths, then read()/write() */
+    CE_RW,                      /* read()/write() loop only */
+    CE_URING,                   /* io_uring pipeline, else read()/write() */
+    CE_MMAP                     /* mmap() windows, else read()/write() */
+};
+
+enum copyCache {
+    CC_NORMAL,                  /* Leave the page cache to the kernel */
+    CC_NOCACHE,                 /* Drop our pages from the cache as we go */
+    CC_DIRECT                   /* O_DIRECT if possible, else CC_NOCACHE */
+};
+
+#define COPY_MAX_BUF_SIZE (64 * 1024 * 1024)   /* Largest opts.bufSize */
+#define COPY_URING_DEPTH 8                      /* Default opts.queueDepth */
+#define COPY_MAX_URING_DEPTH 1024
+#define COPY_MAX_JOBS 256
+
+struct copyOpts {
+    enum copyEngine engine;
+    enum copySparse sparse;
+    enum copyReflink reflink;
+    size_t bufSize;             /* Chunk size; 0 = engine's choice */
+    unsigned queueDepth;        /* io_uring buffers in flight; 0 = default */
+    unsigned jobs;              /* Threads for a parallel copy; 0 or 1 = no */
+    int mmapOut;                /* CE_MMAP: map the output too? */
+    enum copyCache cache;
+    int checksum;               /* Compute the CRC-32C of the data? */
+};
+
+struct copyStats {
+    enum copyPath path;         /* Last path that moved data */
+    off_t bytes;                /* Total bytes transferred */
+    size_t bufSize;             /* Final chunk size (0 = no buffer used) */
+    unsigned queueDepth;        /* io_uring buffers used (0 = not used) */
+    unsigned jobs;              /* Threads used (0 = serial copy) */
+    int sparse;                 /* Were holes preserved? */
+    off_t holeBytes;            /* Bytes of input left as holes */
+    uint32_t crc;               /* CRC-32C of the data, if opts->checksum */
+};
+
+int copyFd(int inFd, int outFd, const struct copyOpts *opts,
+           struct copyStats *stats);
+
+const char *copyPathName(enum copyPath path);
+
+long copyResidentPages(int fd);
+
+struct treeStats {
+    unsigned long files;        /* Regular files copied */
+    unsigned long dirs;
+    unsigned long symlinks;
+    unsigned long skipped;      /* Devices, sockets, ...: not copied */
+    off_t bytes;
+    unsigned workers;           /* Threads that copied files */
+    const char *errOp;          /* On error: what failed... */
+    char errName[256];          /* ...and on which entry */
+};
+
+int copyTree(const char *srcPath, const char *dstPath,
+             const struct copyOpts *opts, unsigned workers,
+             struct treeStats *stats);
+
+/* Engines behind copyFd() */
+
+int copyUnsupported(int err);
+
+int copyUring(int inFd, int outFd, const struct copyOpts *opts,
+              struct copyStats *stats);
+
+int copyParallel(int inFd, int outFd, const struct copyOpts *opts,
+                 struct copyStats *stats);
+
+int copySparse(int inFd, int outFd, const struct copyOpts *opts,
+               struct copyStats *stats);
+
+int copyMmap(int inFd, int outFd, const struct copyOpts *opts,
+             struct copyStats *stats);
+
+int copyNocache(int inFd, int outFd, const struct copyOpts *opts,
+                struct copyStats *stats);
+
+#endif
@@ -0,0 +1,153 @@
+/* copy_mmap.c
+
+   mmap() engine for copyFd() (see copy_engine.h).
+
+   The input is mapped a window at a time (so files much larger than the
+   address space we're prepared to use can still be copied), and each
+   window is either handed straight to write() -- saving the copy into a
+   user-space buffer that read() would make -- or, with opts->mmapOut,
+   memcpy()d into a matching window of the output, which is first extended
+   to its final size. memcpy() here is glibc's, which already picks the
+   widest vector/"rep movsb" variant the CPU supports at run time.
+
+   The copy starts at the input's current offset and lands at the output's;
+   mappings must start on a page boundary, so a window starting elsewhere
+   is mapped from the page holding its first byte. The sizes come from
+   st_size, so an input with nothing past its offset by that measure (such
+   as a /proc file, which reports 0) is declined, for read() to deal with.
+
+   The kernel is told that the input will be read sequentially
+   (posix_fadvise(POSIX_FADV_SEQUENTIAL) and madvise(MADV_SEQUENTIAL)), and
+   read-ahead of the next window is started (POSIX_FADV_WILLNEED) before we
+   start on the current one.
+
+   As with any use of mmap(), if the input is truncated while it is being
+   copied, touching the vanished pages raises SIGBUS.
+*/
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "copy_engine.h"
+#include "crc32c.h"
+
+#define MMAP_WINDOW (64 * 1024 * 1024)  /* Default size of each mapping */
+
+static int
+writeAll(int fd, const char *buf, size_t len)
+{
+    ssize_t numWritten;
+    size_t done;
+
+    for (done = 0; done < len; done += numWritten) {
+        numWritten = write(fd, buf + done, len - done);
+        if (numWritten == -1) {
+            if (errno != EINTR)
+                return -1;
+            numWritten = 0;
+        }
+    }
+    return 0;
+}
+
+int
+copyMmap(int inFd, int outFd, const struct copyOpts *opts,
+         struct copyStats *stats)
+{
+    struct stat inSb, outSb;
+    size_t window, len, pageSize, inSkip, outSkip;
+    off_t inStart, outStart, size, outEnd, off, outOff;
+    char *src, *dst;
+    int s, savedErrno;
+
+    if (fstat(inFd, &inSb) == -1 || fstat(outFd, &outSb) == -1)
+        return -1;
+    if (!S_ISREG(inSb.st_mode) ||
+            (opts->mmapOut && !S_ISREG(outSb.st_mode))) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    inStart = lseek(inFd, 0, SEEK_CUR);
+    outStart = lseek(outFd, 0, SEEK_CUR);
+    if (inStart == -1 || outStart == -1)
+        return -1;
+
+    size = inSb.st_size;
+    if (inStart >= size) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    outEnd = outStart + (size - inStart);
+
+    pageSize = sysconf(_SC_PAGESIZE);
+    window = opts->bufSize != 0 ? opts->bufSize : MMAP_WINDOW;
+    window = (window + pageSize - 1) / pageSize * pageSize;
+
+    posix_fadvise(inFd, inStart, size - inStart, POSIX_FADV_SEQUENTIAL);
+
+    /* Extend (but never shrink) the output to where the copy ends */
+
+    if (opts->mmapOut && outSb.st_size < outEnd &&
+            ftruncate(outFd, outEnd) == -1)
+        return -1;
+
+    stats->bufSize = window;
+
+    /* Only the first window can start inside a page; it is cut short so
+       that the others all start on a page boundary */
+
+    for (off = inStart; off < size; off += len) {
+        inSkip = off % pageSize;
+        len = (size - off < (off_t) (window - inSkip)) ? (size_t) (size - off)
+                                                      : window - inSkip;
+
+        src = mmap(NULL, inSkip + len, PROT_READ, MAP_SHARED, inFd,
+                   off - inSkip);
+        if (src == MAP_FAILED)
+            return -1;
+        madvise(src, inSkip + len, MADV_SEQUENTIAL);
+        if (off + (off_t) len < size)
+            posix_fadvise(inFd, off + len, window, POSIX_FADV_WILLNEED);
+
+        if (opts->checksum)
+            stats->crc = crc32c(stats->crc, src + inSkip, len);
+
+        if (opts->mmapOut) {
+            outOff = outStart + (off - inStart);
+            outSkip = outOff % pageSize;
+            dst = mmap(NULL, outSkip + len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, outFd, outOff - outSkip);
+            if (dst == MAP_FAILED) {
+                s = -1;
+            } else {
+                memcpy(dst + outSkip, src + inSkip, len);
+                s = munmap(dst, outSkip + len);
+            }
+        } else {
+            s = writeAll(outFd, src + inSkip, len);
+        }
+
+        savedErrno = errno;
+        munmap(src, inSkip + len);
+        if (s == -1) {
+            errno = savedErrno;
+            return -1;
+        }
+
+        stats->bytes += len;
+        stats->path = opts->mmapOut ? CP_MMAP_MEMCPY : CP_MMAP_WRITE;
+    }
+
+    /* Leave the offsets where a copy would have left them (write() has
+       already moved the output's, unless it was mapped) */
+
+    if (lseek(inFd, size, SEEK_SET) == -1)
+        return -1;
+    if (opts->mmapOut && lseek(outFd, outEnd, SEEK_SET) == -1)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,357 @@
+/* copy_nocache.c
+
+   Page-cache-friendly engine for copyFd() (see copy_engine.h).
+
+   An ordinary copy of a large file leaves both the input and the output in
+   the page cache, and on a busy host that pushes out the data the other
+   processes are actually using. This engine keeps the copy's own footprint
+   in the cache bounded:
+
+   CC_NOCACHE - the data goes through a read()/write() loop, and windows of
+   NOCACHE_WINDOW bytes are retired behind the cursor. For the output,
+   writeback of each window is started with sync_file_range() as soon as
+   the window is complete; one window later we wait for it and drop it with
+   posix_fadvise(POSIX_FADV_DONTNEED), so at most about two windows of dirty
+   or written pages are in the cache at any time. For the input, pages are
+   dropped as soon as they have been read -- but only those that weren't
+   already resident before we started reading ahead into them (checked
+   with mincore()), so that if someone else is using the input, we don't
+   evict it. We do the read-ahead ourselves, a window at a time, since the
+   kernel's can run further ahead than our residency checks.
+
+   CC_DIRECT - both files are switched to O_DIRECT, and the data moves
+   between the devices and a suitably aligned buffer without entering the
+   page cache at all. O_DIRECT needs aligned offsets and lengths, so if the
+   file offsets aren't aligned or the filesystem refuses O_DIRECT (e.g.,
+   tmpfs) we use CC_NOCACHE instead, and a final partial block is written
+   with O_DIRECT switched off, then dropped as above.
+
+   The file status flags of both descriptors are restored before returning.
+*/
+#define _GNU_SOURCE             /* O_DIRECT, sync_file_range() */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "copy_engine.h"
+#include "crc32c.h"
+
+#define NOCACHE_WINDOW (8 * 1024 * 1024)        /* Retired as a unit */
+#define NOCACHE_CHUNK (1024 * 1024)     /* Default read()/write() size */
+#define DIRECT_ALIGN 4096               /* Offsets, lengths, buffer */
+
+struct cacheWindow {            /* Tracks what remains to be dropped */
+    int fd;
+    int seekable;               /* Can we fadvise()/sync_file_range()? */
+    off_t start;                /* Start of the window being filled */
+    off_t prevStart;            /* Window whose writeback is in progress */
+    off_t off;                  /* File offset of the cursor */
+};
+
+static int
+writeAll(int fd, const char *buf, size_t len)
+{
+    ssize_t numWritten;
+    size_t done;
+
+    for (done = 0; done < len; done += numWritten) {
+        numWritten = write(fd, buf + done, len - done);
+        if (numWritten == -1) {
+            if (errno != EINTR)
+                return -1;
+            numWritten = 0;
+        }
+    }
+    return 0;
+}
+
+/* Fill 'vec' with the mincore() residency of [off, off + len) of 'fd'.
+   Returns 0 on success, or -1 on error. */
+
+static int
+residency(int fd, off_t off, size_t len, unsigned char *vec)
+{
+    void *addr;
+    int s;
+
+    addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, off);
+    if (addr == MAP_FAILED)
+        return -1;
+    s = mincore(addr, len, vec);
+    munmap(addr, len);
+    return s;
+}
+
+long
+copyResidentPages(int fd)
+{
+    struct stat sb;
+    unsigned char *vec;
+    size_t pageSize, len, j;
+    off_t off;
+    long pages;
+
+    if (fstat(fd, &sb) == -1)
+        return -1;
+    if (!S_ISREG(sb.st_mode)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pageSize = sysconf(_SC_PAGESIZE);
+    vec = malloc(NOCACHE_WINDOW / pageSize);
+    if (vec == NULL)
+        return -1;
+
+    pages = 0;
+    for (off = 0; off < sb.st_size; off += len) {
+        len = (sb.st_size - off < NOCACHE_WINDOW) ? (size_t) (sb.st_size - off)
+                                                  : NOCACHE_WINDOW;
+        if (residency(fd, off, len, vec) == -1) {
+            free(vec);
+            return -1;
+        }
+        for (j = 0; j < (len + pageSize - 1) / pageSize; j++)
+            pages += vec[j] & 1;
+    }
+
+    free(vec);
+    return pages;
+}
+
+/* Drop the pages of [off, off + len) of the input that were not resident
+   according to 'vec' (taken before we read them) */
+
+static void
+dropInput(int fd, off_t off, size_t len, const unsigned char *vec,
+          size_t pageSize)
+{
+    size_t j, n, run;
+
+    n = (len + pageSize - 1) / pageSize;
+    for (j = 0; j < n; j += run) {
+        for (run = 0; j + run < n && !(vec[j + run] & 1); run++)
+            continue;
+        if (run > 0)
+            posix_fadvise(fd, off + j * pageSize, run * pageSize,
+                          POSIX_FADV_DONTNEED);
+        else
+            run = 1;                    /* Someone else's page: keep it */
+    }
+}
+
+/* Drop the input windows the cursor has passed (with 'final', also the
+   partial one it's in). vec[0] holds the residency of the current window
+   and vec[1] that of the next, each taken one window ahead of the cursor
+   so that our own read-ahead isn't mistaken for someone else's pages. */
+
+static void
+retireInput(struct cacheWindow *w, unsigned char *vec[2], size_t pageSize,
+            int final)
+{
+    unsigned char *t;
+    size_t len;
+
+    while (w->seekable && (w->off - w->start >= NOCACHE_WINDOW ||
+                           (final && w->off > w->start))) {
+        len = (w->off - w->start < NOCACHE_WINDOW) ?
+                (size_t) (w->off - w->start) : NOCACHE_WINDOW;
+        dropInput(w->fd, w->start, len, vec[0], pageSize);
+        w->start += len;
+
+        t = vec[0];
+        vec[0] = vec[1];
+        vec[1] = t;
+        if (final)
+            continue;
+        if (residency(w->fd, w->start + NOCACHE_WINDOW, NOCACHE_WINDOW,
+                      vec[1]) == -1)
+            w->seekable = 0;
+        else
+            posix_fadvise(w->fd, w->start + NOCACHE_WINDOW, NOCACHE_WINDOW,
+                          POSIX_FADV_WILLNEED);
+    }
+}
+
+/* Start writeback of the output window just completed, then wait for and
+   drop the one before it. With 'final', also wait for and drop whatever
+   has been written since. */
+
+static void
+retireOutput(struct cacheWindow *w, int final)
+{
+    const unsigned waitFlags = SYNC_FILE_RANGE_WAIT_BEFORE |
+                               SYNC_FILE_RANGE_WRITE |
+                               SYNC_FILE_RANGE_WAIT_AFTER;
+
+    if (!w->seekable)
+        return;
+
+    if (w->start > w->prevStart) {
+        sync_file_range(w->fd, w->prevStart, w->start - w->prevStart,
+                        waitFlags);
+        posix_fadvise(w->fd, w->prevStart, w->start - w->prevStart,
+                      POSIX_FADV_DONTNEED);
+    }
+    w->prevStart = w->start;
+
+    if (w->off > w->start)
+        sync_file_range(w->fd, w->start, w->off - w->start,
+                        final ? waitFlags : SYNC_FILE_RANGE_WRITE);
+    if (final && w->off > w->start)
+        posix_fadvise(w->fd, w->start, w->off - w->start,
+                      POSIX_FADV_DONTNEED);
+    w->start = w->off;
+}
+
+/* Switch O_DIRECT on for both files, returning their original flags in
+   'inFl' and 'outFl'. Returns 0 on success, or -1 if either file refused
+   (in which case both are left as they were). */
+
+static int
+directOn(int inFd, int outFd, int *inFl, int *outFl)
+{
+    *inFl = fcntl(inFd, F_GETFL);
+    *outFl = fcntl(outFd, F_GETFL);
+    if (*inFl == -1 || *outFl == -1)
+        return -1;
+
+    if (fcntl(inFd, F_SETFL, *inFl | O_DIRECT) == -1)
+        return -1;
+    if (fcntl(outFd, F_SETFL, *outFl | O_DIRECT) == -1) {
+        fcntl(inFd, F_SETFL, *inFl);
+        return -1;
+    }
+    return 0;
+}
+
+int
+copyNocache(int inFd, int outFd, const struct copyOpts *opts,
+            struct copyStats *stats)
+{
+    struct cacheWindow in, out;
+    unsigned char *vec[2];
+    size_t pageSize, chunk;
+    ssize_t numRead, aligned;
+    int inFl, outFl, direct, s, savedErrno;
+    char *buf;
+
+    pageSize = sysconf(_SC_PAGESIZE);
+    chunk = opts->bufSize != 0 ? opts->bufSize : NOCACHE_CHUNK;
+    chunk = (chunk + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    if (chunk > NOCACHE_WINDOW)
+        chunk = NOCACHE_WINDOW;
+
+    in.fd = inFd;
+    in.off = lseek(inFd, 0, SEEK_CUR);
+    in.seekable = in.off != -1;
+    in.start = in.prevStart = in.off / pageSize * pageSize;
+    out.fd = outFd;
+    out.off = lseek(outFd, 0, SEEK_CUR);
+    out.seekable = out.off != -1;
+    out.start = out.prevStart = out.off;
+
+    direct = opts->cache == CC_DIRECT && in.seekable && out.seekable &&
+             in.off % DIRECT_ALIGN == 0 && out.off % DIRECT_ALIGN == 0 &&
+             directOn(inFd, outFd, &inFl, &outFl) == 0;
+
+    buf = NULL;
+    vec[0] = malloc(NOCACHE_WINDOW / pageSize);
+    vec[1] = malloc(NOCACHE_WINDOW / pageSize);
+    s = posix_memalign((void **) &buf, DIRECT_ALIGN, chunk);
+    if (s != 0 || vec[0] == NULL || vec[1] == NULL) {
+        errno = (s != 0) ? s : ENOMEM;
+        s = -1;
+        goto done;
+    }
+
+    /* Note which of the input's pages are already cached (and so are
+       someone else's to keep) before we, or read-ahead, get to them */
+
+    if (in.seekable && !direct &&
+            (residency(inFd, in.start, NOCACHE_WINDOW, vec[0]) == -1 ||
+             residency(inFd, in.start + NOCACHE_WINDOW, NOCACHE_WINDOW,
+                       vec[1]) == -1))
+        in.seekable = 0;
+    /* The kernel's own read-ahead (which may be larger than a window)
+       would run past the residency snapshots, so we turn it off and ask
+       for the next window ourselves, once we have its snapshot */
+
+    if (in.seekable && !direct) {
+        posix_fadvise(inFd, 0, 0, POSIX_FADV_RANDOM);
+        posix_fadvise(inFd, in.start, 2 * NOCACHE_WINDOW,
+                      POSIX_FADV_WILLNEED);
+    }
+    stats->bufSize = chunk;
+
+    for (;;) {
+        numRead = read(inFd, buf, chunk);
+        if (numRead == -1) {
+            if (errno == EINTR)
+                continue;
+            s = -1;
+            break;
+        }
+        if (numRead == 0)
+            break;
+
+        in.off += numRead;
+        if (opts->checksum)
+            stats->crc = crc32c(stats->crc, buf, numRead);
+        if (!direct)
+            retireInput(&in, vec, pageSize, 0);
+
+        if (stats->path != CP_DIRECT)
+            stats->path = direct ? CP_DIRECT : CP_NOCACHE;
+
+        /* O_DIRECT writes must be whole blocks, so a partial block at
+           the end is written through the page cache */
+
+        aligned = direct ? numRead / DIRECT_ALIGN * DIRECT_ALIGN : 0;
+        if (aligned > 0 && writeAll(outFd, buf, aligned) == -1) {
+            s = -1;
+            break;
+        }
+        if (numRead > aligned) {
+            if (direct) {
+                fcntl(inFd, F_SETFL, inFl);
+                fcntl(outFd, F_SETFL, outFl);
+                direct = 0;
+                in.seekable = 0;        /* Input was never cached */
+                out.start = out.prevStart = out.off + aligned;
+            }
+            if (writeAll(outFd, buf + aligned, numRead - aligned) == -1) {
+                s = -1;
+                break;
+            }
+        }
+        out.off += numRead;
+        stats->bytes += numRead;
+
+        if (!direct && out.off - out.start >= NOCACHE_WINDOW)
+            retireOutput(&out, 0);
+    }
+
+    savedErrno = errno;
+    if (!direct) {
+        retireInput(&in, vec, pageSize, 1);
+        retireOutput(&out, 1);
+        if (in.seekable)
+            posix_fadvise(inFd, 0, 0, POSIX_FADV_NORMAL);
+    }
+    errno = savedErrno;
+
+done:
+    savedErrno = errno;
+    free(vec[0]);
+    free(vec[1]);
+    free(buf);
+    if (direct) {
+        fcntl(inFd, F_SETFL, inFl);
+        fcntl(outFd, F_SETFL, outFl);
+    }
+    errno = savedErrno;
+    return s == 0 ? 0 : -1;
+}
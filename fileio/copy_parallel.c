@@ -0,0 +1,275 @@
+/* copy_parallel.c
+
+   Multi-threaded engine for copyFd() (see copy_engine.h).
+
+   A single thread issuing sequential I/O can't keep a fast NVMe device (or
+   a RAID set) busy. Here the output is first extended with ftruncate() to
+   the size it will have, and the rest of the input (from its current
+   offset) is then split into 'jobs' contiguous ranges, multiples of
+   RANGE_ALIGN long, each copied by its own thread with explicit file
+   offsets, so that the threads never share a file offset; the files' own
+   offsets are set past the copy at the end. With CE_AUTO each thread lets
+   copy_file_range() move its range; otherwise (or when that's refused) it
+   uses pread()/pwrite().
+
+   The first error seen by any thread is recorded; the other threads notice
+   it between chunks and give up, and it's what copyParallel() returns.
+*/
+#define _GNU_SOURCE             /* copy_file_range() */
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "copy_engine.h"
+
+#define RANGE_ALIGN (1024 * 1024)       /* Ranges start on this boundary */
+#define PARALLEL_CHUNK (1024 * 1024)    /* Default pread()/pwrite() size */
+#define XFER_CHUNK (1 << 30)            /* Most we ask copy_file_range() for */
+
+struct parallelCopy {           /* State shared by all the workers */
+    int inFd;
+    int outFd;
+    off_t outDelta;             /* Output offset minus input offset */
+    enum copyEngine engine;
+    size_t chunk;
+    pthread_mutex_t mtx;        /* Protects 'err' and 'eof' */
+    int err;                    /* First error seen by any worker */
+    off_t eof;                  /* Input ended here, if it shrank */
+};
+
+struct worker {
+    pthread_t tid;
+    struct parallelCopy *pc;
+    off_t start;                /* Input range [start, end) to copy */
+    off_t end;
+    off_t bytes;                /* Bytes this worker has moved */
+    enum copyPath path;
+};
+
+static int
+failed(struct parallelCopy *pc)
+{
+    return __atomic_load_n(&pc->err, __ATOMIC_RELAXED) != 0;
+}
+
+static void
+recordError(struct parallelCopy *pc, int err)
+{
+    pthread_mutex_lock(&pc->mtx);
+    if (pc->err == 0)
+        __atomic_store_n(&pc->err, err, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pc->mtx);
+}
+
+static void
+recordEof(struct parallelCopy *pc, off_t off)
+{
+    pthread_mutex_lock(&pc->mtx);
+    if (off < pc->eof)
+        pc->eof = off;
+    pthread_mutex_unlock(&pc->mtx);
+}
+
+static void *
+copyRange(void *arg)
+{
+    struct worker *w = arg;
+    struct parallelCopy *pc = w->pc;
+    off_t off, inOff, outOff;
+    ssize_t numRead, numWritten, done;
+    size_t len;
+    char *buf;
+    int s;
+
+    off = w->start;
+
+    if (pc->engine == CE_AUTO) {
+        while (off < w->end && !failed(pc)) {
+            len = (w->end - off < XFER_CHUNK) ? (size_t) (w->end - off)
+                                              : XFER_CHUNK;
+            inOff = off;
+            outOff = off + pc->outDelta;
+            numWritten = copy_file_range(pc->inFd, &inOff, pc->outFd, &outOff,
+                                         len, 0);
+            if (numWritten == -1) {
+                if (errno == EINTR)
+                    continue;
+                if (copyUnsupported(errno))
+                    break;
+                recordError(pc, errno);
+                return NULL;
+            }
+            if (numWritten == 0)        /* Let pread() decide if it's EOF */
+                break;
+
+            off += numWritten;
+            w->bytes += numWritten;
+            w->path = CP_COPY_FILE_RANGE;
+        }
+    }
+
+    if (off >= w->end || failed(pc))
+        return NULL;
+
+    s = posix_memalign((void **) &buf, sysconf(_SC_PAGESIZE), pc->chunk);
+    if (s != 0) {
+        recordError(pc, s);
+        return NULL;
+    }
+
+    while (off < w->end && !failed(pc)) {
+        len = (w->end - off < (off_t) pc->chunk) ? (size_t) (w->end - off)
+                                                 : pc->chunk;
+        numRead = pread(pc->inFd, buf, len, off);
+        if (numRead == -1) {
+            if (errno == EINTR)
+                continue;
+            recordError(pc, errno);
+            break;
+        }
+        if (numRead == 0) {             /* Input was truncated under us */
+            recordEof(pc, off);
+            break;
+        }
+
+        for (done = 0; done < numRead; done += numWritten) {
+            numWritten = pwrite(pc->outFd, buf + done, numRead - done,
+                                off + pc->outDelta + done);
+            if (numWritten == -1) {
+                if (errno != EINTR) {
+                    recordError(pc, errno);
+                    free(buf);
+                    return NULL;
+                }
+                numWritten = 0;
+            }
+        }
+
+        off += numRead;
+        w->bytes += numRead;
+        w->path = CP_PREAD_PWRITE;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+int
+copyParallel(int inFd, int outFd, const struct copyOpts *opts,
+             struct copyStats *stats)
+{
+    struct stat inSb, outSb;
+    struct parallelCopy pc;
+    struct worker *workers;
+    off_t inStart, outStart, size, outEnd, rangeLen;
+    unsigned jobs, started, j;
+    int s;
+
+    if (fstat(inFd, &inSb) == -1 || fstat(outFd, &outSb) == -1)
+        return -1;
+
+    /* The workers address both files by offset, and the output is sized
+       up front, so both must be regular files */
+
+    if (!S_ISREG(inSb.st_mode) || !S_ISREG(outSb.st_mode)) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    inStart = lseek(inFd, 0, SEEK_CUR);
+    outStart = lseek(outFd, 0, SEEK_CUR);
+    if (inStart == -1 || outStart == -1)
+        return -1;
+
+    /* The ranges are cut from st_size, which a pseudo-file (e.g., under
+       /proc) reports as 0 even though it has data; if there seems to be
+       nothing to split, let a serial engine read until EOF */
+
+    size = inSb.st_size;
+    if (inStart >= size) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    outEnd = outStart + (size - inStart);
+
+    /* Give every worker at least one range of RANGE_ALIGN bytes */
+
+    jobs = opts->jobs;
+    if ((off_t) jobs > (size - inStart + RANGE_ALIGN - 1) / RANGE_ALIGN)
+        jobs = (size - inStart + RANGE_ALIGN - 1) / RANGE_ALIGN;
+    rangeLen = ((size - inStart) / jobs + RANGE_ALIGN - 1) / RANGE_ALIGN *
+               RANGE_ALIGN;
+
+    /* Extend (but never shrink) the output to where the copy ends */
+
+    if (outSb.st_size < outEnd && ftruncate(outFd, outEnd) == -1)
+        return -1;
+
+    workers = calloc(jobs, sizeof(struct worker));
+    if (workers == NULL)
+        return -1;
+
+    pc.inFd = inFd;
+    pc.outFd = outFd;
+    pc.outDelta = outStart - inStart;
+    pc.engine = opts->engine;
+    pc.chunk = opts->bufSize != 0 ? opts->bufSize : PARALLEL_CHUNK;
+    pc.err = 0;
+    pc.eof = size;
+    pthread_mutex_init(&pc.mtx, NULL);
+
+    for (started = 0; started < jobs; started++) {
+        struct worker *w = &workers[started];
+
+        w->pc = &pc;
+        w->start = inStart + started * rangeLen;
+        w->end = (w->start + rangeLen < size) ? w->start + rangeLen : size;
+        if (w->start >= size)
+            break;
+        s = pthread_create(&w->tid, NULL, copyRange, w);
+        if (s != 0) {
+            recordError(&pc, s);
+            break;
+        }
+    }
+
+    for (j = 0; j < started; j++) {
+        s = pthread_join(workers[j].tid, NULL);
+        if (s != 0)
+            recordError(&pc, s);
+
+        stats->bytes += workers[j].bytes;
+        if (workers[j].path == CP_PREAD_PWRITE || stats->path == CP_NONE)
+            stats->path = workers[j].path;
+    }
+
+    stats->jobs = started;
+    if (pc.engine != CE_AUTO || stats->path == CP_PREAD_PWRITE)
+        stats->bufSize = pc.chunk;
+
+    free(workers);
+    pthread_mutex_destroy(&pc.mtx);
+
+    if (pc.err != 0) {
+        errno = pc.err;
+        return -1;
+    }
+
+    /* If the input shrank, cut back what we extended the output by */
+
+    if (pc.eof < size) {
+        outEnd = pc.eof + pc.outDelta;
+        if (outEnd < outSb.st_size)
+            outEnd = outSb.st_size;
+        if (ftruncate(outFd, outEnd) == -1)
+            return -1;
+    }
+
+    /* Leave the offsets where a serial copy would have left them */
+
+    if (lseek(inFd, pc.eof, SEEK_SET) == -1 ||
+            lseek(outFd, pc.eof + pc.outDelta, SEEK_SET) == -1)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,256 @@
+/* copy_sparse.c
+
+   Hole-preserving engine for copyFd() (see copy_engine.h).
+
+   The other engines read the holes of a sparse input as runs of zeros and
+   write them out again, so the copy is fully allocated and costs I/O in
+   proportion to the apparent size of the input. Here we instead walk the
+   input's data extents (from its current offset) with lseek(SEEK_DATA)
+   and lseek(SEEK_HOLE), copy only those (to the same distance past the
+   output's current offset), and finally ftruncate() the output to where
+   the copy ends. Whatever we skipped is left as a hole. That only works
+   if nothing in the output lies past its offset to begin with (as after
+   O_TRUNC); otherwise we decline, and copyFd() uses another engine.
+
+   With CS_ALWAYS, we also look inside the data extents for blocks (of the
+   output's st_blksize) that are entirely zero, and skip writing those too,
+   which turns them into holes in the (freshly truncated) output.
+*/
+#define _GNU_SOURCE             /* copy_file_range(), SEEK_DATA, SEEK_HOLE */
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "copy_engine.h"
+
+#define SPARSE_CHUNK (1024 * 1024)      /* Default pread()/pwrite() size */
+#define XFER_CHUNK (1 << 30)            /* Most we ask copy_file_range() for */
+
+struct extentCopy {
+    int inFd;
+    int outFd;
+    off_t outDelta;             /* Output offset minus input offset */
+    int tryKernel;              /* Still worth trying copy_file_range()? */
+    int zeroDetect;             /* Skip all-zero blocks inside extents? */
+    char *buf;
+    size_t chunk;
+    size_t blk;                 /* Granularity of zero detection */
+};
+
+static int
+isZero(const char *p, size_t len)
+{
+    return len == 0 || (p[0] == 0 && memcmp(p, p + 1, len - 1) == 0);
+}
+
+static int
+pwriteAll(int fd, const char *buf, size_t len, off_t off)
+{
+    ssize_t numWritten;
+    size_t done;
+
+    for (done = 0; done < len; done += numWritten) {
+        numWritten = pwrite(fd, buf + done, len - done, off + done);
+        if (numWritten == -1) {
+            if (errno != EINTR)
+                return -1;
+            numWritten = 0;
+        }
+    }
+    return 0;
+}
+
+/* Write the first 'len' bytes of the buffer to offset 'off' of the output;
+   with zero detection, blocks of zeros are skipped rather than written.
+   Returns the number of bytes actually written, or -1 on error. */
+
+static off_t
+writeBlocks(struct extentCopy *ec, size_t len, off_t off,
+            struct copyStats *stats)
+{
+    size_t pos, n, runStart;
+    off_t written;
+
+    if (!ec->zeroDetect)
+        return pwriteAll(ec->outFd, ec->buf, len, off + ec->outDelta) == -1 ?
+               -1 : (off_t) len;
+
+    written = 0;
+    runStart = 0;                       /* Start of unwritten nonzero run */
+    for (pos = 0; pos < len; pos += n) {
+        n = (len - pos < ec->blk) ? len - pos : ec->blk;
+        if (!isZero(ec->buf + pos, n))
+            continue;
+
+        if (pos > runStart) {
+            if (pwriteAll(ec->outFd, ec->buf + runStart, pos - runStart,
+                          off + ec->outDelta + runStart) == -1)
+                return -1;
+            written += pos - runStart;
+        }
+        stats->holeBytes += n;
+        runStart = pos + n;
+    }
+
+    if (len > runStart) {
+        if (pwriteAll(ec->outFd, ec->buf + runStart, len - runStart,
+                      off + ec->outDelta + runStart) == -1)
+            return -1;
+        written += len - runStart;
+    }
+
+    return written;
+}
+
+/* Copy the data extent [off, end) of the input to the corresponding place
+   in the output. Returns 0 on success (including the input having shrunk),
+   or -1 on error. */
+
+static int
+copyExtent(struct extentCopy *ec, off_t off, off_t end,
+           struct copyStats *stats)
+{
+    off_t inOff, outOff, written;
+    ssize_t numXfer;
+    size_t len;
+
+    while (ec->tryKernel && off < end) {
+        len = (end - off < XFER_CHUNK) ? (size_t) (end - off) : XFER_CHUNK;
+        inOff = off;
+        outOff = off + ec->outDelta;
+        numXfer = copy_file_range(ec->inFd, &inOff, ec->outFd, &outOff,
+                                  len, 0);
+        if (numXfer == -1) {
+            if (errno == EINTR)
+                continue;
+            if (!copyUnsupported(errno))
+                return -1;
+            ec->tryKernel = 0;
+        } else if (numXfer == 0) {
+            break;                      /* Let pread() decide if it's EOF */
+        } else {
+            off += numXfer;
+            stats->bytes += numXfer;
+            stats->path = CP_COPY_FILE_RANGE;
+        }
+    }
+
+    while (off < end) {
+        len = (end - off < (off_t) ec->chunk) ? (size_t) (end - off)
+                                              : ec->chunk;
+        numXfer = pread(ec->inFd, ec->buf, len, off);
+        if (numXfer == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (numXfer == 0)               /* Input was truncated under us */
+            break;
+
+        written = writeBlocks(ec, numXfer, off, stats);
+        if (written == -1)
+            return -1;
+
+        off += numXfer;
+        stats->bytes += written;
+        stats->path = CP_PREAD_PWRITE;
+        stats->bufSize = ec->chunk;
+    }
+
+    return 0;
+}
+
+int
+copySparse(int inFd, int outFd, const struct copyOpts *opts,
+           struct copyStats *stats)
+{
+    struct stat inSb, outSb;
+    struct extentCopy ec;
+    off_t inStart, outStart, size, off, data, hole;
+    int s;
+
+    if (fstat(inFd, &inSb) == -1 || fstat(outFd, &outSb) == -1)
+        return -1;
+
+    if (!S_ISREG(inSb.st_mode) || !S_ISREG(outSb.st_mode)) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    inStart = lseek(inFd, 0, SEEK_CUR);
+    outStart = lseek(outFd, 0, SEEK_CUR);
+    if (inStart == -1 || outStart == -1)
+        return -1;
+    if (outSb.st_size > outStart) {     /* A skipped hole wouldn't be zeros */
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    /* An input with nothing past its offset by st_size isn't "all hole":
+       a pseudo-file (e.g., under /proc) reports st_size 0 but has data,
+       which only a plain copy, reading until EOF, will find */
+
+    size = inSb.st_size;
+    if (inStart >= size) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    ec.inFd = inFd;
+    ec.outFd = outFd;
+    ec.outDelta = outStart - inStart;
+    ec.zeroDetect = opts->sparse == CS_ALWAYS;
+    ec.tryKernel = opts->engine == CE_AUTO && !ec.zeroDetect;
+    ec.chunk = opts->bufSize != 0 ? opts->bufSize : SPARSE_CHUNK;
+    ec.blk = outSb.st_blksize > 0 ? outSb.st_blksize : 4096;
+    s = posix_memalign((void **) &ec.buf, sysconf(_SC_PAGESIZE), ec.chunk);
+    if (s != 0) {
+        errno = s;
+        return -1;
+    }
+
+    stats->sparse = 1;
+
+    for (off = inStart; off < size; off = hole) {
+        data = lseek(inFd, off, SEEK_DATA);
+        if (data == -1) {
+            if (errno == ENXIO) {       /* Only a hole from here on */
+                data = size;
+            } else if (errno == EINVAL) {
+                data = off;             /* No SEEK_DATA here; all data */
+            } else {
+                goto fail;
+            }
+        }
+        if (data >= size) {
+            stats->holeBytes += size - off;
+            break;
+        }
+
+        hole = lseek(inFd, data, SEEK_HOLE);
+        if (hole == -1 || hole > size)
+            hole = size;
+
+        stats->holeBytes += data - off;
+        if (copyExtent(&ec, data, hole, stats) == -1)
+            goto fail;
+    }
+
+    free(ec.buf);
+
+    /* Create any hole at the end of the file, and leave both file offsets
+       past the copy, as the other engines do */
+
+    if (ftruncate(outFd, size + ec.outDelta) == -1 ||
+            lseek(inFd, size, SEEK_SET) == -1 ||
+            lseek(outFd, size + ec.outDelta, SEEK_SET) == -1)
+        return -1;
+    return 0;
+
+fail:
+    s = errno;
+    free(ec.buf);
+    errno = s;
+    return -1;
+}
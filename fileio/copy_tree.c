@@ -0,0 +1,687 @@
+/* copy_tree.c
+
+   Directory mode for copy.c: copy a tree of files (see copy_engine.h).
+
+   When a tree holds many small files, the cost of copying it is dominated
+   by process creation (one copy per file) and by metadata operations done
+   one after another. Here one thread walks the source tree while a pool of
+   worker threads copies the regular files it finds, each with copyFd().
+
+   Everything is done relative to open directory file descriptors
+   (openat(), mkdirat(), readlinkat(), symlinkat(), ...), so no path names
+   are built and the kernel never has to resolve more than one component.
+   Directories are read with getdents64() and a large buffer, and we rely on
+   d_type to avoid a stat() of every entry.
+
+   Each directory is represented while it's being copied by a dirNode that
+   holds its source and destination descriptors and a reference count: one
+   reference for the walker while it reads the directory, one for each file
+   queued from it, and one for each subdirectory waiting to be walked or
+   still in progress. When the count drops to zero, the directory's mode
+   and timestamps are applied (this must come after its contents have been
+   created) and its descriptors are closed.
+
+   The walk is iterative: a directory is read to the end (with a single
+   getdents64() buffer), and its subdirectories are pushed on a stack, to
+   be opened and read in turn. Every subdirectory on the stack is in the
+   one being read or in one above it, so the walk itself only holds open
+   the directories on the path down from the root. The rest are held open
+   by files queued for, or being copied by, the workers, and their number
+   is bounded too: before opening another directory, the walker waits
+   while 'maxDirs' dirNodes exist and the workers still have files to
+   finish. 'maxDirs' allows two descriptors per directory within
+   RLIMIT_NOFILE, after setting aside those the workers need to copy a
+   file.
+
+   A destination inside the source tree (which would otherwise be copied
+   into itself, again and again) is refused: before anything is created,
+   the destination (or, if it doesn't exist yet, its parent) and each
+   directory above it are compared with the source by st_dev and st_ino.
+
+   Regular files, directories, symbolic links and FIFOs are copied with
+   their permissions and timestamps; other file types are skipped (and
+   counted). Hard links are copied as separate files. The first error stops
+   the copy.
+*/
+#define _GNU_SOURCE             /* getdents64() */
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "copy_engine.h"
+
+#define DIRENT_BUF (64 * 1024)  /* getdents64() buffer */
+#define QUEUE_LEN 1024          /* Most files waiting for a worker */
+#define MAX_OPEN_DIRS 1024      /* Most directories held open at once */
+#define WORKER_FDS 8            /* Descriptors set aside for each worker */
+
+struct dirNode {
+    struct dirNode *parent;
+    int srcFd;
+    int dstFd;
+    mode_t mode;
+    struct timespec times[2];   /* Access and modification times */
+    int refs;
+};
+
+struct fileJob {
+    struct dirNode *dir;
+    char *name;
+};
+
+struct subdirStack {            /* Subdirectories waiting to be walked */
+    struct fileJob *jobs;       /* Each holds a reference to its parent */
+    size_t len, cap;
+};
+
+struct treeCopy {               /* State shared by walker and workers */
+    const struct copyOpts *opts;    /* For each file */
+    struct treeStats *stats;
+
+    pthread_mutex_t mtx;        /* Protects everything below */
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    pthread_cond_t dirClosed;   /* 'liveDirs' or 'busy' went down */
+    struct fileJob queue[QUEUE_LEN];
+    unsigned head, count;
+    unsigned busy;              /* Jobs being run by workers */
+    unsigned liveDirs;          /* dirNodes in existence */
+    unsigned maxDirs;           /* Soft limit on 'liveDirs' */
+    int done;                   /* Walker has queued its last job */
+    int err;                    /* First error, or 0; read without 'mtx' */
+};
+
+/* Record the first error (errno 'err' while doing 'op' on 'name') */
+
+static void
+recordError(struct treeCopy *tc, int err, const char *op, const char *name)
+{
+    pthread_mutex_lock(&tc->mtx);
+    if (tc->err == 0) {
+        tc->stats->errOp = op;
+        snprintf(tc->stats->errName, sizeof(tc->stats->errName), "%s", name);
+        __atomic_store_n(&tc->err, err, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&tc->mtx);
+}
+
+/* Checked often by the walker and the workers, so don't take the mutex */
+
+static int
+failed(struct treeCopy *tc)
+{
+    return __atomic_load_n(&tc->err, __ATOMIC_ACQUIRE) != 0;
+}
+
+/* Drop a reference to 'dir'; on the last one, give the copy its mode and
+   timestamps, close its descriptors and release its parent */
+
+static void
+releaseDir(struct treeCopy *tc, struct dirNode *dir)
+{
+    struct dirNode *parent;
+
+    while (dir != NULL && __atomic_sub_fetch(&dir->refs, 1,
+                                             __ATOMIC_ACQ_REL) == 0) {
+        if (!failed(tc)) {
+            if (fchmod(dir->dstFd, dir->mode & 07777) == -1)
+                recordError(tc, errno, "fchmod", ".");
+            else if (futimens(dir->dstFd, dir->times) == -1)
+                recordError(tc, errno, "futimens", ".");
+        }
+
+        close(dir->srcFd);
+        close(dir->dstFd);
+        parent = dir->parent;
+        free(dir);
+        dir = parent;
+
+        pthread_mutex_lock(&tc->mtx);
+        tc->liveDirs--;
+        pthread_cond_signal(&tc->dirClosed);
+        pthread_mutex_unlock(&tc->mtx);
+    }
+}
+
+/* Copy the regular file 'name' of 'dir' */
+
+static void
+copyFile(struct treeCopy *tc, struct dirNode *dir, const char *name)
+{
+    struct copyStats cs;
+    struct timespec times[2];
+    struct stat sb;
+    int inFd, outFd;
+
+    inFd = openat(dir->srcFd, name, O_RDONLY | O_NOFOLLOW);
+    if (inFd == -1) {
+        recordError(tc, errno, "open", name);
+        return;
+    }
+    if (fstat(inFd, &sb) == -1) {
+        recordError(tc, errno, "fstat", name);
+        close(inFd);
+        return;
+    }
+
+    /* A shared writable mapping of the output needs read access too */
+
+    outFd = openat(dir->dstFd, name, (tc->opts->mmapOut ? O_RDWR : O_WRONLY) |
+                   O_CREAT | O_TRUNC | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+    if (outFd == -1) {
+        recordError(tc, errno, "create", name);
+        close(inFd);
+        return;
+    }
+
+    times[0] = sb.st_atim;
+    times[1] = sb.st_mtim;
+    if (copyFd(inFd, outFd, tc->opts, &cs) == -1)
+        recordError(tc, errno, "copy", name);
+    else if (fchmod(outFd, sb.st_mode & 07777) == -1)
+        recordError(tc, errno, "fchmod", name);
+    else if (futimens(outFd, times) == -1)
+        recordError(tc, errno, "futimens", name);
+    else {
+        __atomic_add_fetch(&tc->stats->files, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&tc->stats->bytes, cs.bytes, __ATOMIC_RELAXED);
+    }
+
+    close(inFd);
+    if (close(outFd) == -1)
+        recordError(tc, errno, "close", name);
+}
+
+static void *
+worker(void *arg)
+{
+    struct treeCopy *tc = arg;
+    struct fileJob job;
+
+    for (;;) {
+        pthread_mutex_lock(&tc->mtx);
+        while (tc->count == 0 && !tc->done)
+            pthread_cond_wait(&tc->notEmpty, &tc->mtx);
+        if (tc->count == 0) {           /* Done, and nothing left */
+            pthread_mutex_unlock(&tc->mtx);
+            return NULL;
+        }
+        job = tc->queue[tc->head];
+        tc->head = (tc->head + 1) % QUEUE_LEN;
+        tc->count--;
+        tc->busy++;
+        pthread_cond_signal(&tc->notFull);
+        pthread_mutex_unlock(&tc->mtx);
+
+        if (!failed(tc))
+            copyFile(tc, job.dir, job.name);
+        free(job.name);
+        releaseDir(tc, job.dir);
+
+        pthread_mutex_lock(&tc->mtx);
+        tc->busy--;
+        pthread_cond_signal(&tc->dirClosed);
+        pthread_mutex_unlock(&tc->mtx);
+    }
+}
+
+static void
+enqueue(struct treeCopy *tc, struct dirNode *dir, const char *name)
+{
+    char *copy;
+
+    copy = strdup(name);
+    if (copy == NULL) {
+        recordError(tc, errno, "strdup", name);
+        return;
+    }
+
+    __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&tc->mtx);
+    while (tc->count == QUEUE_LEN)
+        pthread_cond_wait(&tc->notFull, &tc->mtx);
+    tc->queue[(tc->head + tc->count) % QUEUE_LEN].dir = dir;
+    tc->queue[(tc->head + tc->count) % QUEUE_LEN].name = copy;
+    tc->count++;
+    pthread_cond_signal(&tc->notEmpty);
+    pthread_mutex_unlock(&tc->mtx);
+}
+
+/* Make a dirNode for the (already open) source directory 'srcFd' and the
+   (already created and open) destination 'dstFd'. On failure, both are
+   closed. */
+
+static struct dirNode *
+newDir(struct treeCopy *tc, struct dirNode *parent, int srcFd, int dstFd,
+       const char *name)
+{
+    struct dirNode *dir;
+    struct stat sb;
+
+    dir = malloc(sizeof(struct dirNode));
+    if (dir == NULL || fstat(srcFd, &sb) == -1) {
+        recordError(tc, errno, "opendir", name);
+        free(dir);
+        close(srcFd);
+        close(dstFd);
+        return NULL;
+    }
+
+    dir->parent = parent;
+    dir->srcFd = srcFd;
+    dir->dstFd = dstFd;
+    dir->mode = sb.st_mode;
+    dir->times[0] = sb.st_atim;
+    dir->times[1] = sb.st_mtim;
+    dir->refs = 1;                      /* The walker's reference */
+    if (parent != NULL)
+        __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&tc->mtx);
+    tc->liveDirs++;
+    pthread_mutex_unlock(&tc->mtx);
+    return dir;
+}
+
+static void
+copySymlink(struct treeCopy *tc, struct dirNode *dir, const char *name)
+{
+    char target[PATH_MAX];
+    struct timespec times[2];
+    struct stat sb;
+    ssize_t len;
+
+    if (fstatat(dir->srcFd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+        recordError(tc, errno, "lstat", name);
+        return;
+    }
+    len = readlinkat(dir->srcFd, name, target, sizeof(target) - 1);
+    if (len == -1) {
+        recordError(tc, errno, "readlink", name);
+        return;
+    }
+    target[len] = '\0';
+
+    if (symlinkat(target, dir->dstFd, name) == -1) {
+        if (errno != EEXIST || unlinkat(dir->dstFd, name, 0) == -1 ||
+                symlinkat(target, dir->dstFd, name) == -1) {
+            recordError(tc, errno, "symlink", name);
+            return;
+        }
+    }
+
+    times[0] = sb.st_atim;
+    times[1] = sb.st_mtim;
+    if (utimensat(dir->dstFd, name, times, AT_SYMLINK_NOFOLLOW) == -1)
+        recordError(tc, errno, "utimensat", name);
+    __atomic_add_fetch(&tc->stats->symlinks, 1, __ATOMIC_RELAXED);
+}
+
+static void
+copyFifo(struct treeCopy *tc, struct dirNode *dir, const char *name)
+{
+    struct timespec times[2];
+    struct stat sb;
+
+    if (fstatat(dir->srcFd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+        recordError(tc, errno, "lstat", name);
+        return;
+    }
+    if (mkfifoat(dir->dstFd, name, sb.st_mode & 07777) == -1 &&
+            errno != EEXIST) {
+        recordError(tc, errno, "mkfifo", name);
+        return;
+    }
+
+    times[0] = sb.st_atim;
+    times[1] = sb.st_mtim;
+    if (fchmodat(dir->dstFd, name, sb.st_mode & 07777, 0) == -1 ||
+            utimensat(dir->dstFd, name, times, 0) == -1)
+        recordError(tc, errno, "fifo attributes", name);
+}
+
+/* Create the destination directory 'name' in 'dstParentFd' (it's fine if it
+   already exists) and return an open descriptor for it */
+
+static int
+makeDir(int dstParentFd, const char *name)
+{
+    if (mkdirat(dstParentFd, name, S_IRWXU) == -1 && errno != EEXIST)
+        return -1;
+    return openat(dstParentFd, name, O_RDONLY | O_DIRECTORY);
+}
+
+/* Push the subdirectory 'name' of 'parent' on 'stack', to be walked later */
+
+static void
+pushSubdir(struct treeCopy *tc, struct subdirStack *stack,
+           struct dirNode *parent, const char *name)
+{
+    struct fileJob *jobs;
+    char *copy;
+
+    if (stack->len == stack->cap) {
+        stack->cap = stack->cap == 0 ? 64 : stack->cap * 2;
+        jobs = realloc(stack->jobs, stack->cap * sizeof(struct fileJob));
+        if (jobs == NULL) {
+            recordError(tc, errno, "realloc", name);
+            return;
+        }
+        stack->jobs = jobs;
+    }
+    copy = strdup(name);
+    if (copy == NULL) {
+        recordError(tc, errno, "strdup", name);
+        return;
+    }
+
+    __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+    stack->jobs[stack->len].dir = parent;
+    stack->jobs[stack->len].name = copy;
+    stack->len++;
+}
+
+/* Wait until opening another directory keeps within tc->maxDirs, or until
+   the workers have nothing left that would release one */
+
+static void
+waitForDirSlot(struct treeCopy *tc)
+{
+    pthread_mutex_lock(&tc->mtx);
+    while (tc->liveDirs >= tc->maxDirs && (tc->count > 0 || tc->busy > 0))
+        pthread_cond_wait(&tc->dirClosed, &tc->mtx);
+    pthread_mutex_unlock(&tc->mtx);
+}
+
+/* Open the subdirectory 'name' of 'parent', and create and open its copy;
+   returns its dirNode, or NULL on error */
+
+static struct dirNode *
+openSubdir(struct treeCopy *tc, struct dirNode *parent, const char *name)
+{
+    struct dirNode *dir;
+    int srcFd, dstFd;
+
+    srcFd = openat(parent->srcFd, name,
+                   O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (srcFd == -1) {
+        recordError(tc, errno, "opendir", name);
+        return NULL;
+    }
+    dstFd = makeDir(parent->dstFd, name);
+    if (dstFd == -1) {
+        recordError(tc, errno, "mkdir", name);
+        close(srcFd);
+        return NULL;
+    }
+
+    dir = newDir(tc, parent, srcFd, dstFd, name);
+    if (dir != NULL)
+        __atomic_add_fetch(&tc->stats->dirs, 1, __ATOMIC_RELAXED);
+    return dir;
+}
+
+/* Read every entry of 'dir' into 'buf', queueing regular files for the
+   workers, pushing subdirectories on 'stack' and handling everything else
+   here; then drop the walker's reference */
+
+static void
+readDir(struct treeCopy *tc, struct dirNode *dir, char *buf,
+        struct subdirStack *stack)
+{
+    struct dirent64 *d;
+    struct stat sb;
+    ssize_t numRead, pos;
+    unsigned char type;
+
+    numRead = 0;
+    while (!failed(tc) &&
+            (numRead = getdents64(dir->srcFd, buf, DIRENT_BUF)) > 0) {
+        for (pos = 0; pos < numRead && !failed(tc); pos += d->d_reclen) {
+            d = (struct dirent64 *) (buf + pos);
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+                continue;
+
+            type = d->d_type;
+            if (type == DT_UNKNOWN) {   /* Filesystem doesn't supply it */
+                if (fstatat(dir->srcFd, d->d_name, &sb,
+                            AT_SYMLINK_NOFOLLOW) == -1) {
+                    recordError(tc, errno, "lstat", d->d_name);
+                    break;
+                }
+                type = IFTODT(sb.st_mode);
+            }
+
+            switch (type) {
+            case DT_REG:    enqueue(tc, dir, d->d_name);            break;
+            case DT_DIR:    pushSubdir(tc, stack, dir, d->d_name);  break;
+            case DT_LNK:    copySymlink(tc, dir, d->d_name);        break;
+            case DT_FIFO:   copyFifo(tc, dir, d->d_name);           break;
+            default:
+                __atomic_add_fetch(&tc->stats->skipped, 1, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+    }
+    if (numRead == -1)
+        recordError(tc, errno, "getdents64", ".");
+
+    releaseDir(tc, dir);
+}
+
+/* Walk the tree below 'root', depth first, without recursion */
+
+static void
+walkTree(struct treeCopy *tc, struct dirNode *root)
+{
+    struct subdirStack stack;
+    struct fileJob job;
+    struct dirNode *dir;
+    char *buf;
+
+    buf = malloc(DIRENT_BUF);
+    if (buf == NULL) {
+        recordError(tc, errno, "malloc", ".");
+        releaseDir(tc, root);
+        return;
+    }
+    memset(&stack, 0, sizeof(stack));
+
+    readDir(tc, root, buf, &stack);
+    while (stack.len > 0) {
+        job = stack.jobs[--stack.len];
+        if (!failed(tc)) {
+            waitForDirSlot(tc);
+            dir = openSubdir(tc, job.dir, job.name);
+            if (dir != NULL)
+                readDir(tc, dir, buf, &stack);
+        }
+        free(job.name);
+        releaseDir(tc, job.dir);        /* The new dirNode has its own */
+    }
+
+    free(stack.jobs);
+    free(buf);
+}
+
+/* How many directories may be open at once, given RLIMIT_NOFILE and
+   'workers' workers */
+
+static unsigned
+dirLimit(unsigned workers)
+{
+    struct rlimit rl;
+    rlim_t reserve, n;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur == RLIM_INFINITY)
+        return MAX_OPEN_DIRS;
+
+    reserve = 3 + WORKER_FDS * (rlim_t) workers + WORKER_FDS;
+    n = rl.rlim_cur > reserve ? (rl.rlim_cur - reserve) / 2 : 1;
+    if (n > MAX_OPEN_DIRS)
+        n = MAX_OPEN_DIRS;
+    return n > 0 ? n : 1;
+}
+
+/* Is 'dstPath' the directory open on 'srcFd', or somewhere below it? If it
+   doesn't exist yet, its parent is checked instead. Returns 1 if so, 0 if
+   not (or if that can't be told: creating it will then fail). */
+
+static int
+insideTree(int srcFd, const char *dstPath)
+{
+    struct stat srcSb, sb, upSb;
+    char *path;
+    int fd, up, inside;
+
+    if (fstat(srcFd, &srcSb) == -1)
+        return 0;
+
+    fd = open(dstPath, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        path = strdup(dstPath);
+        if (path == NULL)
+            return 0;
+        fd = open(dirname(path), O_RDONLY | O_DIRECTORY);
+        free(path);
+        if (fd == -1)
+            return 0;
+    }
+
+    /* Climb through '..' to the root, which is its own parent */
+
+    inside = 0;
+    if (fstat(fd, &sb) == -1) {
+        close(fd);
+        return 0;
+    }
+    for (;;) {
+        if (sb.st_dev == srcSb.st_dev && sb.st_ino == srcSb.st_ino) {
+            inside = 1;
+            break;
+        }
+        up = openat(fd, "..", O_RDONLY | O_DIRECTORY);
+        if (up == -1)
+            break;
+        if (fstat(up, &upSb) == -1 ||
+                (upSb.st_dev == sb.st_dev && upSb.st_ino == sb.st_ino)) {
+            close(up);
+            break;
+        }
+        close(fd);
+        fd = up;
+        sb = upSb;
+    }
+
+    close(fd);
+    return inside;
+}
+
+int
+copyTree(const char *srcPath, const char *dstPath,
+         const struct copyOpts *opts, unsigned workers,
+         struct treeStats *stats)
+{
+    struct treeCopy tc;
+    struct dirNode *root;
+    struct copyOpts fileOpts;
+    pthread_t *tids;
+    unsigned started, j;
+    int srcFd, dstFd, s;
+
+    memset(stats, 0, sizeof(*stats));
+    if (workers == 0)
+        workers = 1;
+
+    /* Each file is copied by a single worker; the parallelism is across
+       files */
+
+    fileOpts = *opts;
+    fileOpts.jobs = 0;
+
+    memset(&tc, 0, sizeof(tc));
+    tc.opts = &fileOpts;
+    tc.stats = stats;
+    pthread_mutex_init(&tc.mtx, NULL);
+    pthread_cond_init(&tc.notEmpty, NULL);
+    pthread_cond_init(&tc.notFull, NULL);
+    pthread_cond_init(&tc.dirClosed, NULL);
+    tc.maxDirs = dirLimit(workers);
+
+    srcFd = open(srcPath, O_RDONLY | O_DIRECTORY);
+    if (srcFd == -1) {
+        recordError(&tc, errno, "opendir", srcPath);
+        goto out;
+    }
+    if (insideTree(srcFd, dstPath)) {
+        recordError(&tc, EINVAL, "copy into itself", dstPath);
+        close(srcFd);
+        goto out;
+    }
+    dstFd = makeDir(AT_FDCWD, dstPath);
+    if (dstFd == -1) {
+        recordError(&tc, errno, "mkdir", dstPath);
+        close(srcFd);
+        goto out;
+    }
+    root = newDir(&tc, NULL, srcFd, dstFd, srcPath);
+    if (root == NULL)
+        goto out;
+    stats->dirs = 1;
+
+    tids = calloc(workers, sizeof(pthread_t));
+    if (tids == NULL) {
+        recordError(&tc, errno, "calloc", srcPath);
+        releaseDir(&tc, root);
+        goto out;
+    }
+
+    for (started = 0; started < workers; started++) {
+        s = pthread_create(&tids[started], NULL, worker, &tc);
+        if (s != 0) {
+            if (started == 0) {         /* Can't do anything without one */
+                recordError(&tc, s, "pthread_create", srcPath);
+                releaseDir(&tc, root);
+                free(tids);
+                goto out;
+            }
+            break;                      /* Make do with fewer */
+        }
+    }
+    stats->workers = started;
+
+    walkTree(&tc, root);
+
+    pthread_mutex_lock(&tc.mtx);
+    tc.done = 1;
+    pthread_cond_broadcast(&tc.notEmpty);
+    pthread_mutex_unlock(&tc.mtx);
+
+    for (j = 0; j < started; j++) {
+        s = pthread_join(tids[j], NULL);
+        if (s != 0)
+            recordError(&tc, s, "pthread_join", srcPath);
+    }
+    free(tids);
+
+out:
+    pthread_cond_destroy(&tc.dirClosed);
+    pthread_cond_destroy(&tc.notFull);
+    pthread_cond_destroy(&tc.notEmpty);
+    pthread_mutex_destroy(&tc.mtx);
+
+    if (tc.err != 0) {
+        errno = tc.err;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,394 @@
+/* copy_uring.c
+
+   io_uring engine for copyFd() (see copy_engine.h).
+
+   The read()/write() loop leaves the device idle while each half of the
+   loop waits for the other. Here up to 'queueDepth' buffers are kept busy
+   at once: each is either being filled by a read at some offset of the
+   input or drained by a write to the matching offset of the output, and as
+   soon as a write completes the buffer is handed the next unread chunk.
+   Reads of later chunks therefore proceed while earlier chunks are being
+   written. Every operation carries its own file offset, counted from the
+   offsets the files had on entry; the files' offsets are only moved, past
+   the copy, at the end.
+
+   The buffers are registered with the kernel (IORING_REGISTER_BUFFERS) so
+   that their pages needn't be pinned and unpinned for every operation; if
+   registration fails (e.g., because of RLIMIT_MEMLOCK) we carry on with
+   ordinary IORING_OP_READ/IORING_OP_WRITE.
+
+   glibc has no wrappers for the io_uring system calls, and we don't want to
+   depend on liburing, so the rings are set up by hand as described in
+   io_uring_setup(2).
+*/
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "copy_engine.h"
+
+#define URING_CHUNK (1024 * 1024)       /* Default size of each buffer */
+
+struct ring {
+    int fd;
+    unsigned *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqPtr, *cqPtr;
+    size_t sqLen, cqLen, sqesLen;
+    unsigned toSubmit;          /* SQEs queued but not yet submitted */
+    unsigned inFlight;          /* Submitted or queued, not yet completed */
+};
+
+enum slotState { SLOT_IDLE, SLOT_READING, SLOT_WRITING };
+
+struct slot {
+    enum slotState state;
+    char *buf;
+    off_t off;                  /* Offset of this chunk in the input... */
+    off_t outOff;               /* ...and in the output */
+    size_t len;                 /* Length of this chunk */
+    size_t done;                /* Bytes of the current operation completed */
+};
+
+static int
+ringSetup(struct ring *r, unsigned entries)
+{
+    struct io_uring_params p;
+    int savedErrno;
+
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->sqPtr = r->cqPtr = r->sqes = MAP_FAILED;
+
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd == -1)
+        return -1;
+
+    r->sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqLen > r->sqLen)
+            r->sqLen = r->cqLen;
+        r->cqLen = 0;
+    }
+
+    r->sqPtr = mmap(NULL, r->sqLen, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sqPtr == MAP_FAILED)
+        goto fail;
+
+    if (r->cqLen == 0) {
+        r->cqPtr = r->sqPtr;
+    } else {
+        r->cqPtr = mmap(NULL, r->cqLen, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cqPtr == MAP_FAILED)
+            goto fail;
+    }
+
+    r->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqesLen, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail;
+
+    r->sqTail = (unsigned *) ((char *) r->sqPtr + p.sq_off.tail);
+    r->sqMask = (unsigned *) ((char *) r->sqPtr + p.sq_off.ring_mask);
+    r->sqArray = (unsigned *) ((char *) r->sqPtr + p.sq_off.array);
+    r->cqHead = (unsigned *) ((char *) r->cqPtr + p.cq_off.head);
+    r->cqTail = (unsigned *) ((char *) r->cqPtr + p.cq_off.tail);
+    r->cqMask = (unsigned *) ((char *) r->cqPtr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cqPtr + p.cq_off.cqes);
+    return 0;
+
+fail:
+    savedErrno = errno;
+    if (r->sqPtr != MAP_FAILED)
+        munmap(r->sqPtr, r->sqLen);
+    if (r->cqPtr != MAP_FAILED && r->cqLen != 0)
+        munmap(r->cqPtr, r->cqLen);
+    close(r->fd);
+    errno = savedErrno;
+    return -1;
+}
+
+static void
+ringTeardown(struct ring *r)
+{
+    munmap(r->sqes, r->sqesLen);
+    if (r->cqLen != 0)
+        munmap(r->cqPtr, r->cqLen);
+    munmap(r->sqPtr, r->sqLen);
+    close(r->fd);
+}
+
+/* Queue the remainder of the current operation on slot 'idx': a read from
+   'inFd' if the slot is filling, otherwise a write to 'outFd' */
+
+static void
+ringQueue(struct ring *r, struct slot *slots, unsigned idx, int inFd,
+          int outFd, int fixed)
+{
+    struct slot *s = &slots[idx];
+    struct io_uring_sqe *sqe;
+    unsigned tail, i;
+
+    tail = *r->sqTail;                  /* Only we update the SQ tail */
+    i = tail & *r->sqMask;
+    sqe = &r->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+
+    if (s->state == SLOT_READING) {
+        sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = inFd;
+    } else {
+        sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = outFd;
+    }
+    sqe->addr = (unsigned long) (s->buf + s->done);
+    sqe->len = s->len - s->done;
+    sqe->off = (s->state == SLOT_READING ? s->off : s->outOff) + s->done;
+    if (fixed)
+        sqe->buf_index = idx;
+    sqe->user_data = idx;
+
+    r->sqArray[i] = i;
+    __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+    r->toSubmit++;
+    r->inFlight++;
+}
+
+/* Submit whatever has been queued and wait for at least one completion */
+
+static int
+ringEnter(struct ring *r)
+{
+    int n;
+
+    do {
+        n = syscall(__NR_io_uring_enter, r->fd, r->toSubmit, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1)
+        return -1;
+
+    r->toSubmit -= n;
+    return 0;
+}
+
+/* Fetch the next completion into '*idx' and '*res'; return 0 if there
+   is none waiting */
+
+static int
+ringReap(struct ring *r, unsigned *idx, int *res)
+{
+    unsigned head = *r->cqHead;         /* Only we update the CQ head */
+    struct io_uring_cqe *cqe;
+
+    if (head == __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    cqe = &r->cqes[head & *r->cqMask];
+    *idx = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(r->cqHead, head + 1, __ATOMIC_RELEASE);
+    r->inFlight--;
+    return 1;
+}
+
+/* Point slot 's' at the next unread chunk of the input, which goes
+   'outDelta' bytes further on in the output */
+
+static void
+startRead(struct slot *s, off_t *nextOff, off_t size, size_t chunk,
+          off_t outDelta)
+{
+    s->state = SLOT_READING;
+    s->off = *nextOff;
+    s->outOff = *nextOff + outDelta;
+    s->len = (size - *nextOff < (off_t) chunk) ? (size_t) (size - *nextOff)
+                                               : chunk;
+    s->done = 0;
+    *nextOff += s->len;
+}
+
+int
+copyUring(int inFd, int outFd, const struct copyOpts *opts,
+          struct copyStats *stats)
+{
+    struct stat inSb, outSb;
+    struct ring r;
+    struct slot *slots;
+    struct iovec *iov;
+    char *bufs;
+    size_t chunk, stride, pageSize;
+    off_t inStart, outStart, size, nextOff, nChunks;
+    unsigned depth, active, idx, j;
+    int fixed, res, savedErrno;
+
+    if (fstat(inFd, &inSb) == -1 || fstat(outFd, &outSb) == -1)
+        return -1;
+
+    /* Every operation carries an explicit file offset, so both files
+       must be seekable, and we need to know where the input ends */
+
+    if (!S_ISREG(inSb.st_mode) ||
+            !(S_ISREG(outSb.st_mode) || S_ISBLK(outSb.st_mode))) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    inStart = lseek(inFd, 0, SEEK_CUR);
+    outStart = lseek(outFd, 0, SEEK_CUR);
+    if (inStart == -1 || outStart == -1)
+        return -1;
+
+    /* Nothing to copy according to st_size may just be a pseudo-file
+       (e.g., under /proc) that has data all the same; only read() can
+       tell, so leave it to readWrite() */
+
+    size = inSb.st_size;
+    if (inStart >= size) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    pageSize = sysconf(_SC_PAGESIZE);
+    chunk = opts->bufSize != 0 ? opts->bufSize : URING_CHUNK;
+    if ((off_t) chunk > size - inStart) /* Don't allocate more than needed */
+        chunk = (size - inStart + pageSize - 1) / pageSize * pageSize;
+    depth = opts->queueDepth != 0 ? opts->queueDepth : COPY_URING_DEPTH;
+    stride = (chunk + pageSize - 1) / pageSize * pageSize;
+    nChunks = (size - inStart + chunk - 1) / chunk;
+    if ((off_t) depth > nChunks)
+        depth = nChunks;
+
+    if (ringSetup(&r, depth) == -1) {
+        if (errno == EPERM)             /* io_uring disabled by sysctl */
+            errno = ENOSYS;
+        return -1;
+    }
+
+    slots = calloc(depth, sizeof(struct slot));
+    iov = calloc(depth, sizeof(struct iovec));
+    bufs = NULL;
+    if (slots == NULL || iov == NULL ||
+            (errno = posix_memalign((void **) &bufs, pageSize,
+                                    depth * stride)) != 0) {
+        savedErrno = errno != 0 ? errno : ENOMEM;
+        free(slots);
+        free(iov);
+        ringTeardown(&r);
+        errno = savedErrno;
+        return -1;
+    }
+
+    for (j = 0; j < depth; j++) {
+        slots[j].buf = bufs + j * stride;
+        iov[j].iov_base = slots[j].buf;
+        iov[j].iov_len = chunk;
+    }
+    fixed = syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_BUFFERS,
+                    iov, depth) == 0;
+
+    stats->bufSize = chunk;
+    stats->queueDepth = depth;
+
+    nextOff = inStart;
+    active = 0;
+    for (j = 0; j < depth && nextOff < size; j++) {
+        startRead(&slots[j], &nextOff, size, chunk, outStart - inStart);
+        ringQueue(&r, slots, j, inFd, outFd, fixed);
+        active++;
+    }
+
+    while (active > 0) {
+        if (ringEnter(&r) == -1)
+            goto fail;
+
+        while (ringReap(&r, &idx, &res)) {
+            struct slot *s = &slots[idx];
+
+            if (res < 0) {
+                if (res == -EAGAIN || res == -EINTR) {
+                    ringQueue(&r, slots, idx, inFd, outFd, fixed);
+                    continue;
+                }
+                errno = -res;
+                goto fail;
+            }
+
+            if (s->state == SLOT_READING && res == 0) {
+                /* Input was truncated under us; copy what we saw */
+
+                s->len = s->done;
+                if (s->off + (off_t) s->len < size)
+                    size = s->off + s->len;
+            } else {
+                s->done += res;
+            }
+
+            if (s->done < s->len) {                     /* Short transfer */
+                ringQueue(&r, slots, idx, inFd, outFd, fixed);
+                continue;
+            }
+
+            if (s->state == SLOT_READING && s->len > 0) {
+                s->state = SLOT_WRITING;
+                s->done = 0;
+                ringQueue(&r, slots, idx, inFd, outFd, fixed);
+                continue;
+            }
+
+            if (s->state == SLOT_WRITING) {
+                stats->bytes += s->len;
+                stats->path = CP_URING;
+            }
+
+            if (nextOff < size) {
+                startRead(s, &nextOff, size, chunk, outStart - inStart);
+                ringQueue(&r, slots, idx, inFd, outFd, fixed);
+            } else {
+                s->state = SLOT_IDLE;
+                active--;
+            }
+        }
+    }
+
+    ringTeardown(&r);
+    free(bufs);
+    free(iov);
+    free(slots);
+
+    /* Leave the offsets where a read()/write() loop would have left them */
+
+    if (lseek(inFd, size, SEEK_SET) == -1 ||
+            lseek(outFd, outStart + (size - inStart), SEEK_SET) == -1)
+        return -1;
+    return 0;
+
+fail:
+    savedErrno = errno;
+
+    /* The kernel may still be using the buffers, so wait for everything
+       that was submitted before freeing them */
+
+    while (r.inFlight > r.toSubmit && ringEnter(&r) == 0)
+        while (ringReap(&r, &idx, &res))
+            continue;
+
+    ringTeardown(&r);
+    free(bufs);
+    free(iov);
+    free(slots);
+    errno = savedErrno;
+    return -1;
+}
@@ -0,0 +1,281 @@
+/* crc32c.c
+
+   CRC-32C, with a hardware version chosen at run time (see crc32c.h).
+
+   x86-64 (SSE4.2) and ARMv8 both have an instruction that folds 8 bytes
+   into a CRC-32C. On x86 it has a latency of three cycles but can start a
+   new one every cycle, so a single chain of them runs at a third of the
+   possible speed. As in Mark Adler's well-known crc32c.c, we therefore
+   run three independent CRCs over adjacent blocks of the buffer at once,
+   and then combine them: appending n bytes to a message is a linear
+   operation on its CRC, so "the CRC of block 1, shifted over the length
+   of block 2" can be computed by four table lookups (crc32cShift()), with
+   tables built once for each of the two block sizes we use.
+
+   Without the instruction, crc32c() falls back to crc32cScalar(), which
+   processes a byte at a time through a 256-entry table. The choice is made
+   on the first call (with CPU feature tests), and crc32cImpl() says what
+   was chosen.
+*/
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>          /* _mm_crc32_u8(), _mm_crc32_u64() */
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>          /* HWCAP_CRC32 */
+#endif
+#include "crc32c.h"
+
+#define POLY 0x82f63b78         /* CRC-32C polynomial, bit-reversed */
+
+#define LONG_BLOCK 8192         /* Sizes of the blocks CRCed in parallel */
+#define SHORT_BLOCK 256
+
+static uint32_t byteTable[256];
+static uint32_t longShift[4][256];      /* Append LONG_BLOCK zero bytes */
+static uint32_t shortShift[4][256];     /* Append SHORT_BLOCK zero bytes */
+
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+
+static uint32_t (*impl)(uint32_t crc, const void *buf, size_t len);
+static const char *implName;
+
+/* Multiply the 32x32 GF(2) matrix 'mat' by the vector 'vec' */
+
+static uint32_t
+gf2Times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum;
+
+    for (sum = 0; vec != 0; vec >>= 1, mat++)
+        if (vec & 1)
+            sum ^= *mat;
+    return sum;
+}
+
+static void
+gf2Square(uint32_t *square, const uint32_t *mat)
+{
+    int n;
+
+    for (n = 0; n < 32; n++)
+        square[n] = gf2Times(mat, mat[n]);
+}
+
+/* Build the tables that apply the operator "append 'len' zero bytes"
+   ('len' a power of 2) to a CRC a byte at a time */
+
+static void
+makeShift(uint32_t table[4][256], size_t len)
+{
+    uint32_t odd[32], even[32], row, *op;
+    int n;
+
+    odd[0] = POLY;                      /* Operator for one zero bit */
+    for (n = 1, row = 1; n < 32; n++, row <<= 1)
+        odd[n] = row;
+
+    gf2Square(even, odd);               /* 2 bits */
+    gf2Square(odd, even);               /* 4 bits */
+
+    /* Square until we reach 'len' bytes (8 bits being the first) */
+
+    for (;;) {
+        gf2Square(even, odd);
+        len >>= 1;
+        if (len == 0) {
+            op = even;
+            break;
+        }
+        gf2Square(odd, even);
+        len >>= 1;
+        if (len == 0) {
+            op = odd;
+            break;
+        }
+    }
+
+    for (n = 0; n < 256; n++) {
+        table[0][n] = gf2Times(op, n);
+        table[1][n] = gf2Times(op, n << 8);
+        table[2][n] = gf2Times(op, n << 16);
+        table[3][n] = gf2Times(op, (uint32_t) n << 24);
+    }
+}
+
+static uint32_t
+crc32cShift(uint32_t table[4][256], uint32_t crc)
+{
+    return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^
+           table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32cHw(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *next = buf, *end;
+    uint64_t crc0, crc1, crc2, w0, w1, w2;
+
+    crc0 = (uint32_t) ~crc;
+    while (len > 0 && ((uintptr_t) next & 7) != 0) {
+        crc0 = _mm_crc32_u8(crc0, *next++);
+        len--;
+    }
+
+    /* Three blocks at a time, LONG_BLOCK and then SHORT_BLOCK bytes each */
+
+    while (len >= 3 * LONG_BLOCK) {
+        crc1 = crc2 = 0;
+        for (end = next + LONG_BLOCK; next < end; next += 8) {
+            memcpy(&w0, next, 8);
+            memcpy(&w1, next + LONG_BLOCK, 8);
+            memcpy(&w2, next + 2 * LONG_BLOCK, 8);
+            crc0 = _mm_crc32_u64(crc0, w0);
+            crc1 = _mm_crc32_u64(crc1, w1);
+            crc2 = _mm_crc32_u64(crc2, w2);
+        }
+        crc0 = crc32cShift(longShift, crc0) ^ crc1;
+        crc0 = crc32cShift(longShift, crc0) ^ crc2;
+        next += 2 * LONG_BLOCK;
+        len -= 3 * LONG_BLOCK;
+    }
+
+    while (len >= 3 * SHORT_BLOCK) {
+        crc1 = crc2 = 0;
+        for (end = next + SHORT_BLOCK; next < end; next += 8) {
+            memcpy(&w0, next, 8);
+            memcpy(&w1, next + SHORT_BLOCK, 8);
+            memcpy(&w2, next + 2 * SHORT_BLOCK, 8);
+            crc0 = _mm_crc32_u64(crc0, w0);
+            crc1 = _mm_crc32_u64(crc1, w1);
+            crc2 = _mm_crc32_u64(crc2, w2);
+        }
+        crc0 = crc32cShift(shortShift, crc0) ^ crc1;
+        crc0 = crc32cShift(shortShift, crc0) ^ crc2;
+        next += 2 * SHORT_BLOCK;
+        len -= 3 * SHORT_BLOCK;
+    }
+
+    for (; len >= 8; len -= 8, next += 8) {
+        memcpy(&w0, next, 8);
+        crc0 = _mm_crc32_u64(crc0, w0);
+    }
+    while (len-- > 0)
+        crc0 = _mm_crc32_u8(crc0, *next++);
+
+    return ~(uint32_t) crc0;
+}
+
+#elif defined(__aarch64__) && defined(HWCAP_CRC32)
+
+#include <arm_acle.h>
+
+__attribute__((target("+crc")))
+static uint32_t
+crc32cHw(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *next = buf, *end;
+    uint32_t crc0, crc1, crc2;
+    uint64_t w0, w1, w2;
+
+    crc0 = ~crc;
+    while (len > 0 && ((uintptr_t) next & 7) != 0) {
+        crc0 = __crc32cb(crc0, *next++);
+        len--;
+    }
+
+    while (len >= 3 * LONG_BLOCK) {
+        crc1 = crc2 = 0;
+        for (end = next + LONG_BLOCK; next < end; next += 8) {
+            memcpy(&w0, next, 8);
+            memcpy(&w1, next + LONG_BLOCK, 8);
+            memcpy(&w2, next + 2 * LONG_BLOCK, 8);
+            crc0 = __crc32cd(crc0, w0);
+            crc1 = __crc32cd(crc1, w1);
+            crc2 = __crc32cd(crc2, w2);
+        }
+        crc0 = crc32cShift(longShift, crc0) ^ crc1;
+        crc0 = crc32cShift(longShift, crc0) ^ crc2;
+        next += 2 * LONG_BLOCK;
+        len -= 3 * LONG_BLOCK;
+    }
+
+    for (; len >= 8; len -= 8, next += 8) {
+        memcpy(&w0, next, 8);
+        crc0 = __crc32cd(crc0, w0);
+    }
+    while (len-- > 0)
+        crc0 = __crc32cb(crc0, *next++);
+
+    return ~crc0;
+}
+
+#endif
+
+static uint32_t
+scalarNoInit(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    crc = ~crc;
+    while (len-- > 0)
+        crc = byteTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void
+initTables(void)
+{
+    uint32_t crc;
+    int n, k;
+
+    for (n = 0; n < 256; n++) {
+        crc = n;
+        for (k = 0; k < 8; k++)
+            crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+        byteTable[n] = crc;
+    }
+    makeShift(longShift, LONG_BLOCK);
+    makeShift(shortShift, SHORT_BLOCK);
+
+    impl = scalarNoInit;
+    implName = "scalar";
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        impl = crc32cHw;
+        implName = "sse4.2";
+    }
+#elif defined(__aarch64__) && defined(HWCAP_CRC32)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        impl = crc32cHw;
+        implName = "armv8-crc";
+    }
+#endif
+}
+
+uint32_t
+crc32cScalar(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&initOnce, initTables);
+    return scalarNoInit(crc, buf, len);
+}
+
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&initOnce, initTables);
+    return impl(crc, buf, len);
+}
+
+const char *
+crc32cImpl(void)
+{
+    pthread_once(&initOnce, initTables);
+    return implName;
+}
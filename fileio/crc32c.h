@@ -0,0 +1,25 @@
+/* crc32c.h
+
+   CRC-32C (the Castagnoli polynomial, as used by iSCSI, ext4 and btrfs),
+   computed incrementally: start with 0 and feed each buffer in turn, as in
+
+       crc = crc32c(0, buf1, len1);
+       crc = crc32c(crc, buf2, len2);
+
+   crc32c() uses the CPU's CRC instructions when it has them (chosen at run
+   time; see crc32c.c); crc32cScalar() is a plain table-driven version that
+   gives the same results everywhere, for checking the fast one.
+*/
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+uint32_t crc32cScalar(uint32_t crc, const void *buf, size_t len);
+
+const char *crc32cImpl(void);   /* Name of the version crc32c() uses */
+
+#endif
@@ -0,0 +1,103 @@
+#!/bin/sh
+#
+# reflink_test.sh -- check copy's --reflink modes on a loopback filesystem
+#
+# Usage: reflink_test.sh [btrfs|xfs]     (as root; default: btrfs)
+#
+# Makes a small image file, formats it (XFS with reflink=1), mounts it on a
+# loop device and checks that:
+#
+#   - 'copy --reflink=always' clones a file (reported as "via reflink"),
+#     and the clone's extents are marked shared;
+#   - 'copy --reflink=never' copies the data, sharing nothing;
+#   - the copies match the original;
+#   - on btrfs, a clone into another subvolume (a different st_dev on the
+#     same filesystem) also works.
+#
+# Needs mkfs.btrfs or mkfs.xfs, and filefrag (e2fsprogs) for the extent
+# checks, which are skipped without it. Run 'make copy' first.
+
+fs=${1:-btrfs}
+copy=$(cd "$(dirname "$0")" && pwd)/copy
+fail=0
+
+die() {
+    echo "reflink_test: $*" >&2
+    exit 1
+}
+
+check() {                       # check description command...
+    what=$1
+    shift
+    if "$@"; then
+        echo "ok      $what"
+    else
+        echo "FAILED  $what"
+        fail=1
+    fi
+}
+
+# Does 'file' have any extent flagged as shared?
+shared() {
+    filefrag -v "$1" | grep -q shared
+}
+
+not_shared() {
+    ! shared "$1"
+}
+
+via_reflink() {                 # via_reflink log-file
+    grep -q 'via reflink' "$1"
+}
+
+not_via_reflink() {
+    ! via_reflink "$1"
+}
+
+[ "$(id -u)" = 0 ] || die "must be run as root (to mount the image)"
+[ -x "$copy" ] || die "$copy not found; run 'make copy' first"
+case $fs in
+btrfs)  mkfs="mkfs.btrfs -q" ;;
+xfs)    mkfs="mkfs.xfs -q -m reflink=1" ;;
+*)      die "unknown filesystem '$fs' (btrfs or xfs)" ;;
+esac
+command -v "${mkfs%% *}" >/dev/null || die "${mkfs%% *} not installed"
+
+tmp=$(mktemp -d) || exit 1
+mnt=$tmp/mnt
+trap 'umount "$mnt" 2>/dev/null; rm -rf "$tmp"' EXIT INT TERM
+
+truncate -s 512M "$tmp/image" && $mkfs "$tmp/image" &&
+    mkdir "$mnt" && mount -o loop "$tmp/image" "$mnt" ||
+    die "can't make and mount a $fs image"
+
+head -c 64M /dev/urandom > "$mnt/src" || die "can't write the input"
+sync
+
+"$copy" -v --reflink=always "$mnt/src" "$mnt/clone" 2> "$tmp/log"
+check "--reflink=always succeeds" [ $? = 0 ]
+check "--reflink=always clones" via_reflink "$tmp/log"
+check "clone matches" cmp -s "$mnt/src" "$mnt/clone"
+
+"$copy" -v --reflink=never "$mnt/src" "$mnt/copy" 2> "$tmp/log"
+check "--reflink=never succeeds" [ $? = 0 ]
+check "--reflink=never doesn't clone" not_via_reflink "$tmp/log"
+check "copy matches" cmp -s "$mnt/src" "$mnt/copy"
+
+if command -v filefrag >/dev/null; then
+    sync
+    check "clone shares extents" shared "$mnt/clone"
+    check "copy shares nothing" not_shared "$mnt/copy"
+else
+    echo "skip    extent checks (no filefrag)"
+fi
+
+if [ "$fs" = btrfs ]; then
+    btrfs subvolume create "$mnt/sub" >/dev/null ||
+        die "can't create a subvolume"
+    "$copy" -v --reflink=always "$mnt/src" "$mnt/sub/clone" 2> "$tmp/log"
+    check "clone into another subvolume" via_reflink "$tmp/log"
+    check "subvolume clone matches" cmp -s "$mnt/src" "$mnt/sub/clone"
+fi
+
+exit $fail
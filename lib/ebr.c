@@ -0,0 +1,225 @@
+/*
+  Epoch-based reclamation (Fraser, "Practical lock-freedom", 2004).
+
+  The domain has a global epoch, and each thread that uses it a record
+  holding the epoch it entered at (or 0 when it is outside). Something
+  retired at epoch e may still be seen by threads that entered at e or
+  e - 1, but not by any that enter later, since it was already unlinked.
+  The global epoch only moves from e to e + 1 once every thread inside
+  has entered at e, so by the time it reaches e + 2 nobody can still hold
+  a pointer into anything retired at e, and it is freed.
+
+  Each thread keeps what it retires in three lists, by epoch mod 3; a
+  list is freed as its epoch comes round again (three epochs later) or,
+  when the thread has a batch of EBR_BATCH waiting, after it has tried to
+  advance the epoch. So each thread has at most three epochs' worth of
+  retirements outstanding, and an epoch passes every EBR_BATCH retirements
+  unless a reader holds it up. A thread that is stuck inside ebr_enter()
+  ... ebr_exit() holds everything up, so critical sections must be short.
+
+  ebr_quiescent() re-enters at the current epoch without leaving, which
+  is all QSBR needs: a thread that stays inside but passes quiescent
+  points often never holds the epoch back for long. ebr_synchronize()
+  drives the epoch on two steps, waiting for stragglers, after which
+  nothing retired before the call can still be in use.
+
+  Records are found through thread-specific data. They are never freed
+  while the domain exists: when a thread exits, its record (and whatever
+  it had retired) is left for the next thread that registers.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ebr.h"
+
+#define EBR_BATCH 64                // retirements between advance attempts
+
+typedef struct ebr_thread {
+    unsigned long epoch;            // (epoch << 1) | 1 while inside, else 0
+    int in_use;                     // claimed by a live thread
+    struct ebr_thread *next;        // all records of the domain
+    ebr_entry *limbo[3];            // retired, by epoch mod 3
+    unsigned long limbo_epoch[3];
+    size_t pending;                 // retired since the last advance attempt
+} ebr_thread;
+
+struct ebr_domain {
+    unsigned long epoch;
+    ebr_thread *threads;
+    pthread_key_t key;
+    void (*reclaim)(ebr_entry *entry);
+};
+
+static void die(int err, const char *what) {
+    fprintf(stderr, "ebr: %s: %s\n", what, strerror(err));
+    abort();
+}
+
+static void release_thread(void *arg) {
+    ebr_thread *t = arg;
+
+    __atomic_store_n(&t->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&t->in_use, 0, __ATOMIC_RELEASE);
+}
+
+ebr_domain *ebr_create(void (*reclaim)(ebr_entry *entry)) {
+    ebr_domain *d = calloc(1, sizeof(ebr_domain));
+    int s;
+
+    if (d == NULL) { die(ENOMEM, "calloc"); }
+    d->epoch = 1;
+    d->threads = NULL;
+    d->reclaim = reclaim;
+    s = pthread_key_create(&d->key, release_thread);
+    if (s != 0) { die(s, "pthread_key_create"); }
+    return d;
+}
+
+static void free_list(ebr_domain *d, ebr_entry *e) {
+    ebr_entry *next;
+
+    for (; e != NULL; e = next) {
+        next = e->next;
+        d->reclaim(e);
+    }
+}
+
+void ebr_destroy(ebr_domain *d) {
+    ebr_thread *t, *next;
+    int i;
+
+    pthread_key_delete(d->key);
+    for (t = d->threads; t != NULL; t = next) {
+        next = t->next;
+        for (i = 0; i < 3; i++)
+            free_list(d, t->limbo[i]);
+        free(t);
+    }
+    free(d);
+}
+
+/* The calling thread's record: reuse one left by an exited thread, or add
+   a new one to the (push-only) list */
+static ebr_thread *get_thread(ebr_domain *d) {
+    ebr_thread *t = pthread_getspecific(d->key);
+    int s, zero;
+
+    if (t != NULL) return t;
+
+    for (t = __atomic_load_n(&d->threads, __ATOMIC_ACQUIRE); t != NULL;
+         t = t->next) {
+        zero = 0;
+        if (__atomic_compare_exchange_n(&t->in_use, &zero, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (t == NULL) {
+        t = calloc(1, sizeof(ebr_thread));
+        if (t == NULL) { die(ENOMEM, "calloc"); }
+        t->in_use = 1;
+        t->next = __atomic_load_n(&d->threads, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&d->threads, &t->next, t, 1,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+            ;
+    }
+
+    s = pthread_setspecific(d->key, t);
+    if (s != 0) { die(s, "pthread_setspecific"); }
+    return t;
+}
+
+void ebr_enter(ebr_domain *d) {
+    ebr_thread *t = get_thread(d);
+    unsigned long e = __atomic_load_n(&d->epoch, __ATOMIC_RELAXED);
+
+    /* The record must be visible before we read any shared pointer, or a
+       thread advancing the epoch could miss us: a full fence */
+    __atomic_store_n(&t->epoch, (e << 1) | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void ebr_exit(ebr_domain *d) {
+    ebr_thread *t = pthread_getspecific(d->key);
+
+    __atomic_store_n(&t->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Nothing read before this may be used after it (the release half), and
+   the new epoch must be visible before anything is read again: as in
+   ebr_enter(), a full fence */
+void ebr_quiescent(ebr_domain *d) {
+    ebr_thread *t = pthread_getspecific(d->key);
+    unsigned long e = __atomic_load_n(&d->epoch, __ATOMIC_RELAXED);
+
+    if (t->epoch == ((e << 1) | 1)) return;     // nothing to announce
+    __atomic_store_n(&t->epoch, (e << 1) | 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Move the global epoch on if every thread inside has caught up with it;
+   returns the (possibly new) epoch */
+static unsigned long try_advance(ebr_domain *d) {
+    unsigned long e = __atomic_load_n(&d->epoch, __ATOMIC_SEQ_CST), te;
+    ebr_thread *t;
+
+    for (t = __atomic_load_n(&d->threads, __ATOMIC_ACQUIRE); t != NULL;
+         t = t->next) {
+        te = __atomic_load_n(&t->epoch, __ATOMIC_ACQUIRE);
+        if ((te & 1) && (te >> 1) != e)
+            return e;
+    }
+    if (__atomic_compare_exchange_n(&d->epoch, &e, e + 1, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        e++;
+    return e;
+}
+
+/* Free those of t's lists that are two or more epochs older than 'e' */
+static void collect(ebr_domain *d, ebr_thread *t, unsigned long e) {
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (t->limbo[i] != NULL && t->limbo_epoch[i] + 2 <= e) {
+            free_list(d, t->limbo[i]);
+            t->limbo[i] = NULL;
+        }
+    }
+}
+
+void ebr_retire(ebr_domain *d, ebr_entry *entry) {
+    ebr_thread *t = get_thread(d);
+    unsigned long e = __atomic_load_n(&d->epoch, __ATOMIC_SEQ_CST);
+    int i = e % 3;
+
+    if (t->limbo_epoch[i] != e) {   // i.e. it holds epoch e - 3 or older
+        free_list(d, t->limbo[i]);
+        t->limbo[i] = NULL;
+        t->limbo_epoch[i] = e;
+    }
+    entry->next = t->limbo[i];
+    t->limbo[i] = entry;
+
+    if (++t->pending >= EBR_BATCH) {
+        t->pending = 0;
+        collect(d, t, try_advance(d));
+    }
+}
+
+void ebr_synchronize(ebr_domain *d) {
+    ebr_thread *t = get_thread(d);
+    unsigned long target = __atomic_load_n(&d->epoch, __ATOMIC_SEQ_CST) + 2;
+    int i;
+
+    while (try_advance(d) < target)
+        sched_yield();              // a reader is still at an old epoch
+    for (i = 0; i < 3; i++) {
+        free_list(d, t->limbo[i]);
+        t->limbo[i] = NULL;
+    }
+    t->pending = 0;
+}
@@ -0,0 +1,50 @@
+/*
+  Epoch-based reclamation (see ebr.c): lets lock-free readers go on
+  using memory that a writer has just unlinked, by deferring free() until
+  every thread that might still hold a pointer to it has moved on.
+
+  Readers and writers bracket each operation with ebr_enter() and
+  ebr_exit() (not nested). A writer that has unlinked an object passes
+  its embedded ebr_entry to ebr_retire(); the domain's 'reclaim' function
+  is called on it later, from whichever thread finds it safe to do so.
+
+  Alternatively (quiescent-state-based reclamation, QSBR), a thread may
+  stay inside across any number of operations, calling ebr_quiescent()
+  at points where it holds no pointers into the shared data -- between
+  requests, say. That moves the cost of ebr_enter() off each operation,
+  at the price of holding reclamation up until the next such point.
+
+  Not tied to any data structure; used by the ch30 skip list and hash
+  index.
+*/
+#ifndef EBR_H
+#define EBR_H
+
+#include <stddef.h>
+
+typedef struct ebr_entry {
+    struct ebr_entry *next;
+} ebr_entry;
+
+typedef struct ebr_domain ebr_domain;
+
+ebr_domain *ebr_create(void (*reclaim)(ebr_entry *entry));
+
+// Reclaims everything still pending; no thread may be using the domain
+void ebr_destroy(ebr_domain *domain);
+
+void ebr_enter(ebr_domain *domain);
+void ebr_exit(ebr_domain *domain);
+
+// Inside: as ebr_exit() then ebr_enter(), but cheaper
+void ebr_quiescent(ebr_domain *domain);
+
+// 'entry' must already be unreachable for threads entering from now on
+void ebr_retire(ebr_domain *domain, ebr_entry *entry);
+
+/* Waits for a grace period -- until every thread that was inside has
+   left or passed ebr_quiescent() -- and then reclaims everything the
+   calling thread has retired. The caller must be outside. */
+void ebr_synchronize(ebr_domain *domain);
+
+#endif
@@ -0,0 +1,439 @@
+/*
+  A work-stealing thread pool.
+
+  Each worker owns a Chase-Lev deque (Chase and Lev, "Dynamic circular
+  work-stealing deque", 2005; with the C11 orderings of Le et al., 2013).
+  The owner pushes and takes at the bottom, like a stack, so it runs the
+  most recent -- and most cache-warm -- task first; other workers steal
+  from the top, the oldest task, which in fork-join code is the largest
+  piece of work left. Only a steal, or the owner taking the very last
+  task, needs a compare-and-swap. A deque that fills up is replaced by
+  one twice the size; the old one may still be read by a thief, so it's
+  kept until the pool is destroyed (at most doubling the memory used).
+
+  Tasks submitted by a thread outside the pool go on a mutex-protected
+  queue that every worker checks after its own deque.
+
+  A worker that finds nothing to do -- in its deque, the shared queue, or
+  anyone else's deque -- looks again TP_SPINS times, yielding the CPU in
+  between, and then parks on a condition variable. The park is an
+  "eventcount": the worker counts itself as a sleeper, notes 'events',
+  and looks for work one last time before it waits for 'events' to
+  change; a submitter, having published its task, takes the mutex only if
+  there are sleepers, and then bumps 'events' and signals. Either the
+  worker's last look sees the task, or the submitter sees the sleeper
+  (both sides order their store before their load with a full fence), so
+  no wakeup is lost, and a busy pool never touches the mutex.
+
+  Wait groups: finishing a task decrements its group's count with a
+  compare-and-swap, except for the last one, which is done under the
+  group's mutex and wakes the waiters. A waiter only returns after it has
+  seen the count reach zero under that mutex, so by then nothing will
+  touch the group again and the caller may free it.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "thread_pool.h"
+
+#define TP_DEQUE_MIN    256         // slots in a new deque
+#define TP_SPINS        32          // looks for work before parking
+
+typedef struct tp_task {
+    void (*fn)(void *arg);
+    void *arg;
+    wait_group *wg;
+    struct tp_task *next;           // on the shared queue
+} tp_task;
+
+typedef struct tp_array {
+    long size;                      // a power of 2
+    struct tp_array *prev;          // the smaller array this one replaced
+    tp_task *slots[];
+} tp_array;
+
+typedef struct tp_worker {
+    long top;                       // the next to steal (only ever grows)
+    long bottom                     // the next free slot; owner only
+        __attribute__((aligned(64)));
+    tp_array *array;
+    thread_pool *pool;
+    pthread_t tid;
+    unsigned long rng;              // for choosing whom to steal from
+} __attribute__((aligned(64))) tp_worker;
+
+struct thread_pool {
+    unsigned nworkers;
+    tp_worker *workers;
+    pthread_key_t self;             // a worker's own tp_worker
+
+    pthread_mutex_t queue_mutex;    // protects the shared queue
+    tp_task *queue_head, *queue_tail;
+    unsigned long queued;           // its length, read without the mutex
+
+    pthread_mutex_t park_mutex;     // protects 'shutdown'; see above
+    pthread_cond_t park_cond;
+    unsigned long events;
+    unsigned long sleepers;
+    int shutdown;
+};
+
+// Stands for "lost a race for a task": the deque may still hold more
+#define STEAL_RETRY     ((tp_task *) 1)
+
+static void die(int err, const char *what) {
+    fprintf(stderr, "thread_pool: %s: %s\n", what, strerror(err));
+    abort();
+}
+
+static void lock_mutex(pthread_mutex_t *mutex) {
+    int s = pthread_mutex_lock(mutex);
+    if (s != 0) { die(s, "pthread_mutex_lock"); }
+}
+
+static void unlock_mutex(pthread_mutex_t *mutex) {
+    int s = pthread_mutex_unlock(mutex);
+    if (s != 0) { die(s, "pthread_mutex_unlock"); }
+}
+
+static void wait_cond(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    int s = pthread_cond_wait(cond, mutex);
+    if (s != 0) { die(s, "pthread_cond_wait"); }
+}
+
+static unsigned long xorshift(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static tp_array *new_array(long size) {
+    tp_array *a = malloc(sizeof(tp_array) + size * sizeof(tp_task *));
+
+    if (a == NULL) { die(ENOMEM, "malloc"); }
+    a->size = size;
+    a->prev = NULL;
+    return a;
+}
+
+/* The deque. push() and take() are for the owner only; steal() is for
+   anyone, the owner included. */
+
+static tp_array *grow(tp_worker *w, tp_array *a, long top, long bottom) {
+    tp_array *bigger = new_array(2 * a->size);
+    long i;
+
+    for (i = top; i < bottom; i++)
+        bigger->slots[i & (bigger->size - 1)] =
+            __atomic_load_n(&a->slots[i & (a->size - 1)], __ATOMIC_RELAXED);
+    bigger->prev = a;
+    __atomic_store_n(&w->array, bigger, __ATOMIC_RELEASE);
+    return bigger;
+}
+
+static void push(tp_worker *w, tp_task *task) {
+    long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    tp_array *a = __atomic_load_n(&w->array, __ATOMIC_RELAXED);
+
+    if (b - t > a->size - 1)
+        a = grow(w, a, t, b);
+    __atomic_store_n(&a->slots[b & (a->size - 1)], task, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+static tp_task *take(tp_worker *w) {
+    long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+    tp_array *a = __atomic_load_n(&w->array, __ATOMIC_RELAXED);
+    tp_task *task;
+    long t;
+
+    // Claim the bottom slot before looking at 'top': a full fence
+    __atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+    if (t > b) {                    // empty
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    task = __atomic_load_n(&a->slots[b & (a->size - 1)], __ATOMIC_RELAXED);
+    if (t == b) {                   // the last one: a thief may want it too
+        if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            task = NULL;
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+static tp_task *steal(tp_worker *w) {
+    long t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE), b;
+    tp_array *a;
+    tp_task *task;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) return NULL;
+    a = __atomic_load_n(&w->array, __ATOMIC_ACQUIRE);
+    task = __atomic_load_n(&a->slots[t & (a->size - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return STEAL_RETRY;
+    return task;
+}
+
+/* The shared queue, for tasks from outside the pool */
+
+static void enqueue(thread_pool *pool, tp_task *task) {
+    task->next = NULL;
+    lock_mutex(&pool->queue_mutex);
+    if (pool->queue_tail != NULL)
+        pool->queue_tail->next = task;
+    else
+        pool->queue_head = task;
+    pool->queue_tail = task;
+    __atomic_store_n(&pool->queued, pool->queued + 1, __ATOMIC_RELAXED);
+    unlock_mutex(&pool->queue_mutex);
+}
+
+static tp_task *dequeue(thread_pool *pool) {
+    tp_task *task;
+
+    if (__atomic_load_n(&pool->queued, __ATOMIC_RELAXED) == 0) return NULL;
+    lock_mutex(&pool->queue_mutex);
+    task = pool->queue_head;
+    if (task != NULL) {
+        pool->queue_head = task->next;
+        if (pool->queue_head == NULL) pool->queue_tail = NULL;
+        __atomic_store_n(&pool->queued, pool->queued - 1, __ATOMIC_RELAXED);
+    }
+    unlock_mutex(&pool->queue_mutex);
+    return task;
+}
+
+/* A task for worker 'w': its own newest, else the oldest shared one, else
+   the oldest of some other worker's, starting with a random victim */
+static tp_task *find_task(thread_pool *pool, tp_worker *w) {
+    unsigned i, start, n = pool->nworkers;
+    tp_task *task;
+    int retry;
+
+    if ((task = take(w)) != NULL) return task;
+    if ((task = dequeue(pool)) != NULL) return task;
+    do {
+        retry = 0;
+        start = xorshift(&w->rng) % n;
+        for (i = 0; i < n; i++) {
+            task = steal(&pool->workers[(start + i) % n]);
+            if (task == STEAL_RETRY)
+                retry = 1;
+            else if (task != NULL)
+                return task;
+        }
+    } while (retry);
+    return NULL;
+}
+
+static void finish(wait_group *wg) {
+    unsigned long n = __atomic_load_n(&wg->pending, __ATOMIC_RELAXED);
+
+    while (n > 1)
+        if (__atomic_compare_exchange_n(&wg->pending, &n, n - 1, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return;
+    lock_mutex(&wg->mutex);
+    if (__atomic_sub_fetch(&wg->pending, 1, __ATOMIC_RELEASE) == 0)
+        pthread_cond_broadcast(&wg->done);
+    unlock_mutex(&wg->mutex);
+}
+
+static void run(tp_task *task) {
+    wait_group *wg = task->wg;
+
+    task->fn(task->arg);
+    free(task);
+    finish(wg);
+}
+
+/* Wake a parked worker, if there is one, for a task just published */
+static void notify(thread_pool *pool) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_RELAXED) == 0) return;
+    lock_mutex(&pool->park_mutex);
+    __atomic_store_n(&pool->events, pool->events + 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&pool->park_cond);
+    unlock_mutex(&pool->park_mutex);
+}
+
+/* Sleep until there may be work; returns 1 if the pool is shutting down */
+static int park(thread_pool *pool, tp_worker *w) {
+    unsigned long ev;
+    tp_task *task;
+    int stop = 0;
+
+    __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    ev = __atomic_load_n(&pool->events, __ATOMIC_RELAXED);
+    task = find_task(pool, w);
+    if (task == NULL) {
+        lock_mutex(&pool->park_mutex);
+        while (__atomic_load_n(&pool->events, __ATOMIC_RELAXED) == ev &&
+               !pool->shutdown)
+            wait_cond(&pool->park_cond, &pool->park_mutex);
+        stop = pool->shutdown;
+        unlock_mutex(&pool->park_mutex);
+    }
+    __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_RELAXED);
+
+    if (task != NULL) run(task);
+    return stop;
+}
+
+static void *worker_main(void *arg) {
+    tp_worker *w = arg;
+    thread_pool *pool = w->pool;
+    tp_task *task;
+    int s, spins = 0;
+
+    s = pthread_setspecific(pool->self, w);
+    if (s != 0) { die(s, "pthread_setspecific"); }
+    for (;;) {
+        if ((task = find_task(pool, w)) != NULL) {
+            run(task);
+            spins = 0;
+        } else if (++spins < TP_SPINS) {
+            sched_yield();
+        } else {
+            spins = 0;
+            if (park(pool, w)) break;
+        }
+    }
+
+    // Shutting down: whatever is left is ours or already being run
+    while ((task = find_task(pool, w)) != NULL)
+        run(task);
+    return NULL;
+}
+
+thread_pool *tp_create(unsigned nworkers) {
+    thread_pool *pool = calloc(1, sizeof(thread_pool));
+    unsigned i;
+    long n;
+    int s;
+
+    if (pool == NULL) { die(ENOMEM, "calloc"); }
+    if (nworkers == 0) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = n > 0 ? n : 1;
+    }
+    pool->nworkers = nworkers;
+    s = posix_memalign((void **) &pool->workers, 64,
+                       nworkers * sizeof(tp_worker));
+    if (s != 0) { die(s, "posix_memalign"); }
+    memset(pool->workers, 0, nworkers * sizeof(tp_worker));
+    s = pthread_key_create(&pool->self, NULL);
+    if (s != 0) { die(s, "pthread_key_create"); }
+    pthread_mutex_init(&pool->queue_mutex, NULL);
+    pthread_mutex_init(&pool->park_mutex, NULL);
+    pthread_cond_init(&pool->park_cond, NULL);
+
+    for (i = 0; i < nworkers; i++) {
+        pool->workers[i].array = new_array(TP_DEQUE_MIN);
+        pool->workers[i].pool = pool;
+        pool->workers[i].rng = 2654435761UL * (i + 1);
+    }
+    for (i = 0; i < nworkers; i++) {
+        s = pthread_create(&pool->workers[i].tid, NULL, worker_main,
+                           &pool->workers[i]);
+        if (s != 0) { die(s, "pthread_create"); }
+    }
+    return pool;
+}
+
+void tp_destroy(thread_pool *pool) {
+    tp_array *a, *prev;
+    unsigned i;
+    int s;
+
+    lock_mutex(&pool->park_mutex);
+    pool->shutdown = 1;
+    __atomic_store_n(&pool->events, pool->events + 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&pool->park_cond);
+    unlock_mutex(&pool->park_mutex);
+
+    for (i = 0; i < pool->nworkers; i++) {
+        s = pthread_join(pool->workers[i].tid, NULL);
+        if (s != 0) { die(s, "pthread_join"); }
+        for (a = pool->workers[i].array; a != NULL; a = prev) {
+            prev = a->prev;
+            free(a);
+        }
+    }
+
+    pthread_cond_destroy(&pool->park_cond);
+    pthread_mutex_destroy(&pool->park_mutex);
+    pthread_mutex_destroy(&pool->queue_mutex);
+    pthread_key_delete(pool->self);
+    free(pool->workers);
+    free(pool);
+}
+
+unsigned tp_workers(thread_pool *pool) {
+    return pool->nworkers;
+}
+
+void tp_submit(thread_pool *pool, wait_group *wg, void (*fn)(void *arg),
+               void *arg) {
+    tp_worker *w = pthread_getspecific(pool->self);
+    tp_task *task = malloc(sizeof(tp_task));
+
+    if (task == NULL) { die(ENOMEM, "malloc"); }
+    task->fn = fn;
+    task->arg = arg;
+    task->wg = wg;
+    __atomic_add_fetch(&wg->pending, 1, __ATOMIC_RELAXED);
+    if (w != NULL)
+        push(w, task);
+    else
+        enqueue(pool, task);
+    notify(pool);
+}
+
+void wg_init(wait_group *wg) {
+    wg->pending = 0;
+    pthread_mutex_init(&wg->mutex, NULL);
+    pthread_cond_init(&wg->done, NULL);
+}
+
+void wg_destroy(wait_group *wg) {
+    pthread_cond_destroy(&wg->done);
+    pthread_mutex_destroy(&wg->mutex);
+}
+
+void wg_wait(thread_pool *pool, wait_group *wg) {
+    tp_worker *w = pthread_getspecific(pool->self);
+    tp_task *task;
+
+    // A worker mustn't just sleep: the tasks it waits for may be its own
+    if (w != NULL) {
+        while (__atomic_load_n(&wg->pending, __ATOMIC_ACQUIRE) != 0) {
+            if ((task = find_task(pool, w)) != NULL)
+                run(task);
+            else
+                sched_yield();
+        }
+    }
+
+    lock_mutex(&wg->mutex);
+    while (__atomic_load_n(&wg->pending, __ATOMIC_ACQUIRE) != 0)
+        wait_cond(&wg->done, &wg->mutex);
+    unlock_mutex(&wg->mutex);
+}
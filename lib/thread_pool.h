@@ -0,0 +1,42 @@
+/*
+  A pool of worker threads for small tasks (see thread_pool.c), so that a
+  program with many short pieces of work pays for pthread_create() once
+  per worker rather than once per piece.
+
+  Tasks are submitted to a wait group, and wg_wait() returns once all of
+  a group's tasks have finished. A task may submit more tasks, to its own
+  group or another, and may wait for them; a worker that waits runs other
+  tasks meanwhile, so nested fork-join doesn't deadlock the pool.
+*/
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+
+typedef struct thread_pool thread_pool;
+
+typedef struct wait_group {
+    unsigned long pending;          // tasks submitted, not yet finished
+    pthread_mutex_t mutex;          // taken to finish the last of them
+    pthread_cond_t done;
+} wait_group;
+
+// 'nworkers' threads, or one per online CPU if 0
+thread_pool *tp_create(unsigned nworkers);
+
+// Waits for every task to finish, then stops the workers
+void tp_destroy(thread_pool *pool);
+
+unsigned tp_workers(thread_pool *pool);
+
+// Runs fn(arg) on some worker, as part of 'wg'
+void tp_submit(thread_pool *pool, wait_group *wg, void (*fn)(void *arg),
+               void *arg);
+
+void wg_init(wait_group *wg);
+void wg_destroy(wait_group *wg);
+
+// Returns once every task submitted to 'wg' has finished
+void wg_wait(thread_pool *pool, wait_group *wg);
+
+#endif